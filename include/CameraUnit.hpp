@@ -13,6 +13,7 @@
 
 #include "ImageData.hpp"
 #include <string>
+#include <functional>
 
 typedef struct
 {
@@ -22,6 +23,13 @@ typedef struct
     int y_max;
 } ROI;
 
+/**
+ * @brief Completion callback for asynchronous captures. Invoked on the
+ * capture thread with the captured image, which may be empty on error.
+ *
+ */
+typedef std::function<void(CImageData &)> CaptureCallback;
+
 const double INVALID_TEMPERATURE = -273.0;
 class CCameraUnit
 {
@@ -35,11 +43,55 @@ public:
      * @return CImageData Container with raw image data
      */
     virtual CImageData CaptureImage(long int &retryCount) = 0;
+    /**
+     * @brief Start capturing an image in the background and return immediately.
+     * The image is handed to the callback on completion, or can be collected
+     * with GetCapturedImage if no callback is set.
+     *
+     * @param callback [optional] Completion callback
+     * @return true if the capture was started
+     * @return false if the camera is not ready or a capture is in progress
+     */
+    virtual bool StartCapture(CaptureCallback callback = nullptr) = 0;
+    /**
+     * @brief Check if an asynchronous capture is in progress
+     *
+     * @return true
+     * @return false
+     */
+    virtual bool CaptureInProgress() const = 0;
+    /**
+     * @brief Collect the image of an asynchronous capture started without callback
+     *
+     * @param image Container for the captured image (output)
+     * @param timeoutMs Time to wait for the capture to complete in ms, 0 to poll, negative to wait indefinitely
+     * @return true if the capture completed and the image was retrieved
+     * @return false if no image is available yet
+     */
+    virtual bool GetCapturedImage(CImageData &image, int timeoutMs = 0) = 0;
     /**
      * @brief Cancel an ongoing capture
      * 
      */
     virtual void CancelCapture() = 0;
+    /**
+     * @brief Enable or disable streaming capture. While streaming, the detector
+     * exposes back to back and every call to CaptureImage returns the next frame,
+     * so the readout of one frame overlaps the exposure of the next. Cameras
+     * without hardware support keep capturing single exposures.
+     *
+     * @param enable Enable streaming
+     * @return true if frames are streamed by the hardware
+     * @return false if single exposures are used
+     */
+    virtual bool SetStreamingMode(bool enable) = 0;
+    /**
+     * @brief Check if hardware streaming capture is active
+     *
+     * @return true
+     * @return false
+     */
+    virtual bool IsStreaming() const = 0;
 
     /**
      * @brief Check if camera was initialized properly
@@ -14,6 +14,9 @@
 #include "CameraUnit.hpp"
 #include "AtikCameras.h"
 #include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <atomic>
 
 class CCameraUnit_ATIK : public CCameraUnit
 {
@@ -22,8 +25,9 @@ class CCameraUnit_ATIK : public CCameraUnit
 
     bool m_initializationOK;
     std::mutex cs_;
-    bool cancelCapture_;
-    std::string status_;
+    std::atomic<bool> cancelCapture_;
+    std::atomic<int> cameraState_;
+    std::atomic<int> downloadPercent_;
 
     bool hasshutter;
 
@@ -55,6 +59,49 @@ class CCameraUnit_ATIK : public CCameraUnit
 
     char cam_name[100];
 
+    enum StreamMode
+    {
+        STREAM_NONE = 0,   // single exposures
+        STREAM_OVERLAPPED, // overlapped exposures, next frame integrates during readout
+        STREAM_CONTINUOUS, // continuous exposing mode
+        STREAM_FAST        // fast mode, frames delivered through FastCallback
+    };
+
+    bool hasoverlap;
+    bool hascontinuous;
+    bool hasfast;
+
+    StreamMode streamMode_;
+    bool streamRunning_;
+    bool streamRearm_;
+    int streamExposureMs_;
+    uint64_t streamFrameStart_;
+
+    std::thread asyncThread_;
+    mutable std::mutex async_cs_;
+    std::condition_variable async_cv_;
+    bool asyncQuit_;
+    bool asyncRequested_;
+    bool asyncBusy_;
+    bool asyncReady_;
+    CaptureCallback asyncCallback_;
+    CImageData asyncImage_;
+
+    enum
+    {
+        READY_POLL_MIN_US = 100,    // first readiness poll interval
+        READY_POLL_MAX_US = 1000,   // readiness poll interval limit, frame pick-up latency
+        READY_WAIT_MAX_US = 1000000 // longest sleep during an exposure
+    };
+
+    std::mutex frame_cs_;
+    std::condition_variable frame_cv_;
+    int lastReadoutUs_;
+    bool fastReady_;
+    int fastBinX_;
+    int fastBinY_;
+    CImageData fastImage_;
+
 public:
     /**
      * @brief Construct a new Atik Camera Object. This will connect to the first available Atik camera.
@@ -68,7 +115,12 @@ public:
     ~CCameraUnit_ATIK();
 
     CImageData CaptureImage(long int &retryCount);
+    bool StartCapture(CaptureCallback callback = nullptr);
+    bool CaptureInProgress() const;
+    bool GetCapturedImage(CImageData &image, int timeoutMs = 0);
     void CancelCapture();
+    bool SetStreamingMode(bool enable);
+    inline bool IsStreaming() const { return streamMode_ != STREAM_NONE; }
 
     inline bool CameraReady() const { return m_initializationOK; }
     inline const char *CameraName() const { return cam_name; }
@@ -82,7 +134,7 @@ public:
     inline int GetBinningX() const { return binningX_; }
     inline int GetBinningY() const { return binningY_; }
     const ROI *GetROI() const;
-    inline std::string GetStatus() const { return status_; }
+    std::string GetStatus() const;
     inline int GetCCDWidth() const { return CCDWidth_; }
     inline int GetCCDHeight() const { return CCDHeight_; }
 
@@ -90,7 +142,12 @@ private:
     bool StatusIsIdle();
     void SetShutter(bool open);
     bool HasError(int error, unsigned int line) const;
-    int ArtemisGetCameraState(ArtemisHandle h);
+    CImageData Capture(long int &retryCount); // CaptureImage() without clearing a pending cancel
+    bool WaitImageReady(std::unique_lock<std::mutex> &lock, uint64_t &exposure_end);
+    static void FastCallback(ArtemisHandle handle, int x, int y, int w, int h, int binx, int biny, void *imageBuffer);
+    bool ArmStream(int exposure_ms);
+    void StopStream();
+    void AsyncCaptureThread();
 };
 
 #endif // __CAMERAUNIT_ATIK_HPP__
@@ -0,0 +1,97 @@
+/**
+ * @file FitsContainer.hpp
+ * @author Sunip K. Mukherjee (sunipkmukherjee@gmail.com)
+ * @brief Rolling multi-extension FITS file for frame sequences
+ * @version 0.1
+ * @date 2022-01-03
+ *
+ * @copyright Copyright (c) 2022
+ *
+ */
+#ifndef __FITSCONTAINER_HPP__
+#define __FITSCONTAINER_HPP__
+
+#include <stdint.h>
+#include <string>
+
+#include "ImageData.hpp"
+
+/**
+ * @brief Appends frames to a FITS file as tile compressed image extensions, one per
+ * frame with the header keywords SaveFits writes, instead of creating a file per frame.
+ * A new file, named after the timestamp of its first frame, is started when the current
+ * one would exceed the size, time span or frame count limit, or when the directory or
+ * file prefix changes. The file is flushed after every frame, so it is readable up to
+ * the last complete frame. The container is not MT-safe.
+ *
+ */
+class CFitsContainer
+{
+public:
+    /**
+     * @brief Construct a new FITS container. No file is created until the first frame.
+     *
+     * @param maxBytes File size limit in bytes, 0 for no limit (default: 1 GiB)
+     * @param maxSeconds Time span of the frames in a file in seconds, 0 for no limit (default: 3600 s)
+     * @param maxFrames Number of frames in a file, 0 for no limit (default)
+     */
+    CFitsContainer(uint64_t maxBytes = 1ULL << 30, int maxSeconds = 3600, int maxFrames = 0);
+    /**
+     * @brief Close the current file.
+     *
+     */
+    ~CFitsContainer();
+    /**
+     * @brief Append an image, starting a new file if needed.
+     *
+     * @param image Image
+     * @param dirPrefix Directory name, NULL for default
+     * @param filePrefix File name prefix, NULL for default
+     * @return bool true if the frame was written
+     */
+    bool Append(const CImageData &image, const char *dirPrefix = NULL, const char *filePrefix = NULL);
+    /**
+     * @brief Close the current file, the next frame starts a new one.
+     *
+     * @return bool false if the file could not be closed cleanly
+     */
+    bool Close();
+    /**
+     * @brief Get the name of the current file.
+     *
+     * @return const std::string& File name, empty if no file is open
+     */
+    const std::string &GetFileName() const { return fileName_; }
+    /**
+     * @brief Get the number of frames in the current file.
+     *
+     * @return int Number of frames
+     */
+    int GetFrameCount() const { return frames_; }
+    /**
+     * @brief Get the size of the current file.
+     *
+     * @return uint64_t Size in bytes
+     */
+    uint64_t GetFileSize() const { return bytes_; }
+
+private:
+    CFitsContainer(const CFitsContainer &) = delete;
+    CFitsContainer &operator=(const CFitsContainer &) = delete;
+
+    bool Open(const CImageData &image, const std::string &dir, const std::string &prefix);
+
+    void *fptr_; // fitsfile *, opaque so that users do not need fitsio.h
+    std::string fileName_;
+    std::string dir_;
+    std::string prefix_;
+    uint64_t maxBytes_;
+    int maxSeconds_;
+    int maxFrames_;
+    uint64_t firstTimestamp_; // timestamp of the first frame in the file
+    int frames_;              // frames in the file
+    uint64_t bytes_;          // size of the file
+    uint64_t lastFrameBytes_; // size of the last frame, to keep the next one under the limit
+};
+
+#endif // __FITSCONTAINER_HPP__
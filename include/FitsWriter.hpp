@@ -0,0 +1,228 @@
+/**
+ * @file FitsWriter.hpp
+ * @author Sunip K. Mukherjee (sunipkmukherjee@gmail.com)
+ * @brief Background FITS writer with a bounded write-behind queue
+ * @version 0.1
+ * @date 2022-01-03
+ *
+ * @copyright Copyright (c) 2022
+ *
+ */
+#ifndef __FITSWRITER_HPP__
+#define __FITSWRITER_HPP__
+
+#include <stdint.h>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "FitsContainer.hpp"
+#include "ImageData.hpp"
+
+/**
+ * @brief FITS writer statistics.
+ *
+ */
+typedef struct
+{
+    uint64_t submitted;  // frames accepted into the queue
+    uint64_t written;    // frames written
+    uint64_t failed;     // frames that could not be written
+    uint64_t dropped;    // frames dropped because the queue was full
+    int queued;          // frames waiting in the queue
+    int writing;         // frames being written or committed
+    int maxQueued;       // high water mark of the queue
+    double lastWriteMs;  // time taken by the last write
+    double maxWriteMs;   // longest write
+    uint64_t syncs;      // group commits
+    uint64_t synced;     // files made durable by group commits
+    uint64_t syncErrors; // files or directories that could not be synced
+    int unsynced;        // written files waiting for the next group commit
+    double lastSyncMs;   // time taken by the last group commit
+    double maxSyncMs;    // longest group commit
+} FitsWriterStats;
+
+/**
+ * @brief Writes images to FITS files on background threads, so that capture timing does
+ * not depend on disk latency. Images are taken over by move (or share their pixels
+ * copy-on-write when copied in) and queued; when the queue is full the policy decides
+ * whether Submit() waits for room or a frame is dropped. The writer is MT-safe.
+ *
+ */
+class CFitsWriter
+{
+public:
+    /**
+     * @brief What Submit() does when the queue is full
+     *
+     */
+    enum QueuePolicy
+    {
+        BLOCK = 0,   // wait until a frame has been taken off the queue
+        DROP_OLDEST, // drop the oldest queued frame to make room
+        DROP_NEWEST, // drop the submitted frame
+    };
+    /**
+     * @brief When written files are flushed to disk
+     *
+     */
+    enum DurabilityPolicy
+    {
+        DURABILITY_NONE = 0, // leave it to the kernel
+        DURABILITY_FILE,     // fdatasync every file and fsync its directory after writing it
+        DURABILITY_GROUP,    // fdatasync the files written since the last commit, then fsync their directories, every N files or T ms
+    };
+    /**
+     * @brief Called on a writer thread after every frame, with the image and whether it
+     * was written. Must not call back into the writer.
+     *
+     */
+    typedef std::function<void(const CImageData &image, bool ok)> Callback;
+    /**
+     * @brief Construct a new FITS writer and start its threads.
+     *
+     * @param maxQueued Maximum number of frames waiting to be written (default: 8)
+     * @param policy Queue full policy (default: BLOCK)
+     * @param numThreads Number of writer threads (default: 1)
+     */
+    CFitsWriter(int maxQueued = 8, QueuePolicy policy = BLOCK, int numThreads = 1);
+    /**
+     * @brief Write all queued frames and stop the writer threads.
+     *
+     */
+    ~CFitsWriter();
+    /**
+     * @brief Queue an image to be written with CImageData::SaveFits.
+     *
+     * @param image Image, pass with std::move to hand over the pixels
+     * @param filePrefix File name prefix, NULL for default
+     * @param dirPrefix Directory name, NULL for default
+     * @param filePrefixIsName Treat the file name prefix as file name
+     * @param i Image index
+     * @param n Out of n
+     * @return bool true if the frame was queued, false if it was dropped or the writer is stopped
+     */
+    bool Submit(CImageData image, const char *filePrefix = NULL, const char *dirPrefix = NULL, bool filePrefixIsName = false, int i = -1, int n = -1);
+    /**
+     * @brief Wait until all queued frames have been written, and commit any files waiting
+     * for a group commit.
+     *
+     */
+    void Flush();
+    /**
+     * @brief Write (drain = true) or discard the queued frames and stop the writer threads.
+     * Frames submitted afterwards are rejected.
+     *
+     * @param drain Write the queued frames first (default: true)
+     */
+    void Stop(bool drain = true);
+    /**
+     * @brief Set the queue full policy.
+     *
+     * @param policy Queue full policy
+     */
+    void SetPolicy(QueuePolicy policy);
+    /**
+     * @brief Set the function called after every frame.
+     *
+     * @param callback Callback, empty to disable
+     */
+    void SetCallback(Callback callback);
+    /**
+     * @brief Set when written files are flushed to disk. Only the written files and their
+     * directories are synced, never the whole system.
+     *
+     * @param policy Durability policy (default: DURABILITY_NONE)
+     * @param groupFiles Group commit after this many files (default: 16)
+     * @param groupMs Group commit this long after the oldest unsynced file was written (default: 1000 ms)
+     */
+    void SetDurability(DurabilityPolicy policy, int groupFiles = 16, int groupMs = 1000);
+    /**
+     * @brief Also save every frame as a JPEG image named after its timestamp, next to the
+     * FITS file, encoded on the writer thread.
+     *
+     * @param enable Enable the JPEG image
+     * @param maxDimension Size of the JPEG image on its longer side, 0 for full size
+     */
+    void SetJPEGDump(bool enable, int maxDimension = 0);
+    /**
+     * @brief Choose between Rice compressed files (SaveFits) and uncompressed files written
+     * through a memory mapping (SaveFitsUncompressed). Container files are always compressed.
+     *
+     * @param compress Compress the files (default: enabled)
+     */
+    void SetCompression(bool compress);
+    /**
+     * @brief Append frames as extensions to rolling multi-extension FITS files (see
+     * CFitsContainer) instead of writing a file per frame. The file name prefix of a frame
+     * is its container file's prefix; the index and count are not used. A frame that can not
+     * be appended is written to its own file instead.
+     *
+     * @param enable Enable container files
+     * @param maxBytes File size limit in bytes, 0 for no limit (default: 1 GiB)
+     * @param maxSeconds Time span of the frames in a file in seconds, 0 for no limit (default: 3600 s)
+     * @param maxFrames Number of frames in a file, 0 for no limit (default)
+     */
+    void SetContainer(bool enable, uint64_t maxBytes = 1ULL << 30, int maxSeconds = 3600, int maxFrames = 0);
+    /**
+     * @brief Close the current container file, the next frame starts a new one. Call
+     * Flush() first to include the queued frames.
+     *
+     */
+    void Rotate();
+    /**
+     * @brief Get writer statistics.
+     *
+     * @return FitsWriterStats
+     */
+    FitsWriterStats GetStats() const;
+
+private:
+    CFitsWriter(const CFitsWriter &) = delete;
+    CFitsWriter &operator=(const CFitsWriter &) = delete;
+
+    typedef struct
+    {
+        CImageData image;
+        std::string filePrefix;
+        std::string dirPrefix;
+        bool filePrefixIsName;
+        int i;
+        int n;
+    } Job;
+
+    void WriterThread();
+    bool Write(Job &job);
+    bool WriteContainer(Job &job, DurabilityPolicy durability, std::string &fileName);
+    bool GroupCommitDue() const;
+    void GroupCommit(std::unique_lock<std::mutex> &lock);
+
+    mutable std::mutex cs_;
+    std::condition_variable work_cv_;  // jobs queued or stopping
+    std::condition_variable room_cv_;  // room in the queue
+    std::condition_variable idle_cv_;  // queue empty and nothing being written
+    std::deque<Job> queue_;
+    std::vector<std::thread> threads_;
+    int maxQueued_;
+    QueuePolicy policy_;
+    bool stopping_;
+    DurabilityPolicy durability_;
+    int groupFiles_;
+    int groupMs_;
+    std::vector<std::string> unsynced_;               // files written since the last group commit
+    std::chrono::steady_clock::time_point groupStart_; // when the oldest of them was written
+    bool compress_;
+    bool jpegDump_;
+    int jpegMaxDimension_;
+    Callback callback_;
+    std::mutex containerLock_;   // serializes appends, taken before cs_
+    CFitsContainer *container_; // NULL for a file per frame
+    FitsWriterStats stats_;
+};
+
+#endif // __FITSWRITER_HPP__
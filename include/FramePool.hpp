@@ -0,0 +1,96 @@
+/**
+ * @file FramePool.hpp
+ * @author Sunip K. Mukherjee (sunipkmukherjee@gmail.com)
+ * @brief Recycling pool for large frame buffers
+ * @version 0.1
+ * @date 2022-01-03
+ *
+ * @copyright Copyright (c) 2022
+ *
+ */
+#ifndef __FRAMEPOOL_HPP__
+#define __FRAMEPOOL_HPP__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <map>
+#include <mutex>
+#include <vector>
+
+/**
+ * @brief Frame buffer pool statistics.
+ *
+ */
+typedef struct
+{
+    uint64_t hits;         // buffers served from the pool
+    uint64_t misses;       // buffers that had to be allocated
+    uint64_t returns;      // buffers returned to the pool for reuse
+    uint64_t releases;     // buffers freed because the pool was full
+    size_t cachedBuffers;  // buffers currently held by the pool
+    size_t cachedBytes;    // bytes currently held by the pool
+} FramePoolStats;
+
+/**
+ * @brief Process-wide pool of large, 64-byte aligned buffers keyed by size. Frames of
+ * the same geometry are recycled instead of going through the heap (and glibc's
+ * mmap/munmap path for large blocks) on every capture. The pool is MT-safe.
+ *
+ */
+class CFramePool
+{
+public:
+    /**
+     * @brief Get the frame buffer pool. The pool is never destroyed, so buffers can
+     * be returned from static object destructors.
+     *
+     * @return CFramePool&
+     */
+    static CFramePool &Instance();
+    /**
+     * @brief Get a buffer of the given size. Contents are undefined.
+     *
+     * @param size Size of buffer in bytes
+     * @return void* Buffer, NULL on allocation failure or zero size
+     */
+    void *Get(size_t size);
+    /**
+     * @brief Return a buffer obtained from Get() to the pool.
+     *
+     * @param buf Buffer, NULL is ignored
+     * @param size Size the buffer was requested with
+     */
+    void Put(void *buf, size_t size);
+    /**
+     * @brief Limit the number of cached buffers. Buffers returned beyond the limits
+     * are freed.
+     *
+     * @param maxPerSize Maximum number of cached buffers of a single size (default: 2)
+     * @param maxBytes Maximum number of bytes cached in total (default: 64 MiB)
+     */
+    void SetLimits(int maxPerSize, size_t maxBytes);
+    /**
+     * @brief Free all cached buffers.
+     *
+     */
+    void Clear();
+    /**
+     * @brief Get pool statistics.
+     *
+     * @return FramePoolStats
+     */
+    FramePoolStats GetStats() const;
+
+private:
+    CFramePool();
+    CFramePool(const CFramePool &) = delete;
+    CFramePool &operator=(const CFramePool &) = delete;
+
+    mutable std::mutex cs_;
+    std::map<size_t, std::vector<void *>> free_;
+    int maxPerSize_;
+    size_t maxBytes_;
+    FramePoolStats stats_;
+};
+
+#endif // __FRAMEPOOL_HPP__
@@ -18,8 +18,11 @@
 #include <BaseTsd.h>
 typedef SSIZE_T ssize_t;
 #endif
+#include <memory>
 #include <string>
 
+#include "PixelKernels.hpp"
+
 /**
  * @brief Image Data Statistics Storage Class
  *
@@ -85,10 +88,17 @@ class CImageData
 
     std::string m_cameraName;
 
-    unsigned short *m_imageData;
+    std::shared_ptr<unsigned short> m_pixels; // reference counted pixel store, shared between copies
+    unsigned short *m_imageData;              // m_pixels.get()
+
+    mutable std::shared_ptr<unsigned short> m_pyramid; // 2x, 4x and 8x reduced pixels, built on demand
 
-    unsigned char *m_jpegData;
+    std::shared_ptr<unsigned char> m_jpegData; // reference counted, kept alive by frames still being sent
+    int m_jpegBufSize;
     int sz_jpegData;
+    int m_jpegLevel;  // pyramid level the JPEG image is encoded from, 0 for full size
+    int m_jpegWidth;  // JPEG image width
+    int m_jpegHeight; // JPEG image height
 
     bool convert_jpeg;
 
@@ -96,6 +106,19 @@ class CImageData
     int pixelMin;
     int pixelMax;
     bool autoscale;
+    float autoscaleLow;
+    float autoscaleHigh;
+    bool jpegOverlay; // colour saturated and clipped pixels in the JPEG image
+    bool m_jpegMono;  // last JPEG image was encoded as grayscale
+    int toneCurve;
+    float toneParam;
+    int jpegThreads;
+    int fitsTileWidth;  // Rice compression tile width, 0 for the image width
+    int fitsTileHeight; // Rice compression tile height, 0 for the image height
+    int fitsThreads;    // threads compressing tiles, 0 for one per CPU core
+
+    mutable PixelStats m_stats; // cached single pass statistics of the pixels
+    mutable bool m_statsValid;
 
 public:
     /**
@@ -119,18 +142,35 @@ public:
     CImageData(int imageWidth, int imageHeight, unsigned short *imageData = NULL, float exposureTime = 0, int binX = 1, int binY = 1, float temperature = 0, uint64_t timestamp = 0, std::string cameraName = "", bool enableJpeg = false, int JpegQuality = 100, int pixelMin = -1, int pixelMax = -1, bool autoscale = true);
 
     /**
-     * @brief Construct a new CImageData object from another CImageData object
+     * @brief Construct a new CImageData object from another CImageData object. The pixel
+     * store is shared with rhs and copied on the first write to either object.
      *
      * @param rhs CImageData object
      */
     CImageData(const CImageData &rhs);
     /**
-     * @brief Check if two CImageData objects are equal
+     * @brief Construct a new CImageData object by taking over the pixels and JPEG data of
+     * another CImageData object, which is left empty.
+     *
+     * @param rhs CImageData object
+     */
+    CImageData(CImageData &&rhs);
+    /**
+     * @brief Assign from another CImageData object. The pixel store is shared with rhs
+     * and copied on the first write to either object.
      *
      * @param rhs
      * @return CImageData&
      */
     CImageData &operator=(const CImageData &rhs);
+    /**
+     * @brief Take over the pixels and JPEG data of another CImageData object, which is
+     * left empty.
+     *
+     * @param rhs
+     * @return CImageData&
+     */
+    CImageData &operator=(CImageData &&rhs);
 
     ~CImageData();
 
@@ -147,6 +187,17 @@ public:
      * @return false
      */
     bool HasData() const { return m_imageData != NULL; }
+    /**
+     * @brief Replace the pixels with a copy of raw image data. The existing pixel buffer
+     * is reused if it has the same size, a new one is not cleared since the copy
+     * overwrites it, so the copy is the only pass over the frame.
+     *
+     * @param imageWidth Width of image
+     * @param imageHeight Height of image
+     * @param imageData Pointer to image data
+     * @return true on success, false on invalid input
+     */
+    bool SetImageData(int imageWidth, int imageHeight, const unsigned short *imageData);
     /**
      * @brief Set metadata for the image
      *
@@ -159,12 +210,37 @@ public:
      */
     void SetImageMetadata(float exposureTime, int binX = 1, int binY = 1, float temperature = 0, uint64_t timestamp = 0, std::string cameraName = "");
     /**
-     * @brief Retrieve JPEG image corresponding to raw data
+     * @brief Retrieve JPEG image corresponding to raw data. With a maximum dimension the
+     * image is encoded from the smallest pyramid level that is still at least that large
+     * on its longer side, see GetPyramidLevel.
      *
      * @param ptr Pointer to JPEG image data
      * @param sz Size of JPEG image data
+     * @param maxDimension [optional] Size of the preview on its longer side, 0 for full size
+     */
+    void GetJPEGData(unsigned char *&ptr, int &sz, int maxDimension = 0);
+    /**
+     * @brief Retrieve JPEG image corresponding to raw data as a reference to the buffer, which
+     * stays valid after this object re-encodes, is reassigned or destroyed. Use it to hand
+     * the JPEG image to another thread (e.g. for transmission) without copying it.
+     *
+     * @param sz Size of JPEG image data
+     * @param maxDimension [optional] Size of the preview on its longer side, 0 for full size
+     * @return std::shared_ptr<const unsigned char> JPEG image data, empty if there is none
+     */
+    std::shared_ptr<const unsigned char> GetJPEGBuffer(int &sz, int maxDimension = 0);
+    /**
+     * @brief Get the width of the last JPEG image
+     *
+     * @return int Width in pixels
+     */
+    inline int GetJPEGWidth() const { return m_jpegWidth; }
+    /**
+     * @brief Get the height of the last JPEG image
+     *
+     * @return int Height in pixels
      */
-    void GetJPEGData(unsigned char *&ptr, int &sz);
+    inline int GetJPEGHeight() const { return m_jpegHeight; }
     /**
      * @brief Set quality of JPEG image
      *
@@ -172,9 +248,11 @@ public:
      */
     void SetJPEGQuality(int quality = 100)
     {
+        quality = quality < 0 ? 10 : quality;
+        quality = quality > 100 ? 100 : quality;
+        if (quality != JpegQuality)
+            convert_jpeg = false; // re-encode at the new quality
         JpegQuality = quality;
-        JpegQuality = JpegQuality < 0 ? 10 : JpegQuality;
-        JpegQuality = JpegQuality > 100 ? 100 : JpegQuality;
     }
     /**
      * @brief Set pixel scaling values for JPEG image conversion
@@ -193,12 +271,131 @@ public:
      * @param autoscale
      */
     void SetJPEGScaling(bool autoscale);
+    /**
+     * @brief Set the pixel percentiles used as dark and bright levels when the JPEG image
+     * is autoscaled. The default 0 and 100 scale between the darkest and brightest pixel.
+     *
+     * @param low Percentile for the dark level
+     * @param high Percentile for the bright level
+     */
+    void SetJPEGAutoscalePercentile(float low = 0, float high = 100);
+    /**
+     * @brief Enable/disable colouring of saturated (red) and clipped (orange) pixels in the
+     * JPEG image. Images without such pixels, or with the overlay disabled, are encoded as
+     * single channel grayscale JPEG.
+     *
+     * @param overlay Enable the colour overlay (default: enabled)
+     */
+    void SetJPEGSaturationOverlay(bool overlay) { jpegOverlay = overlay; }
+    /**
+     * @brief Check if the JPEG image was encoded as grayscale.
+     *
+     * @return bool
+     */
+    inline bool IsJPEGMono() const { return m_jpegMono; }
+    /**
+     * @brief Tone curves for the 16 bit to 8 bit JPEG conversion
+     *
+     */
+    enum JPEGToneCurve
+    {
+        JPEG_TONE_LINEAR = 0, // linear between the dark and bright levels
+        JPEG_TONE_GAMMA,      // t^(1/gamma)
+        JPEG_TONE_ASINH,      // asinh(beta t) / asinh(beta)
+    };
+    /**
+     * @brief Set the tone curve applied between the dark and bright levels of the JPEG
+     * image. The curve is tabulated, so all curves cost the same.
+     *
+     * @param curve Tone curve
+     * @param param Gamma (default 2.2) or asinh stretch beta (default 10), 0 for default
+     */
+    void SetJPEGToneCurve(JPEGToneCurve curve, float param = 0);
+    /**
+     * @brief Set the number of threads encoding the JPEG image. The image is split into
+     * horizontal strips joined with JPEG restart markers.
+     *
+     * @param threads Number of threads, 0 for one per CPU core (default)
+     */
+    void SetJPEGThreads(int threads) { jpegThreads = threads < 0 ? 0 : threads; }
+    /**
+     * @brief Set the tiles SaveFits Rice compresses the image in. Tiles are compressed in
+     * parallel, so more tiles spread the work over more threads; smaller tiles compress
+     * slightly worse.
+     *
+     * @param tileWidth Tile width, 0 for the image width (default)
+     * @param tileHeight Tile height, 0 for the image height (default: 1, one tile per row)
+     * @param threads Number of threads, 0 for one per CPU core (default)
+     */
+    void SetFitsCompression(int tileWidth, int tileHeight, int threads = 0)
+    {
+        fitsTileWidth = tileWidth < 0 ? 0 : tileWidth;
+        fitsTileHeight = tileHeight < 0 ? 0 : tileHeight;
+        fitsThreads = threads < 0 ? 0 : threads;
+    }
     /**
      * @brief Get statistics on image data
      *
      * @return ImageStats Statistics data container
      */
     ImageStats GetStats() const;
+    /**
+     * @brief Number of bins of a pixel histogram, one per pixel value
+     *
+     */
+    enum
+    {
+        HISTOGRAM_BINS = 0x10000
+    };
+    /**
+     * @brief Build the pixel histogram in a single pass over the image.
+     *
+     * @param hist Histogram output, HISTOGRAM_BINS entries
+     * @param step Sample every step-th pixel of every step-th row (default: 1, all pixels)
+     * @param numThreads Number of threads building partial histograms (default: 1)
+     * @return bool false if there is no image data
+     */
+    bool GetHistogram(uint32_t *hist, int step = 1, int numThreads = 1) const;
+    /**
+     * @brief Get exact pixel percentiles from the histogram. The value of percentile p is
+     * the pixel of rank floor(p * (N - 1) / 100) among the N sampled pixels in ascending
+     * order, or the brightest pixel above 99.99.
+     *
+     * @param percentiles Percentiles, 0 to 100
+     * @param values Pixel values (output)
+     * @param count Number of percentiles
+     * @param step Sample every step-th pixel of every step-th row (default: 1, all pixels)
+     * @return bool false if there is no image data
+     */
+    bool GetPercentiles(const float *percentiles, uint16_t *values, int count, int step = 1) const;
+    /**
+     * @brief Get an exact pixel percentile from the histogram, see GetPercentiles.
+     *
+     * @param percentile Percentile, 0 to 100
+     * @param step Sample every step-th pixel of every step-th row (default: 1, all pixels)
+     * @return uint16_t Pixel value, 0 if there is no image data
+     */
+    uint16_t GetPercentile(float percentile, int step = 1) const;
+    /**
+     * @brief Number of reduced levels in the image pyramid
+     *
+     */
+    enum
+    {
+        PYRAMID_LEVELS = 3
+    };
+    /**
+     * @brief Get a 2^level times reduced copy of the image, each pixel the rounded average
+     * of a 2^level x 2^level block. All levels are built together in one pass over the
+     * image on the first call after the pixels change.
+     *
+     * @param level 1 to PYRAMID_LEVELS, 0 for the image itself
+     * @param width Width of the level (output)
+     * @param height Height of the level (output)
+     * @return const unsigned short* Pixels of the level, NULL if there is no image data or
+     * the image is too small for the level
+     */
+    const unsigned short *GetPyramidLevel(int level, int &width, int &height) const;
     /**
      * @brief Get the pointer to image data
      *
@@ -208,9 +405,29 @@ public:
     /**
      * @brief Get the pointer to image data
      *
-     * @return unsigned short* const
+     * @return unsigned short* const NULL if the pixels are shared and could not be copied
      */
-    unsigned short *const GetImageData() { return m_imageData; }
+    unsigned short *const GetImageData()
+    {
+        if (!Detach())
+            return NULL;
+        m_statsValid = false; // caller may modify the pixels
+        m_pyramid.reset();
+        return m_imageData;
+    }
+    /**
+     * @brief Give this object its own copy of the pixel store if it is shared with
+     * other CImageData objects. Called before any write to the pixels.
+     *
+     * @return bool false if the copy could not be allocated, the pixels must not be written then
+     */
+    bool Detach();
+    /**
+     * @brief Check if the pixel store is shared with other CImageData objects.
+     *
+     * @return bool
+     */
+    inline bool IsShared() const { return m_pixels && m_pixels.use_count() > 1; }
     /**
      * @brief Stack data from another image
      *
@@ -240,7 +457,7 @@ public:
      * @param maxAllowedBin Maximum allowed binning (input, default: 4)
      * @param numPixelExclusion Number of pixels to be excluded from calculation (input, default: 100)
      * @param pixelTargetUncertainty Value target uncertainty (inpit, default: 5000)
-     * @return bool Returns true.
+     * @return bool Returns true, false if there is no image data.
      */
     bool FindOptimumExposure(float &targetExposure, int &bin, float percentilePixel = 80, int pixelTarget = 40000, float maxAllowedExposure = 10.0, int maxAllowedBin = 4, int numPixelExclusion = 100, int pixelTargetUncertainty = 5000);
     /**
@@ -252,11 +469,12 @@ public:
      * @param maxAllowedExposure aximum allowed exposure time (input, default: 10 s)
      * @param numPixelExclusion Number of pixels to be excluded from calculation (input, default: 100)
      * @param pixelTargetUncertainty Value target uncertainty (inpit, default: 5000)
-     * @return bool Returns true.
+     * @return bool Returns true, false if there is no image data.
      */
     bool FindOptimumExposure(float &targetExposure, float percentilePixel = 80, int pixelTarget = 40000, float maxAllowedExposure = 10.0, int numPixelExclusion = 100, int pixelTargetUncertainty = 5000);
     /**
-     * @brief Save image contained in CImageData
+     * @brief Save image contained in CImageData as a RICE_1 tile compressed FITS image,
+     * with the tiles set by SetFitsCompression() compressed in parallel
      *
      * @param filePrefix File name prefix
      * @param DirPrefix Directory name
@@ -265,8 +483,57 @@ public:
      * @param n Out of n
      * @param outString Status output string pointer
      * @param outStringSz Status output string max size
+     * @param syncOnWrite Flush the file's data and directory entry to disk after writing
+     * @return bool true if the file was written, false otherwise.
      */
-    void SaveFits(char *filePrefix, char *DirPrefix, bool filePrefixIsName = false, int i = -1, int n = -1, char *outString = NULL, ssize_t outStringSz = 0, bool syncOnWrite = false);
+    bool SaveFits(const char *filePrefix, const char *DirPrefix, bool filePrefixIsName = false, int i = -1, int n = -1, char *outString = NULL, ssize_t outStringSz = 0, bool syncOnWrite = false);
+    /**
+     * @brief Save the image as an uncompressed FITS file without going through cfitsio:
+     * the file is preallocated and memory mapped, the header is written into it and the
+     * pixels are offset and byte swapped straight into the mapping in one vectorized pass.
+     * Arguments are the same as SaveFits.
+     *
+     * @param filePrefix File name prefix
+     * @param DirPrefix Directory name
+     * @param filePrefixIsName File name prefix is the file name
+     * @param i Image index
+     * @param n Out of n
+     * @param outString Status output string pointer
+     * @param outStringSz Status output string max size
+     * @param syncOnWrite Flush the file's data and directory entry to disk after writing
+     * @return bool true if the file was written, false otherwise.
+     */
+    bool SaveFitsUncompressed(const char *filePrefix, const char *DirPrefix, bool filePrefixIsName = false, int i = -1, int n = -1, char *outString = NULL, ssize_t outStringSz = 0, bool syncOnWrite = false);
+    /**
+     * @brief Append the image to an open FITS file as a RICE_1 tile compressed image
+     * extension, with the same header keywords SaveFits writes.
+     *
+     * @param fitsFile cfitsio file handle (fitsfile *)
+     * @param status cfitsio status, nothing is written if it is set on entry
+     * @return bool true if the extension was written
+     */
+    bool WriteFitsHDU(void *fitsFile, int &status) const;
+    /**
+     * @brief Get the name of the file SaveFits writes with the same arguments
+     *
+     * @param fileName Output file name
+     * @param fileNameSz Size of the file name buffer
+     * @param filePrefix File name prefix
+     * @param DirPrefix Directory name
+     * @param filePrefixIsName File name prefix is the file name
+     * @param i Image index
+     * @param n Out of n
+     * @return bool false if the name does not fit or the arguments are invalid.
+     */
+    bool GetFitsFileName(char *fileName, size_t fileNameSz, const char *filePrefix, const char *DirPrefix, bool filePrefixIsName = false, int i = -1, int n = -1) const;
+    /**
+     * @brief Flush a file, or a directory entry, to disk without syncing the whole system
+     *
+     * @param path File or directory path
+     * @param dataOnly Flush the file data only (fdatasync), use false for directories (fsync)
+     * @return bool true on success
+     */
+    static bool SyncFile(const char *path, bool dataOnly = true);
     /**
      * @brief Get the image height
      * 
@@ -334,6 +601,19 @@ private:
      * @return uint16_t
      */
     uint16_t DataMax();
+    /**
+     * @brief Get the pixel statistics, computed in a single pass over the image on the
+     * first call after the pixels change.
+     *
+     * @return const PixelStats&
+     */
+    const PixelStats &Stats() const;
+    /**
+     * @brief Number of pyramid levels the image is large enough for.
+     *
+     * @return int 0 to PYRAMID_LEVELS
+     */
+    int PyramidLevels() const;
 };
 
 #endif // __IMAGEDATA_HPP__
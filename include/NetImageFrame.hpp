@@ -0,0 +1,167 @@
+/**
+ * @file NetImageFrame.hpp
+ * @author Sunip K. Mukherjee (sunipkmukherjee@gmail.com)
+ * @brief Image frame sent to the controller without copying the image data
+ * @version 0.1
+ * @date 2022-01-03
+ *
+ * @copyright Copyright (c) 2022
+ *
+ */
+#ifndef __NETIMAGEFRAME_HPP__
+#define __NETIMAGEFRAME_HPP__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <memory>
+#include <vector>
+
+#include "ImageData.hpp"
+
+/**
+ * @brief Network Image Metadata
+ *
+ * @return typedef struct
+ */
+typedef struct __attribute__((packed))
+{
+    uint16_t x;
+    uint16_t y;
+    uint16_t width;
+    uint16_t height;
+    int32_t temperature;
+    uint32_t exposure_ms;
+    uint64_t tstamp;
+    int32_t type;
+    int32_t size;
+} netimg_meta;
+
+typedef enum
+{
+    JPEGMONO = 15,
+    JPEGRGBA = 20,
+    JPEGRGB = 25,
+    RAW8 = 30,
+    RAW16 = 35,
+    RICE16 = 40 // 16-bit pixels in Rice coded chunks of rows, see netimg_chunk
+} netimg_type;
+
+/**
+ * @brief Header of a chunk of rows of a RICE16 image. The image metadata (size: width x
+ * height x 2) is followed by chunks covering the image top to bottom, each a header and
+ * the rows Rice coded as one RICE_1 tile (BLOCKSIZE 32, pixels offset by -32768).
+ *
+ * @return typedef struct
+ */
+typedef struct __attribute__((packed))
+{
+    uint16_t y;    // first row
+    uint16_t rows; // number of rows
+    uint32_t size; // coded size in bytes
+} netimg_chunk;
+
+/**
+ * @brief An image on its way to the controller: the metadata followed by the image data,
+ * the same byte layout as a netimg_meta copied in front of the data. The data is not
+ * copied; the frame holds a reference to the buffer it came from (e.g. the JPEG buffer
+ * or the pixels of a CImageData) until the frame is destroyed, and Send() writes the
+ * metadata and the data with scatter/gather calls.
+ *
+ * Image stream protocol: Send() writes the frame as it is, without the NetFrame header
+ * and trailer of the command link, so frames go over a stream socket of their own and
+ * follow each other back to back. Controllers read them with Receive(). Frames sent over
+ * the command link as NetFrame payload use the same layout inside the NetFrame.
+ *
+ * Raw frames carry the 16-bit pixels, either as they are (RAW16) or Rice coded (RICE16).
+ * A RICE16 frame is coded in chunks of rows while it is being sent: worker threads code
+ * the next chunks while the calling thread sends the finished ones.
+ *
+ */
+class CNetImageFrame
+{
+public:
+    /**
+     * @brief Construct a new frame from metadata and data.
+     *
+     * @param meta Metadata, meta.size is the size of the data
+     * @param data Data, meta.size bytes
+     */
+    CNetImageFrame(const netimg_meta &meta, std::shared_ptr<const uint8_t> data);
+    /**
+     * @brief Construct a new frame carrying the JPEG image of an image.
+     *
+     * @param image Image, encoded to JPEG if it is not already
+     * @param maxDimension Size of the JPEG image on its longer side, 0 for full size (default)
+     */
+    CNetImageFrame(CImageData &image, int maxDimension = 0);
+    /**
+     * @brief Construct a new frame carrying the pixels of an image, sharing them with it.
+     *
+     * @param type RAW16 to send the pixels as they are, RICE16 to Rice code them; other types give a frame without data
+     * @param image Image
+     * @param chunkRows Rows per coded chunk (default: 64)
+     * @param numThreads Threads coding chunks, 0 for one per CPU core (default)
+     */
+    CNetImageFrame(netimg_type type, const CImageData &image, int chunkRows = 64, int numThreads = 0);
+    /**
+     * @brief Check if the frame has data to send.
+     *
+     * @return bool
+     */
+    bool HasData() const { return (data_ != nullptr || image_.HasData()) && meta_.size > 0; }
+    /**
+     * @brief Get the metadata.
+     *
+     * @return const netimg_meta&
+     */
+    const netimg_meta &GetMetadata() const { return meta_; }
+    /**
+     * @brief Get the size of the frame on the wire. For RICE16 frames, the size before coding.
+     *
+     * @return size_t Metadata and data size in bytes
+     */
+    size_t GetSize() const { return sizeof(netimg_meta) + (meta_.size > 0 ? meta_.size : 0); }
+    /**
+     * @brief Decode a chunk of a RICE16 frame into the image.
+     *
+     * @param chunk Chunk header
+     * @param data Coded rows, chunk.size bytes
+     * @param width Image width
+     * @param height Image height
+     * @param pixels Image pixels, width x height
+     * @return bool false if the chunk is outside the image or corrupt
+     */
+    static bool DecodeChunk(const netimg_chunk &chunk, const uint8_t *data, int width, int height, uint16_t *pixels);
+    /**
+     * @brief Write the frame to a stream socket (or pipe). Short writes are resumed, and on
+     * a non-blocking socket the call waits for it to become writable.
+     *
+     * @param fd Socket
+     * @param timeout_ms Time to wait for the socket to become writable in ms, negative to wait indefinitely (default: 1000 ms)
+     * @return bool false if the frame was not sent completely
+     */
+    bool Send(int fd, int timeout_ms = 1000) const;
+    /**
+     * @brief Read a frame written by Send() from a stream socket (or pipe). JPEG and RAW16
+     * data is returned as sent; the chunks of a RICE16 frame are decoded into the 16-bit
+     * pixels (width x height), and the metadata keeps the RICE16 type.
+     *
+     * @param fd Socket
+     * @param meta Metadata (output)
+     * @param data Image data, meta.size bytes (output)
+     * @param timeout_ms Time to wait for data in ms, negative to wait indefinitely (default: 1000 ms)
+     * @return bool false on timeout, error, end of stream or a malformed frame
+     */
+    static bool Receive(int fd, netimg_meta &meta, std::vector<uint8_t> &data, int timeout_ms = 1000);
+
+private:
+    bool SendChunks(int fd, int timeout_ms) const;
+
+    netimg_meta meta_;
+    std::shared_ptr<const uint8_t> data_;
+    CImageData image_; // raw frames, shares the pixels
+    int chunkRows_;
+    int numThreads_;
+};
+
+#endif // __NETIMAGEFRAME_HPP__
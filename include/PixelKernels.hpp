@@ -0,0 +1,95 @@
+/**
+ * @file PixelKernels.hpp
+ * @author Sunip K. Mukherjee (sunipkmukherjee@gmail.com)
+ * @brief Vectorized kernels for 16-bit pixel data
+ * @version 0.1
+ * @date 2022-01-03
+ *
+ * @copyright Copyright (c) 2022
+ *
+ */
+#ifndef __PIXELKERNELS_HPP__
+#define __PIXELKERNELS_HPP__
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * @brief Raw pixel statistics, accumulated exactly in integer arithmetic.
+ *
+ */
+typedef struct
+{
+    uint16_t min;   // minimum pixel value
+    uint16_t max;   // maximum pixel value
+    uint64_t sum;   // sum of pixel values
+    uint64_t sumsq; // sum of squared pixel values
+} PixelStats;
+
+/**
+ * @brief Compute min, max, sum and sum of squares of 16-bit pixels in a single pass.
+ * The kernel is selected at compile time: AVX2 or SSE2 on x86, NEON on ARM, with a
+ * scalar fallback.
+ *
+ * @param data Pixel data
+ * @param count Number of pixels
+ * @param stats Output statistics, min = 0xffff and max = 0 for zero pixels
+ */
+void PixelStatsU16(const uint16_t *data, size_t count, PixelStats &stats);
+
+/**
+ * @brief Bin 16-bit pixels by summing binX x binY blocks, saturating at 0xffff. Sums
+ * are accumulated per output row in 32 bits; 2x2, 3x3 and 4x4 use specialized kernels.
+ * Source pixels past the last full block in a row or column are dropped.
+ *
+ * @param src Source pixels, width x height
+ * @param width Source width
+ * @param height Source height
+ * @param binX Horizontal bin factor, >= 1
+ * @param binY Vertical bin factor, >= 1
+ * @param dst Binned pixels, (width / binX) x (height / binY)
+ */
+void PixelBinU16(const uint16_t *src, int width, int height, int binX, int binY, uint16_t *dst);
+
+/**
+ * @brief Average 2x2 blocks of two source rows into one row, rounding to nearest.
+ *
+ * @param row0 First source row, at least 2 * newWidth pixels
+ * @param row1 Second source row, at least 2 * newWidth pixels
+ * @param newWidth Number of output pixels
+ * @param dst Output row
+ */
+void PixelHalveRowU16(const uint16_t *row0, const uint16_t *row1, int newWidth, uint16_t *dst);
+
+/**
+ * @brief Build a pyramid of 2x, 4x, 8x ... box-averaged copies of an image in a single
+ * pass over the source. Every level is the 2x2 average of the level above it, and its
+ * rows are produced as soon as the two rows above them exist, so the smaller levels are
+ * built from rows still in cache.
+ *
+ * @param src Source pixels, width x height
+ * @param width Source width
+ * @param height Source height
+ * @param levels Number of levels, (width >> levels) and (height >> levels) must be >= 1
+ * @param dst Output levels, dst[k] holds (width >> (k + 1)) x (height >> (k + 1)) pixels
+ */
+void PixelPyramidU16(const uint16_t *src, int width, int height, int levels, uint16_t *const *dst);
+
+/**
+ * @brief Convert 16-bit pixels to FITS BITPIX = 16, BZERO = 32768 data: offset to signed
+ * (x - 32768) and stored big endian, in a single pass.
+ *
+ * @param src Source pixels
+ * @param count Number of pixels
+ * @param dst Output, 2 * count bytes, need not be aligned
+ */
+void PixelToFitsU16(const uint16_t *src, size_t count, uint8_t *dst);
+
+/**
+ * @brief Name of the instruction set the pixel kernels were built for.
+ *
+ * @return const char* "avx2", "sse2", "neon" or "scalar"
+ */
+const char *PixelKernelsISA();
+
+#endif // __PIXELKERNELS_HPP__
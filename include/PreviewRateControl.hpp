@@ -0,0 +1,169 @@
+/**
+ * @file PreviewRateControl.hpp
+ * @author Sunip K. Mukherjee (sunipkmukherjee@gmail.com)
+ * @brief Bandwidth-adaptive rate control of preview frames sent to a client
+ * @version 0.1
+ * @date 2022-01-03
+ *
+ * @copyright Copyright (c) 2022
+ *
+ */
+#ifndef __PREVIEWRATECONTROL_HPP__
+#define __PREVIEWRATECONTROL_HPP__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <mutex>
+
+#include "ImageData.hpp"
+#include "NetImageFrame.hpp"
+
+/**
+ * @brief Preview rate controller statistics.
+ *
+ */
+typedef struct
+{
+    uint64_t offered;    // frames offered to ShouldSend()
+    uint64_t skipped;    // frames skipped to keep to the rate or latency target
+    uint64_t sent;       // frames sent
+    uint64_t dropped;    // frames dropped from the transmit queue
+    int quality;         // current JPEG quality
+    int scale;           // current downscale, the preview is reduced 2^scale times
+    int intervalMs;      // current minimum time between frames
+    uint64_t rateBps;    // estimated link throughput, bits per second
+    uint32_t frameBytes; // estimated size of a frame at the current settings
+    int latencyMs;       // estimated time from capture to delivery of the last frame
+} PreviewRateStats;
+
+/**
+ * @brief Adapts the preview stream of one client to its link. The controller measures the
+ * throughput and the capture to delivery latency of the frames that are sent, and sets the
+ * JPEG quality, the preview downscale and the minimum time between frames so that the
+ * stream stays within the target bitrate and latency. Frames are skipped at the source
+ * rather than queued, so a slow link shows recent frames less often instead of old ones.
+ *
+ * The capture thread asks ShouldSend() for every frame and calls Prepare() before building
+ * the frame; the transmit thread sends frames with SendFrame(), or reports them with
+ * FrameSent(), and reports frames dropped from the queue with FrameDropped(). Use one
+ * controller per client. The controller is MT-safe.
+ *
+ */
+class CPreviewRateControl
+{
+public:
+    /**
+     * @brief Construct a new preview rate controller.
+     *
+     * @param targetBitrate Maximum bitrate of the preview stream in bits per second (default: 2 Mbit/s)
+     * @param targetLatencyMs Maximum time from capture to delivery in ms (default: 2000 ms)
+     * @param targetIntervalMs Desired time between frames in ms (default: 1000 ms)
+     */
+    CPreviewRateControl(uint64_t targetBitrate = 2000000, int targetLatencyMs = 2000, int targetIntervalMs = 1000);
+    /**
+     * @brief Set the targets.
+     *
+     * @param targetBitrate Maximum bitrate of the preview stream in bits per second
+     * @param targetLatencyMs Maximum time from capture to delivery in ms
+     * @param targetIntervalMs Desired time between frames in ms
+     */
+    void SetTarget(uint64_t targetBitrate, int targetLatencyMs, int targetIntervalMs);
+    /**
+     * @brief Set the range the JPEG quality is adjusted in.
+     *
+     * @param minQuality Lowest quality (default: 30)
+     * @param maxQuality Highest quality (default: 90)
+     */
+    void SetQualityRange(int minQuality = 30, int maxQuality = 90);
+    /**
+     * @brief Set the largest downscale of the preview.
+     *
+     * @param maxScale The preview is reduced at most 2^maxScale times, 0 - 3 (default: 3)
+     */
+    void SetMaxScale(int maxScale = 3);
+    /**
+     * @brief Decide if a frame captured now should be sent. Frames are skipped to keep the
+     * time between frames the link needs at the current settings, and while the previous
+     * frame is still waiting to be sent.
+     *
+     * @param nowMs Current time in ms
+     * @return bool true if the frame should be sent, it then counts as queued until FrameSent() or FrameDropped()
+     */
+    bool ShouldSend(uint64_t nowMs);
+    /**
+     * @brief Apply the current JPEG quality to an image, and get the preview size to
+     * encode it at.
+     *
+     * @param image Image
+     * @return int Size of the preview on its longer side for GetJPEGData() or CNetImageFrame, 0 for full size
+     */
+    int Prepare(CImageData &image);
+    /**
+     * @brief Send a frame and report it.
+     *
+     * @param frame Frame
+     * @param fd Socket
+     * @param timeout_ms Time to wait for the socket to become writable in ms (default: 1000 ms)
+     * @return bool false if the frame was not sent completely
+     */
+    bool SendFrame(const CNetImageFrame &frame, int fd, int timeout_ms = 1000);
+    /**
+     * @brief Report a frame that was sent.
+     *
+     * @param bytes Size of the frame
+     * @param captureMs Capture timestamp of the frame in ms
+     * @param sendStartMs Time the send started in ms
+     * @param sendEndMs Time the send completed in ms
+     * @param unsentBytes Bytes still in the socket send buffer after the send, if known (default: 0)
+     */
+    void FrameSent(size_t bytes, uint64_t captureMs, uint64_t sendStartMs, uint64_t sendEndMs, size_t unsentBytes = 0);
+    /**
+     * @brief Report a frame that was dropped from the transmit queue or failed to send.
+     *
+     */
+    void FrameDropped();
+    /**
+     * @brief Get the JPEG quality for the next frame.
+     *
+     * @return int Quality in %
+     */
+    int GetQuality() const;
+    /**
+     * @brief Get the preview downscale for the next frame.
+     *
+     * @return int The preview is reduced 2^scale times
+     */
+    int GetScale() const;
+    /**
+     * @brief Get the controller statistics.
+     *
+     * @return PreviewRateStats
+     */
+    PreviewRateStats GetStats() const;
+
+private:
+    void StepDown();
+    void StepUp(int needMs);
+
+    mutable std::mutex cs_;
+    uint64_t targetBitrate_;
+    int targetLatencyMs_;
+    int targetIntervalMs_;
+    int minQuality_;
+    int maxQuality_;
+    int maxScale_;
+    int quality_;
+    int scale_;
+    int intervalMs_;      // minimum time between frames
+    uint64_t lastSendMs_; // time of the last frame ShouldSend() let through
+    int inFlight_;        // frames let through and not yet sent or dropped
+    double rateBps_;      // throughput estimate, 0 until measured
+    double frameBits_;    // frame size estimate at the current settings, 0 until measured
+    int latencyMs_;
+    int holdFrames_;      // frames to measure before the next adjustment
+    size_t lastUnsent_;   // bytes in the socket send buffer at the last report
+    uint64_t lastReportMs_;
+    PreviewRateStats stats_;
+};
+
+#endif // __PREVIEWRATECONTROL_HPP__
@@ -12,11 +12,21 @@
 #ifndef _PROT_QUEUE_HPP_
 #define _PROT_QUEUE_HPP_
 
+#include <stddef.h>
+#include <chrono>
+#include <condition_variable>
 #include <mutex>
 #include <queue>
+#include <utility>
 
 /**
  * @brief Wrapper around std::queue (FIFO) to ensure thread safety. Standard std::queue functions apply.
+ * Consumers can sleep until an item arrives (wait_pop) and drain several items per lock acquisition
+ * (pop_bulk). The queue can be bounded, in which case a push into a full queue blocks, drops the
+ * oldest item or is rejected. close() wakes all waiting threads for shutdown.
+ * 
+ * This is the general purpose locking queue, for queues of any length and consumers that block.
+ * The image transmit path uses the bounded lock-free RingQueue instead.
  * 
  * @tparam T Template type
  */
@@ -24,55 +34,74 @@ template <class T>
 class ProtQueue
 {
 public:
+    /**
+     * @brief Behavior of a push into a full queue.
+     * 
+     */
+    enum Policy
+    {
+        BLOCK,       // wait for room
+        DROP_OLDEST, // remove the object at the front of the queue
+        REJECT,      // do not push
+    };
     /**
      * @brief Construct a new empty protected queue.
      * 
+     * @param maxSize Maximum number of objects, 0 for no limit (default)
+     * @param policy Behavior of a push into a full queue (default: BLOCK)
      */
-    ProtQueue()
+    ProtQueue(size_t maxSize = 0, Policy policy = BLOCK) : maxSize_(maxSize), policy_(policy), closed_(false)
     {
     }
     /**
      * @brief Construct a new protected queue from another protected queue.
      * 
-     * @param other 
+     * @param other
      */
     ProtQueue(const ProtQueue &other)
     {
+        std::lock_guard<std::mutex> lock(other.cs_);
         q_ = other.q_;
+        maxSize_ = other.maxSize_;
+        policy_ = other.policy_;
+        closed_ = other.closed_;
     }
     /**
      * @brief Construct a new protected queue from reference of another protected queue.
      * 
-     * @param other 
+     * @param other
      */
     ProtQueue(ProtQueue &&other)
     {
-        q_ = other->q_;
+        std::lock_guard<std::mutex> lock(other.cs_);
+        q_ = std::move(other.q_);
+        maxSize_ = other.maxSize_;
+        policy_ = other.policy_;
+        closed_ = other.closed_;
+        other.not_full_.notify_all();
     }
     /**
      * @brief Construct a new protected queue from a standard queue.
      * 
-     * @param other 
+     * @param other
      */
-    ProtQueue(std::queue<T> &other)
+    ProtQueue(std::queue<T> &other) : q_(other), maxSize_(0), policy_(BLOCK), closed_(false)
     {
-        q_ = other;
     }
     /**
      * @brief Construct a new protected queue from a reference to a standard queue.
      * 
-     * @param other 
+     * @param other
      */
-    ProtQueue(std::queue<T> &&other)
+    ProtQueue(std::queue<T> &&other) : q_(std::move(other)), maxSize_(0), policy_(BLOCK), closed_(false)
     {
-        q_ = other;
     }
     /**
      * @brief Check if the queue is empty.
      * 
      * @return bool
      */
-    bool empty()
+    bool empty() const
     {
         std::lock_guard<std::mutex> lock(cs_);
         return q_.empty();
@@ -80,29 +109,45 @@ public:
     /**
      * @brief Return current size of the queue
      * 
-     * @return size_t 
+     * @return size_t
      */
-    size_t size()
+    size_t size() const
     {
         std::lock_guard<std::mutex> lock(cs_);
         return q_.size();
     }
     /**
-     * @brief Return a reference to the object at the front of the queue (FIFO)
+     * @brief Set the maximum size of the queue and the behavior of a push into a full queue.
+     * Objects already in the queue are kept.
      * 
-     * @return const T& 
+     * @param maxSize Maximum number of objects, 0 for no limit
+     * @param policy Behavior of a push into a full queue
      */
-    const T &front() const
+    void SetLimit(size_t maxSize, Policy policy = BLOCK)
+    {
+        std::lock_guard<std::mutex> lock(cs_);
+        maxSize_ = maxSize;
+        policy_ = policy;
+        not_full_.notify_all();
+    }
+    /**
+     * @brief Return a copy of the object at the front of the queue (FIFO). The queue must
+     * not be empty.
+     * 
+     * @return T
+     */
+    T front() const
     {
         std::lock_guard<std::mutex> lock(cs_);
         return q_.front();
     }
     /**
-     * @brief Return a reference to the object at the rear of the queue (FIFO)
+     * @brief Return a copy of the object at the rear of the queue (FIFO). The queue must
+     * not be empty.
      * 
-     * @return const T& 
+     * @return T
      */
-    const T &back() const
+    T back() const
     {
         std::lock_guard<std::mutex> lock(cs_);
         return q_.back();
@@ -110,37 +155,48 @@ public:
     /**
      * @brief Push a new object into the queue
      * 
-     * @param val 
+     * @param val
+     * @return bool false if the queue is closed, or full with the REJECT policy
      */
-    void push(const T &val)
+    bool push(const T &val)
     {
-        std::lock_guard<std::mutex> lock(cs_);
+        std::unique_lock<std::mutex> lock(cs_);
+        if (!make_room(lock))
+            return false;
         q_.push(val);
+        not_empty_.notify_one();
+        return true;
     }
     /**
      * @brief Push a new object into the queue using a reference
      * 
-     * @param val 
+     * @param val
+     * @return bool false if the queue is closed, or full with the REJECT policy
      */
-    void push(T &&val)
+    bool push(T &&val)
     {
-        std::lock_guard<std::mutex> lock(cs_);
-        q_.push(val);
+        std::unique_lock<std::mutex> lock(cs_);
+        if (!make_room(lock))
+            return false;
+        q_.push(std::move(val));
+        not_empty_.notify_one();
+        return true;
     }
     /**
      * @brief Create a new object using the provided arguments and push it
      * into the queue.
      * 
+     * @return bool false if the queue is closed, or full with the REJECT policy
      */
     template <typename... _Args>
-#if __cplusplus > 201402L
-    decltype(auto) void emplace(_Args &&...__args)
-#else
-    void emplace(_Args &&...__args)
-#endif
+    bool emplace(_Args &&...__args)
     {
-        std::lock_guard<std::mutex> lock(cs_);
+        std::unique_lock<std::mutex> lock(cs_);
+        if (!make_room(lock))
+            return false;
         q_.emplace(std::forward<_Args>(__args)...);
+        not_empty_.notify_one();
+        return true;
     }
     /**
      * @brief Remove the element at the front of the queue
@@ -150,6 +206,84 @@ public:
     {
         std::lock_guard<std::mutex> lock(cs_);
         q_.pop();
+        not_full_.notify_one();
+    }
+    /**
+     * @brief Remove the element at the front of the queue into out, if there is one.
+     * 
+     * @param out Receives the element
+     * @return bool false if the queue is empty
+     */
+    bool try_pop_into(T &out)
+    {
+        std::lock_guard<std::mutex> lock(cs_);
+        if (q_.empty())
+            return false;
+        take(out);
+        return true;
+    }
+    /**
+     * @brief Remove the element at the front of the queue into out, waiting until there is
+     * one, the timeout expires or the queue is closed.
+     * 
+     * @param out Receives the element
+     * @param timeout_ms Timeout in ms, negative to wait indefinitely (default)
+     * @return bool false on timeout or if the queue is closed and empty
+     */
+    bool wait_pop(T &out, int timeout_ms = -1)
+    {
+        std::unique_lock<std::mutex> lock(cs_);
+        if (!wait_not_empty(lock, timeout_ms))
+            return false;
+        take(out);
+        return true;
+    }
+    /**
+     * @brief Remove up to max elements from the front of the queue under one lock and append
+     * them to out (anything with push_back, e.g. std::vector<T>).
+     * 
+     * @param out Receives the elements
+     * @param max Maximum number of elements
+     * @param timeout_ms Time to wait for the first element in ms, negative to wait indefinitely,
+     * 0 to not wait (default)
+     * @return size_t Number of elements removed
+     */
+    template <class Container>
+    size_t pop_bulk(Container &out, size_t max, int timeout_ms = 0)
+    {
+        std::unique_lock<std::mutex> lock(cs_);
+        if (max == 0 || !wait_not_empty(lock, timeout_ms))
+            return 0;
+        size_t n = 0;
+        for (; n < max && !q_.empty(); n++)
+        {
+            out.push_back(std::move(q_.front()));
+            q_.pop();
+        }
+        not_full_.notify_all();
+        return n;
+    }
+    /**
+     * @brief Close the queue: pushes fail from now on, and waiting threads are woken.
+     * Elements already in the queue can still be popped.
+     * 
+     */
+    void close()
+    {
+        std::lock_guard<std::mutex> lock(cs_);
+        closed_ = true;
+        not_empty_.notify_all();
+        not_full_.notify_all();
+    }
+    /**
+     * @brief Check if the queue has been closed.
+     * 
+     * @return bool
+     */
+    bool closed() const
+    {
+        std::lock_guard<std::mutex> lock(cs_);
+        return closed_;
     }
     /**
      * @brief Swap the contents of two protected queues
@@ -158,24 +292,71 @@ public:
      */
     void swap(ProtQueue &x) noexcept
     {
+        if (&x == this)
+            return;
         std::unique_lock<std::mutex> l1(cs_, std::defer_lock);
         std::unique_lock<std::mutex> l2(x.cs_, std::defer_lock);
         std::lock(l1, l2);
-        this->swap(x);
+        q_.swap(x.q_);
+        not_empty_.notify_all();
+        not_full_.notify_all();
+        x.not_empty_.notify_all();
+        x.not_full_.notify_all();
     }
     /**
      * @brief Acquire a relockable lock on the protected queue for extended operations.
      * 
-     * @return std::unique_lock<std::mutex>& Lock on the queue.
+     * @return std::unique_lock<std::mutex> Lock on the queue.
      */
-    std::unique_lock<std::mutex> &GetLock()
+    std::unique_lock<std::mutex> GetLock()
     {
-        std::unique_lock<std::mutex> lock(cs_);
-        return lock;
+        return std::unique_lock<std::mutex>(cs_);
     }
 
 private:
+    bool make_room(std::unique_lock<std::mutex> &lock)
+    {
+        if (closed_)
+            return false;
+        if (maxSize_ == 0 || q_.size() < maxSize_)
+            return true;
+        if (policy_ == REJECT)
+            return false;
+        if (policy_ == DROP_OLDEST)
+        {
+            while (q_.size() >= maxSize_)
+                q_.pop();
+            return true;
+        }
+        while (!closed_ && maxSize_ != 0 && q_.size() >= maxSize_ && policy_ == BLOCK)
+            not_full_.wait(lock);
+        return closed_ ? false : make_room(lock); // the limit or policy may have changed
+    }
+
+    bool wait_not_empty(std::unique_lock<std::mutex> &lock, int timeout_ms)
+    {
+        if (timeout_ms < 0)
+            not_empty_.wait(lock, [this]()
+                            { return !q_.empty() || closed_; });
+        else if (timeout_ms > 0)
+            not_empty_.wait_for(lock, std::chrono::milliseconds(timeout_ms), [this]()
+                                { return !q_.empty() || closed_; });
+        return !q_.empty();
+    }
+
+    void take(T &out)
+    {
+        out = std::move(q_.front());
+        q_.pop();
+        not_full_.notify_one();
+    }
+
     std::queue<T> q_;
-    std::mutex cs_;
+    mutable std::mutex cs_;
+    std::condition_variable not_empty_;
+    std::condition_variable not_full_;
+    size_t maxSize_;
+    Policy policy_;
+    bool closed_;
 };
-#endif // _PROT_QUEUE_HPP_
\ No newline at end of file
+#endif // _PROT_QUEUE_HPP_
@@ -0,0 +1,70 @@
+/**
+ * @file RiceCompress.hpp
+ * @author Sunip K. Mukherjee (sunipkmukherjee@gmail.com)
+ * @brief Rice coding of 16-bit pixel data, compatible with the FITS tiled image convention
+ * @version 0.1
+ * @date 2022-01-03
+ *
+ * @copyright Copyright (c) 2022
+ *
+ */
+#ifndef __RICECOMPRESS_HPP__
+#define __RICECOMPRESS_HPP__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+/**
+ * @brief Upper bound of the Rice coded size of n 16-bit values.
+ *
+ * @param n Number of values
+ * @param blockSize Values per coding block
+ * @return size_t Maximum number of bytes RiceEncode16 writes
+ */
+size_t RiceBound16(size_t n, int blockSize = 32);
+
+/**
+ * @brief Rice code 16-bit values, in the RICE_1 format of the FITS tiled image
+ * convention (BYTEPIX = 2): the first value raw, then blocks of differences between
+ * consecutive values, each block with its own split. Blocks that would not shrink are
+ * stored raw, so the output never exceeds RiceBound16().
+ *
+ * @param in Input values
+ * @param n Number of values, >= 1
+ * @param out Output buffer, at least RiceBound16(n, blockSize) bytes
+ * @param blockSize Values per coding block (FITS BLOCKSIZE, default: 32)
+ * @return size_t Number of bytes written
+ */
+size_t RiceEncode16(const int16_t *in, size_t n, uint8_t *out, int blockSize = 32);
+
+/**
+ * @brief Decode values coded by RiceEncode16 (or cfitsio's RICE_1 with BYTEPIX = 2).
+ *
+ * @param in Rice coded data
+ * @param size Size of the coded data in bytes
+ * @param out Output values
+ * @param n Number of values to decode
+ * @param blockSize Values per coding block
+ * @return bool false if the coded data is truncated or corrupt
+ */
+bool RiceDecode16(const uint8_t *in, size_t size, int16_t *out, size_t n, int blockSize = 32);
+
+/**
+ * @brief Rice code an image tile by tile, the way a RICE_1 compressed FITS image with
+ * ZBITPIX = 16 and BZERO = 32768 stores it. Tiles are numbered row by row and the
+ * tiles at the right and bottom edges are cropped to the image. Unsigned pixels are
+ * offset to signed values and every tile is coded independently, in parallel.
+ *
+ * @param src Image pixels, width x height
+ * @param width Image width
+ * @param height Image height
+ * @param tileWidth Tile width, 0 for the image width
+ * @param tileHeight Tile height, 0 for the image height
+ * @param numThreads Number of threads, 0 for one per CPU core
+ * @param tiles Output, one coded buffer per tile
+ * @param blockSize Values per coding block (default: 32)
+ */
+void RiceCompressTilesU16(const uint16_t *src, int width, int height, int tileWidth, int tileHeight, int numThreads, std::vector<std::vector<uint8_t>> &tiles, int blockSize = 32);
+
+#endif // __RICECOMPRESS_HPP__
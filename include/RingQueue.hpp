@@ -0,0 +1,327 @@
+/**
+ * @file RingQueue.hpp
+ * @author Sunip K. Mukherjee (sunipkmukherjee@gmail.com)
+ * @brief Bounded lock-free ring queue
+ * @version 0.1
+ * @date 2022-01-03
+ *
+ * @copyright Copyright (c) 2022
+ *
+ */
+
+#ifndef _RING_QUEUE_HPP_
+#define _RING_QUEUE_HPP_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <utility>
+
+/**
+ * @brief Bounded lock-free FIFO queue on a ring of cells with sequence numbers (after
+ * Dmitry Vyukov's bounded queue). Pushes and pops never take a lock; a consumer that
+ * waits for data sleeps on a condition variable, which producers only touch while a
+ * consumer is waiting. The queue never grows: a push into a full queue either fails
+ * (try_push) or evicts the oldest item (push_evict).
+ *
+ * Pops are safe from any number of threads, which is what lets push_evict drop the
+ * oldest item from the producer side. Pushes are safe from one thread when
+ * MultiProducer is false (SPSCQueue), from any number of threads otherwise (MPSCQueue).
+ *
+ * @tparam T Item type, default constructible and movable
+ * @tparam MultiProducer Allow concurrent pushes
+ */
+template <class T, bool MultiProducer = true>
+class RingQueue
+{
+public:
+    /**
+     * @brief Construct a new ring queue.
+     *
+     * @param capacity Maximum number of items, rounded up to a power of 2 (minimum 2)
+     */
+    RingQueue(size_t capacity) : closed_(false), waiters_(0)
+    {
+        size_t size = 2;
+        while (size < capacity)
+            size <<= 1;
+        mask_ = size - 1;
+        cells_ = new Cell[size];
+        for (size_t i = 0; i < size; i++)
+            cells_[i].seq.store(i, std::memory_order_relaxed);
+        head_.store(0, std::memory_order_relaxed);
+        tail_.store(0, std::memory_order_relaxed);
+    }
+    /**
+     * @brief Destroy the ring queue. Items still in the queue are destroyed with it.
+     *
+     */
+    ~RingQueue()
+    {
+        delete[] cells_;
+    }
+    /**
+     * @brief Push an item if there is room.
+     *
+     * @param val Item, only moved from if it was pushed
+     * @return bool false if the queue is full
+     */
+    template <class U>
+    bool try_push(U &&val)
+    {
+        if (!enqueue(std::forward<U>(val)))
+            return false;
+        notify();
+        return true;
+    }
+    /**
+     * @brief Push an item, evicting the oldest item if the queue is full. At most one item
+     * is evicted per push; if another producer takes the freed cell first, the push waits
+     * for a consumer to make room.
+     *
+     * @param val Item
+     * @param evicted Receives the evicted item
+     * @return bool true if an item was evicted into evicted
+     */
+    template <class U>
+    bool push_evict(U &&val, T &evicted)
+    {
+        bool dropped = false;
+        while (!enqueue(std::forward<U>(val)))
+        {
+            if (dropped)
+                std::this_thread::yield();
+            else if (dequeue(evicted)) // else a consumer made room already
+                dropped = true;
+        }
+        notify();
+        return dropped;
+    }
+    /**
+     * @brief Push up to count items, stopping at the first that does not fit. Waiting
+     * consumers are woken once for the batch.
+     *
+     * @param vals Items, the pushed ones are moved from
+     * @param count Number of items
+     * @return size_t Number of items pushed
+     */
+    size_t push_bulk(T *vals, size_t count)
+    {
+        size_t n = 0;
+        while (n < count && enqueue(std::move(vals[n])))
+            n++;
+        if (n > 0)
+            notify();
+        return n;
+    }
+    /**
+     * @brief Pop the oldest item if there is one.
+     *
+     * @param val Receives the item
+     * @return bool false if the queue is empty
+     */
+    bool try_pop(T &val)
+    {
+        return dequeue(val);
+    }
+    /**
+     * @brief Pop up to count items.
+     *
+     * @param vals Receives the items
+     * @param count Maximum number of items
+     * @return size_t Number of items popped
+     */
+    size_t pop_bulk(T *vals, size_t count)
+    {
+        size_t n = 0;
+        while (n < count && dequeue(vals[n]))
+            n++;
+        return n;
+    }
+    /**
+     * @brief Pop the oldest item, waiting until one is pushed, the timeout expires or the
+     * queue is closed.
+     *
+     * @param val Receives the item
+     * @param timeout_ms Timeout in ms, negative to wait indefinitely (default)
+     * @return bool false on timeout or if the queue is closed and empty
+     */
+    bool wait_pop(T &val, int timeout_ms = -1)
+    {
+        if (dequeue(val))
+            return true;
+        std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout_ms);
+        std::unique_lock<std::mutex> lock(cs_);
+        waiters_.fetch_add(1);
+        std::atomic_thread_fence(std::memory_order_seq_cst); // pairs with the fence in notify()
+        bool ok;
+        while (!(ok = dequeue(val)) && !closed_.load())
+        {
+            if (timeout_ms < 0)
+                cv_.wait(lock);
+            else if (cv_.wait_until(lock, deadline) == std::cv_status::timeout)
+            {
+                ok = dequeue(val);
+                break;
+            }
+        }
+        waiters_.fetch_sub(1);
+        return ok;
+    }
+    /**
+     * @brief Wake all waiting consumers and make wait_pop return instead of waiting once
+     * the queue is empty. Pushes still succeed.
+     *
+     */
+    void close()
+    {
+        std::lock_guard<std::mutex> lock(cs_);
+        closed_.store(true);
+        cv_.notify_all();
+    }
+    /**
+     * @brief Check if the queue has been closed.
+     *
+     * @return bool
+     */
+    bool closed() const
+    {
+        return closed_.load();
+    }
+    /**
+     * @brief Number of items in the queue, exact only when no push or pop is in progress.
+     *
+     * @return size_t
+     */
+    size_t size() const
+    {
+        size_t tail = tail_.load(std::memory_order_acquire);
+        size_t head = head_.load(std::memory_order_acquire);
+        return tail - head > mask_ + 1 ? 0 : tail - head;
+    }
+    /**
+     * @brief Check if the queue is empty.
+     *
+     * @return bool
+     */
+    bool empty() const
+    {
+        return size() == 0;
+    }
+    /**
+     * @brief Maximum number of items.
+     *
+     * @return size_t
+     */
+    size_t capacity() const
+    {
+        return mask_ + 1;
+    }
+
+private:
+    RingQueue(const RingQueue &) = delete;
+    RingQueue &operator=(const RingQueue &) = delete;
+
+    struct Cell
+    {
+        std::atomic<size_t> seq; // pos: free for the push at pos, pos + 1: holds the item pushed at pos
+        T data;
+    };
+
+    template <class U>
+    bool enqueue(U &&val)
+    {
+        Cell *cell;
+        size_t pos = tail_.load(std::memory_order_relaxed);
+        while (true)
+        {
+            cell = &cells_[pos & mask_];
+            size_t seq = cell->seq.load(std::memory_order_acquire);
+            intptr_t dif = (intptr_t)seq - (intptr_t)pos;
+            if (dif == 0)
+            {
+                if (!MultiProducer)
+                {
+                    tail_.store(pos + 1, std::memory_order_relaxed);
+                    break;
+                }
+                if (tail_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                    break;
+            }
+            else if (dif < 0) // full
+                return false;
+            else
+                pos = tail_.load(std::memory_order_relaxed);
+        }
+        cell->data = std::forward<U>(val);
+        cell->seq.store(pos + 1, std::memory_order_release);
+        return true;
+    }
+
+    bool dequeue(T &val)
+    {
+        Cell *cell;
+        size_t pos = head_.load(std::memory_order_relaxed);
+        while (true)
+        {
+            cell = &cells_[pos & mask_];
+            size_t seq = cell->seq.load(std::memory_order_acquire);
+            intptr_t dif = (intptr_t)seq - (intptr_t)(pos + 1);
+            if (dif == 0)
+            {
+                if (head_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                    break;
+            }
+            else if (dif < 0) // empty
+                return false;
+            else
+                pos = head_.load(std::memory_order_relaxed);
+        }
+        val = std::move(cell->data);
+        cell->seq.store(pos + mask_ + 1, std::memory_order_release);
+        return true;
+    }
+
+    void notify()
+    {
+        // the item is published; a consumer registered before this fence re-checks the queue under cs_
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (waiters_.load(std::memory_order_relaxed) > 0)
+        {
+            std::lock_guard<std::mutex> lock(cs_);
+            cv_.notify_one();
+        }
+    }
+
+    Cell *cells_;
+    size_t mask_;
+    char pad0_[64];
+    std::atomic<size_t> tail_; // next push position
+    char pad1_[64];
+    std::atomic<size_t> head_; // next pop position
+    char pad2_[64];
+    std::atomic<bool> closed_;
+    std::atomic<int> waiters_;
+    std::mutex cs_;
+    std::condition_variable cv_;
+};
+
+/**
+ * @brief Ring queue with a single producer thread.
+ *
+ */
+template <class T>
+using SPSCQueue = RingQueue<T, false>;
+
+/**
+ * @brief Ring queue with any number of producer threads.
+ *
+ */
+template <class T>
+using MPSCQueue = RingQueue<T, true>;
+
+#endif // _RING_QUEUE_HPP_
@@ -16,34 +16,9 @@
 #include "network_common.hpp"
 #include "network_server.hpp"
 #include "meb_print.h"
-#include "ProtQueue.hpp"
-
-/**
- * @brief Network Image Metadata
- *
- * @return typedef struct
- */
-typedef struct __attribute__((packed))
-{
-    uint16_t x;
-    uint16_t y;
-    uint16_t width;
-    uint16_t height;
-    int32_t temperature;
-    uint32_t exposure_ms;
-    uint64_t tstamp;
-    int32_t type;
-    int32_t size;
-} netimg_meta;
-
-typedef enum
-{
-    JPEGMONO = 15,
-    JPEGRGBA = 20,
-    JPEGRGB = 25,
-    RAW8 = 30,
-    RAW16 = 35
-} netimg_type;
+#include "RingQueue.hpp"
+#include "NetImageFrame.hpp"
+#include "PreviewRateControl.hpp"
 
 typedef struct __attribute__((packed))
 {
@@ -154,8 +129,10 @@ static int32_t CurrentSaveImageNum = 0;      // Currently saving index
 static bool SaveImageCommand = false;        // Save image is false by default
 static char SaveImagePrefix[20] = "comic";   // Default file name prefix
 static char SaveImageDir[256] = "./fits/";   // Default save directory
+static bool StreamRawImage = false;          // Send Rice coded 16-bit frames (RICE16) instead of JPEG previews
 static char DirPathErrorName[256];           // Error finding directory name
-static ProtQueue<NetFrame *> tx_queue;       // Transmit queue
+static SPSCQueue<CNetImageFrame *> img_queue(4); // Image transmit queue, sent on the image socket without NetFrame framing (see CNetImageFrame)
+static CPreviewRateControl PreviewRate;        // Preview quality, size and rate for the link to the controller
 static NetVertex CtrlVertex;                 // Controller netvertex
 static raw_image MainImage[1];               // Image data
 
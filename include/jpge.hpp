@@ -13,18 +13,21 @@ namespace jpge
   typedef unsigned int   uint32;
   typedef unsigned int   uint;
   
+  class encoder_cache;
+
   // JPEG chroma subsampling factors. Y_ONLY (grayscale images) and H2V2 (color images) are the most common.
   enum subsampling_t { Y_ONLY = 0, H1V1 = 1, H2V1 = 2, H2V2 = 3 };
 
   // JPEG compression parameters structure.
   struct params
   {
-    inline params() : m_quality(85), m_subsampling(H2V2), m_no_chroma_discrim_flag(false), m_two_pass_flag(false) { }
+    inline params() : m_quality(85), m_subsampling(H2V2), m_no_chroma_discrim_flag(false), m_two_pass_flag(false), m_restart_interval(0) { }
 
     inline bool check() const
     {
       if ((m_quality < 1) || (m_quality > 100)) return false;
       if ((uint)m_subsampling > (uint)H2V2) return false;
+      if (m_restart_interval > 0xFFFF) return false;
       return true;
     }
 
@@ -43,6 +46,9 @@ namespace jpge
     bool m_no_chroma_discrim_flag;
 
     bool m_two_pass_flag;
+
+    // Restart interval in MCUs, 0 disables restart markers. Max 65535.
+    uint m_restart_interval;
   };
   
   // Writes JPEG image to a file. 
@@ -52,7 +58,10 @@ namespace jpge
   // Writes JPEG image to memory buffer. 
   // On entry, buf_size is the size of the output buffer pointed at by pBuf, which should be at least ~1024 bytes. 
   // If return value is true, buf_size will be set to the size of the compressed data.
-  bool compress_image_to_jpeg_file_in_memory(void *pBuf, int &buf_size, int width, int height, int num_channels, const uint8 *pImage_data, const params &comp_params = params());
+  // num_threads > 1 splits the image into horizontal strips of whole MCU rows that are encoded in parallel and
+  // joined with restart markers. Two pass (optimized Huffman table) encoding is always done on one thread.
+  // pCache, if given, keeps the encoders and their buffers between calls, see encoder_cache below.
+  bool compress_image_to_jpeg_file_in_memory(void *pBuf, int &buf_size, int width, int height, int num_channels, const uint8 *pImage_data, const params &comp_params = params(), int num_threads = 1, encoder_cache *pCache = 0);
     
   // Output stream abstract class - used by the jpeg_encoder class to write to the output stream. 
   // put_buf() is generally called with len==JPGE_OUT_BUF_SIZE bytes, but for headers it'll be called with smaller amounts.
@@ -78,10 +87,18 @@ namespace jpge
     // channels - May be 1, or 3. 1 indicates grayscale, 3 indicates RGB source data.
     // Returns false on out of memory or if a stream write fails.
     bool init(output_stream *pStream, int width, int height, int src_channels, const params &comp_params = params());
+
+    // Initializes the compressor for one horizontal strip of an image, for strips encoded separately and joined
+    // with restart markers. width and height are those of the whole image. Only the first strip writes the headers
+    // and only the last one the end of image marker. Only one pass encoding is supported.
+    // Feed the strip's scanlines, then NULL; every strip but the last must be a whole number of MCU rows.
+    bool init_strip(output_stream *pStream, int width, int height, int src_channels, const params &comp_params, bool first, bool last);
     
     const params &get_params() const { return m_params; }
     
     // Deinitializes the compressor, freeing any allocated memory. May be called at any time.
+    // Calling init() again without deinit() keeps the scanline buffer, and the quantization and standard Huffman
+    // tables if the quality did not change.
     void deinit();
 
     uint get_total_passes() const { return m_params.m_two_pass_flag ? 2 : 1; }
@@ -109,10 +126,15 @@ namespace jpge
     int m_mcus_per_row;
     int m_mcu_x, m_mcu_y;
     uint8 *m_mcu_lines[16];
+    uint m_mcu_lines_size;
     uint8 m_mcu_y_ofs;
     sample_array_t m_sample_array[64];
     int16 m_coefficient_array[64];
     int32 m_quantization_tables[2][64];
+    int32 m_quant_natural[2][64];
+    int m_quant_quality;
+    bool m_quant_no_chroma_discrim;
+    bool m_std_huff_tables;
     uint m_huff_codes[4][256];
     uint8 m_huff_code_sizes[4][256];
     uint8 m_huff_bits[4][17];
@@ -127,6 +149,8 @@ namespace jpge
     uint m_bits_in;
     uint8 m_pass_num;
     bool m_all_stream_writes_succeeded;
+    bool m_emit_headers, m_emit_eoi;
+    uint m_restart_mcus_left, m_restart_num;
         
     void optimize_huffman_table(int table_num, int table_len);
     void emit_byte(uint8 i);
@@ -138,6 +162,8 @@ namespace jpge
     void emit_dht(uint8 *bits, uint8 *val, int index, bool ac_flag);
     void emit_dhts();
     void emit_sos();
+    void emit_dri();
+    void emit_restart();
     void emit_markers();
     void compute_huffman_table(uint *codes, uint8 *code_sizes, uint8 *bits, uint8 *val);
     void compute_quant_table(int32 *dst, int16 *src);
@@ -161,9 +187,39 @@ namespace jpge
     bool process_end_of_image();
     void load_mcu(const void* src);
     void clear();
+    void reset();
     void init();
   };
 
+  class strip_stream;
+
+  // Keeps jpeg_encoder objects, with their tables and scanline buffers, and the strip buffers of parallel
+  // encoding alive between calls to compress_image_to_jpeg_file_in_memory(). Encoding a stream of frames of the
+  // same size and quality then does no per-frame setup. Only one call may use a cache at a time.
+  class encoder_cache
+  {
+  public:
+    encoder_cache();
+    ~encoder_cache();
+
+    // Makes sure at least count encoders and strip buffers exist. Returns false on out of memory.
+    bool reserve(int count);
+
+    jpeg_encoder &encoder(int index) { return *m_pEncoders[index]; }
+    strip_stream &strip(int index) { return *m_pStrips[index]; }
+
+    // Frees all cached encoders and buffers.
+    void clear();
+
+  private:
+    encoder_cache(const encoder_cache &);
+    encoder_cache &operator =(const encoder_cache &);
+
+    jpeg_encoder **m_pEncoders;
+    strip_stream **m_pStrips;
+    int m_count;
+  };
+
 } // namespace jpge
 
 #endif // JPEG_ENCODER
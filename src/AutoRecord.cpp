@@ -1,4 +1,5 @@
 #include "CameraUnit_ATIK.hpp"
+#include "FitsWriter.hpp"
 #include "meb_print.h"
 #include "gpiodev/gpiodev.h"
 #include <signal.h>
@@ -97,6 +98,34 @@ int main(int argc, char *argv[])
     int pixelUncertainty = 5000;
     int maxBin = 4;
     int imgXMin = 100, imgYMin = 335, imgXMax = -1, imgYMax = -1;
+    int jpegMaxDimension = 0;
+    CFitsWriter::DurabilityPolicy durability = CFitsWriter::DURABILITY_NONE;
+    bool container = false;
+    while ((opt = getopt(argc, argv, "j:s:m")) != -1)
+    {
+        switch (opt)
+        {
+        case 'j': // size of the JPEG dumps on the longer side, full size by default
+            jpegMaxDimension = atoi(optarg);
+            break;
+        case 's': // sync written files: none (default), group or file
+            if (strcmp(optarg, "group") == 0)
+                durability = CFitsWriter::DURABILITY_GROUP;
+            else if (strcmp(optarg, "file") == 0)
+                durability = CFitsWriter::DURABILITY_FILE;
+            else
+                durability = CFitsWriter::DURABILITY_NONE;
+            break;
+        case 'm': // append frames to hourly multi-extension FITS files instead of a file per frame
+            container = true;
+            break;
+        default:
+            bprintlf("Usage: %s [-j JPEG size] [-s none|group|file] [-m] [any argument: save a JPEG next to every FITS file]", argv[0]);
+            exit(0);
+        }
+    }
+    // any other argument saves a JPEG next to every FITS file
+    bool jpegDump = optind < argc;
 
     gpioSetMode(11, GPIO_OUT);
     gpioWrite(11, GPIO_HIGH);
@@ -129,6 +158,12 @@ int main(int argc, char *argv[])
     }
     cam->SetExposure(0.2);
     cam->SetBinningAndROI(1, 1, imgXMin, imgXMax, imgYMin, imgYMax);
+    // frames are written behind the capture loop, which only waits if the disk falls 8 frames behind
+    CFitsWriter writer(8, CFitsWriter::BLOCK);
+    writer.SetJPEGDump(jpegDump, jpegMaxDimension);
+    writer.SetDurability(durability);
+    // a file per hour (or GiB) instead of a file per frame
+    writer.SetContainer(container, 1ULL << 30, 3600);
     unsigned long long counter = 0;
     // first run, get sunrise and sunset times
     long long int suntimes[4] = {0, };
@@ -136,12 +171,13 @@ int main(int argc, char *argv[])
     bool firstRun = true;
     while (!done)
     {
-        static char fname[512];
         static char dirname[256];
         static int bin = 1;
         static float exposure = 0.2;
         static long long int timenow = 0;
         static bool exposing = false;
+        static bool capturing = false;
+        static bool streaming = false;
         if (firstRun)
         {
             snprintf(dirname, sizeof(dirname), "fits/%s", get_date());
@@ -152,27 +188,58 @@ int main(int argc, char *argv[])
         if (timenow >= suntimes[1] && timenow <= suntimes[2]) // valid time, take photos
         {
             exposing = true;
-            CImageData img = cam->CaptureImage(retryCount);
-            img.SaveFits(NULL, dirname);
+            if (!capturing)
+            {
+                capturing = cam->StartCapture();
+            }
+            CImageData img;
+            cam->GetCapturedImage(img, -1);
+            capturing = false;
+            if (!img.HasData())
+            {
+                dbprintlf(RED_FG "Capture failed");
+                usleep(1000000 * cadence);
+                continue;
+            }
             img.FindOptimumExposure(exposure, bin, pixelPercentile, pixelTarget, maxExposure, maxBin, 100, pixelUncertainty);
             cam->SetBinningAndROI(bin, bin, imgXMin, imgXMax, imgYMin, imgYMax);
             cam->SetExposure(exposure);
-            if (argc > 1)
+            // back to back frames leave no idle time: keep the sensor integrating between them
+            if (streaming != (cadence <= exposure))
             {
-                unsigned char *ptr;
-                int sz;
-                img.GetJPEGData(ptr, sz);
-                snprintf(fname, sizeof(fname), "%s/%llu.jpg", dirname, img.GetTimestamp());
-                FILE *fp = fopen(fname, "wb");
-                fwrite(ptr, sz, 1, fp);
-                fclose(fp);
+                streaming = !streaming;
+                cam->SetStreamingMode(streaming);
             }
-            long int sleeptime = 1000000 * (cadence - exposure);
-            if (sleeptime > 0)
-                usleep(sleeptime);
+            long long int sleeptime = 1000 * (cadence - exposure); // ms
+            long long int nextstart = getTime() + (sleeptime > 0 ? sleeptime : 0);
+            if (sleeptime <= 0)
+            {
+                // next frame integrates while this one is saved
+                capturing = cam->StartCapture();
+            }
+            writer.Submit(std::move(img), NULL, dirname);
+            sleeptime = nextstart - getTime();
+            if (!capturing && sleeptime > 0)
+                usleep(sleeptime * 1000);
         }
         else if (exposing == true)
         {
+            if (capturing)
+            {
+                // collect the frame started before the window closed
+                CImageData img;
+                cam->GetCapturedImage(img, -1);
+                capturing = false;
+                if (img.HasData())
+                    writer.Submit(std::move(img), NULL, dirname);
+            }
+            if (streaming)
+            {
+                cam->SetStreamingMode(false);
+                streaming = false;
+            }
+            writer.Flush();
+            writer.Rotate(); // close the night's last file before it is backed up
             while (getSunTimes(suntimes) != true);
             exposing = false;
             snprintf(dirname, sizeof(dirname), "fits/%s", get_date());
@@ -202,5 +269,13 @@ int main(int argc, char *argv[])
             usleep(1000000 * cadence);
         }
     }
+    if (cam->CaptureInProgress())
+    {
+        CImageData img;
+        cam->CancelCapture();
+        cam->GetCapturedImage(img, -1);
+    }
+    delete cam;
+    writer.Stop();
     exit(0);
 }
\ No newline at end of file
@@ -15,6 +15,7 @@
 #include <string>
 #include <mutex>
 #include <chrono>
+#include <map>
 
 #if !defined(OS_Windows)
 #include <unistd.h>
@@ -68,14 +69,15 @@ bool CCameraUnit_ATIK::HasError(int error, unsigned int line) const
     }
 }
 
-int CCameraUnit_ATIK::ArtemisGetCameraState(ArtemisHandle h)
+std::string CCameraUnit_ATIK::GetStatus() const
 {
-    int state = ArtemisCameraState(h);
+    std::string status;
+    int state = cameraState_;
     switch (state)
     {
-#define ARTEMIS_STATE(x)           \
-    case x:                        \
-        status_ = std::string(#x); \
+#define ARTEMIS_STATE(x)          \
+    case x:                       \
+        status = std::string(#x); \
         break;
 
         ARTEMIS_STATE(CAMERA_ERROR)
@@ -87,13 +89,43 @@ int CCameraUnit_ATIK::ArtemisGetCameraState(ArtemisHandle h)
         ARTEMIS_STATE(CAMERA_FLUSHING)
 #undef ARTEMIS_STATE
     }
-    return state;
+    if (state == CAMERA_DOWNLOADING)
+    {
+        status += std::string(" Download: ");
+        status += std::to_string(downloadPercent_);
+        status += " %";
+    }
+    return status;
+}
+
+static std::mutex fastCamerasLock;
+static std::map<ArtemisHandle, CCameraUnit_ATIK *> fastCameras;
+
+void CCameraUnit_ATIK::FastCallback(ArtemisHandle handle, int x, int y, int w, int h, int binx, int biny, void *imageBuffer)
+{
+    std::lock_guard<std::mutex> lock(fastCamerasLock);
+    std::map<ArtemisHandle, CCameraUnit_ATIK *>::iterator it = fastCameras.find(handle);
+    if (it == fastCameras.end() || imageBuffer == NULL)
+    {
+        return;
+    }
+    CCameraUnit_ATIK *cam = it->second;
+    {
+        std::lock_guard<std::mutex> flock(cam->frame_cs_);
+        cam->fastImage_.SetImageData(w, h, (unsigned short *)imageBuffer);
+        cam->fastBinX_ = binx;
+        cam->fastBinY_ = biny;
+        cam->fastReady_ = true;
+    }
+    cam->frame_cv_.notify_all();
 }
 
 CCameraUnit_ATIK::CCameraUnit_ATIK()
     : hCam(NULL),
       m_initializationOK(false),
       cancelCapture_(true),
+      cameraState_(CAMERA_IDLE),
+      downloadPercent_(0),
       hasshutter(false),
       numtempsensors(0),
       binningX_(1),
@@ -108,7 +140,23 @@ CCameraUnit_ATIK::CCameraUnit_ATIK()
       roiBottom(0),
       roi_updated_(false),
       CCDWidth_(0),
-      CCDHeight_(0)
+      CCDHeight_(0),
+      hasoverlap(false),
+      hascontinuous(false),
+      hasfast(false),
+      streamMode_(STREAM_NONE),
+      streamRunning_(false),
+      streamRearm_(false),
+      streamExposureMs_(0),
+      streamFrameStart_(0),
+      asyncQuit_(false),
+      asyncRequested_(false),
+      asyncBusy_(false),
+      asyncReady_(false),
+      lastReadoutUs_(0),
+      fastReady_(false),
+      fastBinX_(1),
+      fastBinY_(1)
 {
     // do initialization stuff
     short numcameras = 0;
@@ -195,6 +243,16 @@ CCameraUnit_ATIK::CCameraUnit_ATIK()
     // Set subsample
     HasError(ArtemisSetSubSample(hCam, false), __LINE__);
 
+    // Get streaming caps
+    hasoverlap = (props.cameraflags & ARTEMIS_PROPERTIES_CAMERAFLAGS_HAS_OVERLAP_MODE) != 0;
+    hascontinuous = ArtemisContinuousExposingModeSupported(hCam);
+    if (ArtemisHasFastMode(hCam) && ArtemisSetFastCallback(hCam, &CCameraUnit_ATIK::FastCallback))
+    {
+        std::lock_guard<std::mutex> lock(fastCamerasLock);
+        fastCameras[hCam] = this;
+        hasfast = true;
+    }
+
     // Initialization done
     m_initializationOK = true;
 
@@ -206,8 +264,26 @@ close:
 
 CCameraUnit_ATIK::~CCameraUnit_ATIK()
 {
+    if (asyncThread_.joinable())
+    {
+        {
+            std::lock_guard<std::mutex> lock(async_cs_);
+            asyncQuit_ = true;
+        }
+        async_cv_.notify_all();
+        if (CaptureInProgress())
+            CancelCapture();
+        asyncThread_.join();
+    }
     // CriticalSection::Lock lock(criticalSection_);
     std::lock_guard<std::mutex> lock(cs_);
+    if (m_initializationOK)
+        StopStream();
+    if (hasfast)
+    {
+        std::lock_guard<std::mutex> flock(fastCamerasLock);
+        fastCameras.erase(hCam);
+    }
     ArtemisDisconnect(hCam);
     m_initializationOK = false;
 #ifdef _WIN32
@@ -218,28 +294,333 @@ CCameraUnit_ATIK::~CCameraUnit_ATIK()
 void CCameraUnit_ATIK::CancelCapture()
 {
     std::lock_guard<std::mutex> lock(cs_);
-    cancelCapture_ = true;
+    {
+        // under frame_cs_, cancelCapture_ is what WaitImageReady() waits on
+        std::lock_guard<std::mutex> flock(frame_cs_);
+        cancelCapture_ = true;
+    }
+    frame_cv_.notify_all();
     // abort acquisition
     ArtemisAbortExposure(hCam);
+    // streaming exposures have to be started again
+    streamRunning_ = false;
+}
+
+bool CCameraUnit_ATIK::StartCapture(CaptureCallback callback)
+{
+    if (!m_initializationOK)
+    {
+        return false;
+    }
+
+    std::lock_guard<std::mutex> lock(async_cs_);
+    if (asyncBusy_ || asyncQuit_)
+    {
+        return false;
+    }
+    if (!asyncThread_.joinable())
+    {
+        asyncThread_ = std::thread(&CCameraUnit_ATIK::AsyncCaptureThread, this);
+    }
+    asyncCallback_ = callback;
+    // cleared here, not by the capture thread, so a CancelCapture() right after this call is not lost
+    cancelCapture_ = false;
+    asyncImage_.ClearImage();
+    asyncReady_ = false;
+    asyncBusy_ = true;
+    asyncRequested_ = true;
+    async_cv_.notify_all();
+    return true;
+}
+
+bool CCameraUnit_ATIK::CaptureInProgress() const
+{
+    std::lock_guard<std::mutex> lock(async_cs_);
+    return asyncBusy_;
+}
+
+bool CCameraUnit_ATIK::GetCapturedImage(CImageData &image, int timeoutMs)
+{
+    std::unique_lock<std::mutex> lock(async_cs_);
+    if (timeoutMs < 0)
+    {
+        async_cv_.wait(lock, [this]
+                       { return asyncReady_ || !asyncBusy_; });
+    }
+    else if (timeoutMs > 0)
+    {
+        async_cv_.wait_for(lock, std::chrono::milliseconds(timeoutMs), [this]
+                           { return asyncReady_ || !asyncBusy_; });
+    }
+    if (!asyncReady_)
+    {
+        return false;
+    }
+    image = std::move(asyncImage_);
+    asyncReady_ = false;
+    return true;
+}
+
+void CCameraUnit_ATIK::AsyncCaptureThread()
+{
+    std::unique_lock<std::mutex> lock(async_cs_);
+    while (true)
+    {
+        async_cv_.wait(lock, [this]
+                       { return asyncQuit_ || asyncRequested_; });
+        if (asyncQuit_)
+        {
+            break;
+        }
+        asyncRequested_ = false;
+        CaptureCallback callback = asyncCallback_;
+        lock.unlock();
+
+        long int retryCount = 0;
+        CImageData img = Capture(retryCount);
+        if (callback)
+        {
+            callback(img);
+        }
+
+        lock.lock();
+        if (!callback)
+        {
+            asyncImage_ = std::move(img);
+            asyncReady_ = true;
+        }
+        asyncBusy_ = false;
+        async_cv_.notify_all();
+    }
+    asyncBusy_ = false;
+    async_cv_.notify_all();
+}
+
+bool CCameraUnit_ATIK::SetStreamingMode(bool enable)
+{
+    if (!m_initializationOK)
+    {
+        return false;
+    }
+
+    std::lock_guard<std::mutex> lock(cs_);
+    if (!enable)
+    {
+        StopStream();
+        return false;
+    }
+    if (streamMode_ != STREAM_NONE)
+    {
+        return true;
+    }
+
+    if (hasoverlap)
+    {
+        streamMode_ = STREAM_OVERLAPPED;
+    }
+    else if (hascontinuous && !HasError(ArtemisSetContinuousExposingMode(hCam, true), __LINE__))
+    {
+        streamMode_ = STREAM_CONTINUOUS;
+    }
+    else if (hasfast)
+    {
+        streamMode_ = STREAM_FAST;
+    }
+    else
+    {
+        eprintlf("Streaming not supported by %s, using single exposures", cam_name);
+        return false;
+    }
+    streamRunning_ = false;
+    streamRearm_ = true;
+    return true;
+}
+
+void CCameraUnit_ATIK::StopStream()
+{
+    if (streamRunning_)
+    {
+        HasError(ArtemisStopExposure(hCam), __LINE__);
+    }
+    if (streamMode_ == STREAM_CONTINUOUS)
+    {
+        HasError(ArtemisSetContinuousExposingMode(hCam, false), __LINE__);
+    }
+    streamMode_ = STREAM_NONE;
+    streamRunning_ = false;
+}
+
+bool CCameraUnit_ATIK::ArmStream(int exposure_ms)
+{
+    if (streamRunning_ && !streamRearm_ && (exposure_ms == streamExposureMs_))
+    {
+        // overlapped exposure chain broken by the camera, start the next one
+        if ((streamMode_ == STREAM_OVERLAPPED) && !ArtemisOverlappedExposureValid(hCam))
+        {
+            if (HasError(ArtemisStartOverlappedExposure(hCam), __LINE__))
+            {
+                streamRunning_ = false;
+                return false;
+            }
+            streamFrameStart_ = getTime();
+        }
+        // fast mode stopped by the camera
+        bool fastPending = false;
+        if (streamMode_ == STREAM_FAST)
+        {
+            std::lock_guard<std::mutex> flock(frame_cs_);
+            fastPending = fastReady_;
+        }
+        if ((streamMode_ == STREAM_FAST) && !fastPending && (ArtemisCameraState(hCam) == CAMERA_IDLE))
+        {
+            if (!ArtemisStartFastExposure(hCam, exposure_ms))
+            {
+                streamRunning_ = false;
+                return false;
+            }
+            streamFrameStart_ = getTime();
+        }
+        return true;
+    }
+
+    // exposure, binning or ROI changed: restart the sequence
+    if (streamRunning_)
+    {
+        HasError(ArtemisStopExposure(hCam), __LINE__);
+        streamRunning_ = false;
+    }
+
+    if (streamMode_ == STREAM_OVERLAPPED)
+    {
+        if (HasError(ArtemisSetOverlappedExposureTime(hCam, exposure_ms * 0.001f), __LINE__))
+            return false;
+        if (HasError(ArtemisStartOverlappedExposure(hCam), __LINE__))
+            return false;
+    }
+    else if (streamMode_ == STREAM_CONTINUOUS)
+    {
+        if (HasError(ArtemisStartExposureMS(hCam, exposure_ms), __LINE__))
+            return false;
+    }
+    else if (streamMode_ == STREAM_FAST)
+    {
+        {
+            std::lock_guard<std::mutex> flock(frame_cs_);
+            fastImage_.ClearImage();
+            fastReady_ = false;
+        }
+        if (!ArtemisStartFastExposure(hCam, exposure_ms))
+        {
+            eprintlf("Could not start fast exposure");
+            return false;
+        }
+    }
+    else
+    {
+        return false;
+    }
+
+    streamFrameStart_ = getTime();
+    streamExposureMs_ = exposure_ms;
+    streamRearm_ = false;
+    streamRunning_ = true;
+    return true;
 }
 
 // ----------------------------------------------------------
 
+bool CCameraUnit_ATIK::WaitImageReady(std::unique_lock<std::mutex> &lock, uint64_t &exposure_end)
+{
+    exposure_end = 0;
+    bool readout_wait = lastReadoutUs_ > 0;
+    int backoff_us = READY_POLL_MIN_US;
+    while (true)
+    {
+        if (cancelCapture_)
+        {
+            return false;
+        }
+
+        bool ready;
+        if (streamMode_ == STREAM_FAST)
+        {
+            std::lock_guard<std::mutex> flock(frame_cs_);
+            ready = fastReady_;
+        }
+        else
+        {
+            ready = ArtemisImageReady(hCam);
+        }
+        if (ready)
+        {
+            break;
+        }
+
+        int wait_us;
+        // clamp in float, exposures can be longer than an int holds in us
+        float remaining_s = ArtemisExposureTimeRemaining(hCam);
+        int remaining_us = READY_POLL_MAX_US + READY_WAIT_MAX_US;
+        if (remaining_s * 1000000 < remaining_us)
+            remaining_us = remaining_s * 1000000;
+        cameraState_ = ArtemisCameraState(hCam);
+        if (remaining_us <= 0 && exposure_end == 0)
+        {
+            // exposure over, readout starts
+            exposure_end = getTime();
+        }
+        if (remaining_us > READY_POLL_MAX_US)
+        {
+            // sleep through the bulk of the exposure, at most READY_WAIT_MAX_US at a time, wake up just before it ends
+            wait_us = remaining_us - READY_POLL_MAX_US;
+        }
+        else if (readout_wait && exposure_end != 0)
+        {
+            // sleep through most of the readout, going by the previous frame
+            wait_us = (lastReadoutUs_ * 3) / 4;
+            readout_wait = false;
+        }
+        else
+        {
+            // poll with adaptive back-off to pick up the frame within READY_POLL_MAX_US
+            if (cameraState_ == CAMERA_DOWNLOADING)
+                downloadPercent_ = ArtemisDownloadPercent(hCam);
+            wait_us = backoff_us;
+            backoff_us = backoff_us * 2 > READY_POLL_MAX_US ? READY_POLL_MAX_US : backoff_us * 2;
+        }
+
+        // CancelCapture and fast mode frames wake us up early
+        lock.unlock();
+        {
+            std::unique_lock<std::mutex> flock(frame_cs_);
+            frame_cv_.wait_for(flock, std::chrono::microseconds(wait_us), [this]
+                               { return cancelCapture_ || fastReady_; });
+        }
+        lock.lock();
+    }
+    if (exposure_end != 0)
+    {
+        lastReadoutUs_ = (getTime() - exposure_end) * 1000;
+    }
+    cameraState_ = CAMERA_IDLE;
+    downloadPercent_ = 0;
+    return true;
+}
+
 CImageData CCameraUnit_ATIK::CaptureImage(long int &retryCount)
+{
+    cancelCapture_ = false;
+    return Capture(retryCount);
+}
+
+CImageData CCameraUnit_ATIK::Capture(long int &retryCount)
 {
     std::unique_lock<std::mutex> lock(cs_);
     CImageData retVal;
-    cancelCapture_ = false;
-    BOOL image_ready;
 
     void *pImgBuf;
 
     int x, y, w, h, binx, biny;
 
-    int sleep_time_ms = 0;
-
-    int cameraState = 0;
-
     int exposure_ms = exposure_ * 1000;
 
     float exposure_now = exposure_;
@@ -247,36 +628,55 @@ CImageData CCameraUnit_ATIK::CaptureImage(long int &retryCount)
         exposure_ms = 1;
     
     uint64_t exposure_start; 
+    uint64_t exposure_end;
 
     if (!m_initializationOK)
     {
         goto exit_err;
     }
 
-    exposure_start = getTime();
-    if (HasError(ArtemisStartExposureMS(hCam, exposure_ms), __LINE__))
+    if (streamMode_ != STREAM_NONE)
     {
-        goto exit_err;
+        // the sensor keeps integrating between calls, only (re)start the sequence if needed
+        if (!ArmStream(exposure_ms))
+        {
+            goto exit_err;
+        }
+        exposure_start = streamFrameStart_;
     }
-    sleep_time_ms = 1000 * ArtemisExposureTimeRemaining(hCam); // sleep time in ms
-    if (sleep_time_ms < 0)
-        sleep_time_ms = 0;
-    lock.unlock();
-
-    Sleep(sleep_time_ms);
-
-    lock.lock();
-    while (!(image_ready = ArtemisImageReady(hCam)))
+    else
     {
-        cameraState = ArtemisGetCameraState(hCam);
-        if (cameraState == CAMERA_DOWNLOADING)
+        exposure_start = getTime();
+        if (HasError(ArtemisStartExposureMS(hCam, exposure_ms), __LINE__))
         {
-            status_ += std::string(" Download: ");
-            status_ += std::to_string(ArtemisDownloadPercent(hCam));
-            status_ += " %";
+            goto exit_err;
         }
-        Sleep(10);
     }
+
+    if (!WaitImageReady(lock, exposure_end))
+    {
+        goto exit_err;
+    }
+    // the next streamed frame started integrating when this one ended; if the frame was
+    // ready before its end was seen, the frames run back to back
+    if (streamMode_ != STREAM_NONE)
+    {
+        streamFrameStart_ = exposure_end != 0 ? exposure_end : exposure_start + exposure_ms;
+    }
+
+    if (streamMode_ == STREAM_FAST)
+    {
+        std::lock_guard<std::mutex> flock(frame_cs_);
+        retVal = std::move(fastImage_);
+        fastReady_ = false;
+        binx = fastBinX_;
+        biny = fastBinY_;
+        binningX_ = binx;
+        binningY_ = biny;
+        retVal.SetImageMetadata(exposure_now, binx, biny, GetTemperature(), exposure_start, CameraName());
+        return retVal;
+    }
+
     if (HasError(ArtemisGetImageData(hCam, &x, &y, &w, &h, &binx, &biny), __LINE__))
     {
         eprintlf("Error getting image data");
@@ -287,13 +687,13 @@ CImageData CCameraUnit_ATIK::CaptureImage(long int &retryCount)
     binningX_ = binx;
     binningY_ = biny;
 
-    retVal = CImageData(w, h);
     if (pImgBuf == NULL)
     {
         eprintlf("Image buffer is NULL");
         goto exit_err;
     }
-    memcpy(retVal.GetImageData(), pImgBuf, w * h * 2);
+    // single copy straight out of the SDK buffer
+    retVal.SetImageData(w, h, (unsigned short *)pImgBuf);
     retVal.SetImageMetadata(exposure_now, binx, biny, GetTemperature(), exposure_start, CameraName());
 exit_err:
     // printf("Exiting capture\n");
@@ -373,6 +773,9 @@ void CCameraUnit_ATIK::SetBinningAndROI(int binX, int binY, int x_min, int x_max
         binningX_ = binX;
     }
 
+    // frame geometry changes take effect on a new exposure sequence
+    streamRearm_ = true;
+
     int imageLeft, imageRight, imageTop, imageBottom;
 
     imageLeft = x_min;
@@ -0,0 +1,123 @@
+/**
+ * @file FitsContainer.cpp
+ * @author Sunip K. Mukherjee (sunipkmukherjee@gmail.com)
+ * @brief Rolling multi-extension FITS file for frame sequences
+ * @version 0.1
+ * @date 2022-01-03
+ *
+ * @copyright Copyright (c) 2022
+ *
+ */
+#include "FitsContainer.hpp"
+#include "meb_print.h"
+
+#include <stdio.h>
+#include <unistd.h>
+#include <fitsio.h>
+
+CFitsContainer::CFitsContainer(uint64_t maxBytes, int maxSeconds, int maxFrames)
+    : fptr_(NULL),
+      maxBytes_(maxBytes),
+      maxSeconds_(maxSeconds > 0 ? maxSeconds : 0),
+      maxFrames_(maxFrames > 0 ? maxFrames : 0),
+      firstTimestamp_(0),
+      frames_(0),
+      bytes_(0),
+      lastFrameBytes_(0)
+{
+}
+
+CFitsContainer::~CFitsContainer()
+{
+    Close();
+}
+
+bool CFitsContainer::Append(const CImageData &image, const char *dirPrefix, const char *filePrefix)
+{
+    if (!image.HasData())
+        return false;
+    std::string dir = (dirPrefix == NULL || dirPrefix[0] == '\0') ? "./fits" : dirPrefix;
+    std::string prefix = (filePrefix == NULL || filePrefix[0] == '\0') ? "atik" : filePrefix;
+    uint64_t timestamp = image.GetTimestamp();
+    if (fptr_ != NULL)
+    {
+        bool rotate = dir != dir_ || prefix != prefix_;
+        if (maxFrames_ && frames_ >= maxFrames_)
+            rotate = true;
+        if (maxBytes_ && bytes_ + lastFrameBytes_ > maxBytes_)
+            rotate = true;
+        if (maxSeconds_ && (timestamp < firstTimestamp_ || timestamp - firstTimestamp_ >= (uint64_t)maxSeconds_ * 1000))
+            rotate = true;
+        if (rotate)
+            Close();
+    }
+    if (fptr_ == NULL && !Open(image, dir, prefix))
+        return false;
+
+    fitsfile *fptr = (fitsfile *)fptr_;
+    int status = 0;
+    LONGLONG headstart, datastart, dataend;
+    image.WriteFitsHDU(fptr, status);
+    fits_flush_file(fptr, &status); // the file is complete up to this frame
+    fits_get_hduaddrll(fptr, &headstart, &datastart, &dataend, &status);
+    if (status)
+    {
+        dbprintlf(FATAL "Error %d appending frame %llu to %s", status, (unsigned long long)timestamp, fileName_.c_str());
+        Close();
+        return false;
+    }
+    lastFrameBytes_ = dataend - bytes_;
+    bytes_ = dataend;
+    frames_++;
+    return true;
+}
+
+bool CFitsContainer::Close()
+{
+    if (fptr_ == NULL)
+        return true;
+    int status = 0;
+    fits_close_file((fitsfile *)fptr_, &status);
+    if (status)
+        dbprintlf(FATAL "Error %d closing %s", status, fileName_.c_str());
+    fptr_ = NULL;
+    fileName_.clear();
+    frames_ = 0;
+    bytes_ = 0;
+    lastFrameBytes_ = 0;
+    return status == 0;
+}
+
+bool CFitsContainer::Open(const CImageData &image, const std::string &dir, const std::string &prefix)
+{
+    char fileName[512];
+    if (snprintf(fileName, sizeof(fileName), "%s/%s_%llu.fit", dir.c_str(), prefix.c_str(), (unsigned long long)image.GetTimestamp()) >= (int)sizeof(fileName))
+        return false;
+    fitsfile *fptr;
+    int status = 0;
+    unlink(fileName);
+    if (fits_create_file(&fptr, fileName, &status))
+    {
+        dbprintlf(FATAL "Could not create file %s", fileName);
+        return false;
+    }
+    // empty primary HDU, the frames follow as extensions
+    fits_create_img(fptr, SHORT_IMG, 0, NULL, &status);
+    fits_write_key(fptr, TSTRING, "PROGRAM", (void *)"hitmis_explorer", NULL, &status);
+    fits_flush_file(fptr, &status);
+    if (status)
+    {
+        dbprintlf(FATAL "Error %d writing file %s", status, fileName);
+        fits_close_file(fptr, &status);
+        return false;
+    }
+    fptr_ = fptr;
+    fileName_ = fileName;
+    dir_ = dir;
+    prefix_ = prefix;
+    firstTimestamp_ = image.GetTimestamp();
+    frames_ = 0;
+    bytes_ = 2880; // the primary header
+    lastFrameBytes_ = 0;
+    return true;
+}
@@ -0,0 +1,354 @@
+/**
+ * @file FitsWriter.cpp
+ * @author Sunip K. Mukherjee (sunipkmukherjee@gmail.com)
+ * @brief Background FITS writer with a bounded write-behind queue
+ * @version 0.1
+ * @date 2022-01-03
+ *
+ * @copyright Copyright (c) 2022
+ *
+ */
+#include "FitsWriter.hpp"
+#include "meb_print.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <chrono>
+
+CFitsWriter::CFitsWriter(int maxQueued, QueuePolicy policy, int numThreads)
+    : maxQueued_(maxQueued > 0 ? maxQueued : 1),
+      policy_(policy),
+      stopping_(false),
+      durability_(DURABILITY_NONE),
+      groupFiles_(16),
+      groupMs_(1000),
+      compress_(true),
+      jpegDump_(false),
+      jpegMaxDimension_(0),
+      container_(NULL)
+{
+    memset(&stats_, 0, sizeof(stats_));
+    if (numThreads < 1)
+        numThreads = 1;
+    for (int i = 0; i < numThreads; i++)
+        threads_.push_back(std::thread(&CFitsWriter::WriterThread, this));
+}
+
+CFitsWriter::~CFitsWriter()
+{
+    Stop(true);
+}
+
+bool CFitsWriter::Submit(CImageData image, const char *filePrefix, const char *dirPrefix, bool filePrefixIsName, int i, int n)
+{
+    if (!image.HasData())
+        return false;
+    std::unique_lock<std::mutex> lock(cs_);
+    if (policy_ == BLOCK)
+    {
+        room_cv_.wait(lock, [this]
+                      { return stopping_ || (int)queue_.size() < maxQueued_; });
+    }
+    if (stopping_)
+        return false;
+    if ((int)queue_.size() >= maxQueued_)
+    {
+        stats_.dropped++;
+        if (policy_ == DROP_NEWEST)
+        {
+            dbprintlf(YELLOW_FG "Write queue full, dropping frame %llu", (unsigned long long)image.GetTimestamp());
+            return false;
+        }
+        dbprintlf(YELLOW_FG "Write queue full, dropping frame %llu", (unsigned long long)queue_.front().image.GetTimestamp());
+        queue_.pop_front();
+    }
+    Job job;
+    job.image = std::move(image);
+    job.filePrefix = filePrefix == NULL ? "" : filePrefix;
+    job.dirPrefix = dirPrefix == NULL ? "" : dirPrefix;
+    job.filePrefixIsName = filePrefixIsName;
+    job.i = i;
+    job.n = n;
+    queue_.push_back(std::move(job));
+    stats_.submitted++;
+    if ((int)queue_.size() > stats_.maxQueued)
+        stats_.maxQueued = queue_.size();
+    work_cv_.notify_one();
+    return true;
+}
+
+void CFitsWriter::Flush()
+{
+    std::unique_lock<std::mutex> lock(cs_);
+    idle_cv_.wait(lock, [this]
+                  { return queue_.empty() && stats_.writing == 0; });
+    GroupCommit(lock);
+}
+
+void CFitsWriter::Stop(bool drain)
+{
+    {
+        std::unique_lock<std::mutex> lock(cs_);
+        if (!drain)
+        {
+            stats_.dropped += queue_.size();
+            queue_.clear();
+        }
+        stopping_ = true;
+    }
+    work_cv_.notify_all();
+    room_cv_.notify_all();
+    idle_cv_.notify_all();
+    for (size_t i = 0; i < threads_.size(); i++)
+    {
+        if (threads_[i].joinable())
+            threads_[i].join();
+    }
+    threads_.clear();
+    {
+        std::lock_guard<std::mutex> lock(containerLock_);
+        delete container_;
+        container_ = NULL;
+    }
+    std::unique_lock<std::mutex> lock(cs_);
+    GroupCommit(lock);
+}
+
+void CFitsWriter::SetPolicy(QueuePolicy policy)
+{
+    std::lock_guard<std::mutex> lock(cs_);
+    policy_ = policy;
+    room_cv_.notify_all();
+}
+
+void CFitsWriter::SetCallback(Callback callback)
+{
+    std::lock_guard<std::mutex> lock(cs_);
+    callback_ = callback;
+}
+
+void CFitsWriter::SetDurability(DurabilityPolicy policy, int groupFiles, int groupMs)
+{
+    std::lock_guard<std::mutex> lock(cs_);
+    durability_ = policy;
+    groupFiles_ = groupFiles > 0 ? groupFiles : 1;
+    groupMs_ = groupMs > 0 ? groupMs : 0;
+    work_cv_.notify_all(); // re-evaluate a pending group commit
+}
+
+void CFitsWriter::SetCompression(bool compress)
+{
+    std::lock_guard<std::mutex> lock(cs_);
+    compress_ = compress;
+}
+
+void CFitsWriter::SetJPEGDump(bool enable, int maxDimension)
+{
+    std::lock_guard<std::mutex> lock(cs_);
+    jpegDump_ = enable;
+    jpegMaxDimension_ = maxDimension;
+}
+
+void CFitsWriter::SetContainer(bool enable, uint64_t maxBytes, int maxSeconds, int maxFrames)
+{
+    std::lock_guard<std::mutex> lock(containerLock_);
+    delete container_;
+    container_ = enable ? new CFitsContainer(maxBytes, maxSeconds, maxFrames) : NULL;
+}
+
+void CFitsWriter::Rotate()
+{
+    std::lock_guard<std::mutex> lock(containerLock_);
+    if (container_ != NULL)
+        container_->Close();
+}
+
+FitsWriterStats CFitsWriter::GetStats() const
+{
+    std::lock_guard<std::mutex> lock(cs_);
+    FitsWriterStats stats = stats_;
+    stats.queued = queue_.size();
+    stats.unsynced = unsynced_.size();
+    return stats;
+}
+
+void CFitsWriter::WriterThread()
+{
+    std::unique_lock<std::mutex> lock(cs_);
+    while (true)
+    {
+        if (unsynced_.empty())
+            work_cv_.wait(lock, [this]
+                          { return stopping_ || !queue_.empty(); });
+        else // wake up for the group commit deadline
+            work_cv_.wait_until(lock, groupStart_ + std::chrono::milliseconds(groupMs_), [this]
+                                { return stopping_ || !queue_.empty() || GroupCommitDue(); });
+        if (GroupCommitDue())
+        {
+            GroupCommit(lock);
+            continue;
+        }
+        if (queue_.empty())
+        {
+            if (stopping_) // nothing left to write, Stop() commits the rest
+                break;
+            continue;
+        }
+        Job job = std::move(queue_.front());
+        queue_.pop_front();
+        stats_.writing++;
+        room_cv_.notify_one();
+        lock.unlock();
+
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        bool ok = Write(job);
+        double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+        lock.lock();
+        stats_.writing--;
+        if (ok)
+            stats_.written++;
+        else
+            stats_.failed++;
+        stats_.lastWriteMs = ms;
+        if (ms > stats_.maxWriteMs)
+            stats_.maxWriteMs = ms;
+        Callback callback = callback_;
+        if (callback)
+        {
+            lock.unlock();
+            callback(job.image, ok);
+            lock.lock();
+        }
+        if (queue_.empty() && stats_.writing == 0)
+            idle_cv_.notify_all();
+    }
+}
+
+bool CFitsWriter::Write(Job &job)
+{
+    DurabilityPolicy durability;
+    bool compress, jpegDump;
+    int jpegMaxDimension;
+    {
+        std::lock_guard<std::mutex> lock(cs_);
+        durability = durability_;
+        compress = compress_;
+        jpegDump = jpegDump_;
+        jpegMaxDimension = jpegMaxDimension_;
+    }
+    std::string fileName;
+    bool container;
+    {
+        std::lock_guard<std::mutex> lock(containerLock_);
+        container = container_ != NULL;
+    }
+    bool ok = container && WriteContainer(job, durability, fileName);
+    if (container && !ok)
+        dbprintlf(RED_FG "Could not append frame %llu to a container file, writing it to its own file", (unsigned long long)job.image.GetTimestamp());
+    if (!ok)
+    {
+        char name[256];
+        if (compress)
+            ok = job.image.SaveFits(job.filePrefix.c_str(), job.dirPrefix.c_str(), job.filePrefixIsName, job.i, job.n, NULL, 0, durability == DURABILITY_FILE);
+        else
+            ok = job.image.SaveFitsUncompressed(job.filePrefix.c_str(), job.dirPrefix.c_str(), job.filePrefixIsName, job.i, job.n, NULL, 0, durability == DURABILITY_FILE);
+        if (job.image.GetFitsFileName(name, sizeof(name), job.filePrefix.c_str(), job.dirPrefix.c_str(), job.filePrefixIsName, job.i, job.n))
+            fileName = name;
+    }
+    if (ok && durability == DURABILITY_GROUP && !fileName.empty())
+    {
+        std::lock_guard<std::mutex> lock(cs_);
+        if (unsynced_.empty())
+            groupStart_ = std::chrono::steady_clock::now();
+        if (std::find(unsynced_.begin(), unsynced_.end(), fileName) == unsynced_.end())
+            unsynced_.push_back(fileName);
+    }
+    if (jpegDump)
+    {
+        unsigned char *ptr = NULL;
+        int sz = 0;
+        char fname[512];
+        job.image.GetJPEGData(ptr, sz, jpegMaxDimension);
+        snprintf(fname, sizeof(fname), "%s/%llu.jpg", job.dirPrefix.size() ? job.dirPrefix.c_str() : ".", (unsigned long long)job.image.GetTimestamp());
+        FILE *fp = fopen(fname, "wb");
+        if (ptr != NULL && fp != NULL)
+            fwrite(ptr, sz, 1, fp);
+        else
+            dbprintlf(RED_FG "Could not write %s", fname);
+        if (fp != NULL)
+            fclose(fp);
+    }
+    return ok;
+}
+
+static std::string DirName(const std::string &path)
+{
+    size_t pos = path.find_last_of('/');
+    return pos == std::string::npos ? "." : path.substr(0, pos);
+}
+
+bool CFitsWriter::WriteContainer(Job &job, DurabilityPolicy durability, std::string &fileName)
+{
+    std::lock_guard<std::mutex> lock(containerLock_);
+    if (container_ == NULL || !container_->Append(job.image, job.dirPrefix.c_str(), job.filePrefix.c_str()))
+        return false;
+    fileName = container_->GetFileName();
+    if (durability == DURABILITY_FILE)
+    {
+        CImageData::SyncFile(fileName.c_str(), true);
+        if (container_->GetFrameCount() == 1) // new file, make its directory entry durable
+            CImageData::SyncFile(DirName(fileName).c_str(), false);
+    }
+    return true;
+}
+
+bool CFitsWriter::GroupCommitDue() const
+{
+    if (unsynced_.empty())
+        return false;
+    return durability_ != DURABILITY_GROUP || stopping_ ||
+           (int)unsynced_.size() >= groupFiles_ ||
+           std::chrono::steady_clock::now() >= groupStart_ + std::chrono::milliseconds(groupMs_);
+}
+
+void CFitsWriter::GroupCommit(std::unique_lock<std::mutex> &lock)
+{
+    if (unsynced_.empty())
+        return;
+    std::vector<std::string> files;
+    files.swap(unsynced_);
+    stats_.writing++; // keeps Flush() waiting until the files are durable
+    lock.unlock();
+
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    // data of every file first, then each directory once for the new entries
+    std::vector<std::string> dirs;
+    uint64_t errors = 0;
+    for (size_t i = 0; i < files.size(); i++)
+    {
+        if (!CImageData::SyncFile(files[i].c_str(), true))
+            errors++;
+        std::string dir = DirName(files[i]);
+        if (std::find(dirs.begin(), dirs.end(), dir) == dirs.end())
+            dirs.push_back(dir);
+    }
+    for (size_t i = 0; i < dirs.size(); i++)
+    {
+        if (!CImageData::SyncFile(dirs[i].c_str(), false))
+            errors++;
+    }
+    double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+    lock.lock();
+    stats_.writing--;
+    stats_.syncs++;
+    stats_.synced += files.size();
+    stats_.syncErrors += errors;
+    stats_.lastSyncMs = ms;
+    if (ms > stats_.maxSyncMs)
+        stats_.maxSyncMs = ms;
+    if (queue_.empty() && stats_.writing == 0)
+        idle_cv_.notify_all();
+}
@@ -0,0 +1,147 @@
+/**
+ * @file FramePool.cpp
+ * @author Sunip K. Mukherjee (sunipkmukherjee@gmail.com)
+ * @brief Recycling pool for large frame buffers implementation
+ * @version 0.1
+ * @date 2022-01-03
+ *
+ * @copyright Copyright (c) 2022
+ *
+ */
+#include "FramePool.hpp"
+
+#include <stdlib.h>
+#if defined(WIN32) || defined(_WIN32) || defined(__WIN32__) || defined(__NT__)
+#include <malloc.h>
+#define OS_Windows
+#endif
+
+#define FRAMEPOOL_ALIGN 64
+
+static inline void *aligned_alloc_buf(size_t size)
+{
+#if !defined(OS_Windows)
+    void *buf = NULL;
+    if (posix_memalign(&buf, FRAMEPOOL_ALIGN, size))
+        return NULL;
+    return buf;
+#else
+    return _aligned_malloc(size, FRAMEPOOL_ALIGN);
+#endif
+}
+
+static inline void aligned_free_buf(void *buf)
+{
+#if !defined(OS_Windows)
+    free(buf);
+#else
+    _aligned_free(buf);
+#endif
+}
+
+CFramePool &CFramePool::Instance()
+{
+    static CFramePool *pool = new CFramePool();
+    return *pool;
+}
+
+// a few full frames: idle buffers of every size in use stay cached up to this limit
+CFramePool::CFramePool()
+    : maxPerSize_(2), maxBytes_(64UL * 1024 * 1024)
+{
+    stats_.hits = 0;
+    stats_.misses = 0;
+    stats_.returns = 0;
+    stats_.releases = 0;
+    stats_.cachedBuffers = 0;
+    stats_.cachedBytes = 0;
+}
+
+void *CFramePool::Get(size_t size)
+{
+    if (size == 0)
+        return NULL;
+    {
+        std::lock_guard<std::mutex> lock(cs_);
+        std::map<size_t, std::vector<void *>>::iterator it = free_.find(size);
+        if (it != free_.end() && !it->second.empty())
+        {
+            void *buf = it->second.back();
+            it->second.pop_back();
+            stats_.hits++;
+            stats_.cachedBuffers--;
+            stats_.cachedBytes -= size;
+            return buf;
+        }
+        stats_.misses++;
+    }
+    // allocate outside the lock
+    return aligned_alloc_buf(size);
+}
+
+void CFramePool::Put(void *buf, size_t size)
+{
+    if (buf == NULL)
+        return;
+    {
+        std::lock_guard<std::mutex> lock(cs_);
+        std::vector<void *> &list = free_[size];
+        if ((int)list.size() < maxPerSize_ && stats_.cachedBytes + size <= maxBytes_)
+        {
+            list.push_back(buf);
+            stats_.returns++;
+            stats_.cachedBuffers++;
+            stats_.cachedBytes += size;
+            return;
+        }
+        stats_.releases++;
+    }
+    aligned_free_buf(buf);
+}
+
+void CFramePool::SetLimits(int maxPerSize, size_t maxBytes)
+{
+    std::vector<void *> drop;
+    {
+        std::lock_guard<std::mutex> lock(cs_);
+        maxPerSize_ = maxPerSize < 0 ? 0 : maxPerSize;
+        maxBytes_ = maxBytes;
+        // trim the largest sizes first
+        for (std::map<size_t, std::vector<void *>>::reverse_iterator it = free_.rbegin(); it != free_.rend(); it++)
+        {
+            while (!it->second.empty() && ((int)it->second.size() > maxPerSize_ || stats_.cachedBytes > maxBytes_))
+            {
+                drop.push_back(it->second.back());
+                it->second.pop_back();
+                stats_.releases++;
+                stats_.cachedBuffers--;
+                stats_.cachedBytes -= it->first;
+            }
+        }
+    }
+    for (size_t i = 0; i < drop.size(); i++)
+        aligned_free_buf(drop[i]);
+}
+
+void CFramePool::Clear()
+{
+    std::map<size_t, std::vector<void *>> drop;
+    {
+        std::lock_guard<std::mutex> lock(cs_);
+        drop.swap(free_);
+        stats_.releases += stats_.cachedBuffers;
+        stats_.cachedBuffers = 0;
+        stats_.cachedBytes = 0;
+    }
+    for (std::map<size_t, std::vector<void *>>::iterator it = drop.begin(); it != drop.end(); it++)
+    {
+        for (size_t i = 0; i < it->second.size(); i++)
+            aligned_free_buf(it->second[i]);
+    }
+}
+
+FramePoolStats CFramePool::GetStats() const
+{
+    std::lock_guard<std::mutex> lock(cs_);
+    return stats_;
+}
@@ -12,7 +12,9 @@
 
 #include <math.h>
 #if !defined(OS_Windows)
+#include <fcntl.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <unistd.h>
 #else
 #include <stdio.h>
@@ -21,42 +23,87 @@ static inline void sync()
     _flushall();
 }
 #endif
+#include "FramePool.hpp"
+#include "RiceCompress.hpp"
 #include "jpge.hpp"
 #include "meb_print.h"
 #include <fitsio.h>
 
 #include <algorithm>
 #include <chrono>
+#include <thread>
+#include <vector>
 
 static inline uint64_t getTime()
 {
     return ((std::chrono::duration_cast<std::chrono::milliseconds>((std::chrono::time_point_cast<std::chrono::milliseconds>(std::chrono::system_clock::now())).time_since_epoch())).count());
 }
 
+// frame sized buffers are recycled through the frame pool
+static inline void *AllocBuffer(size_t size)
+{
+    return CFramePool::Instance().Get(size);
+}
+
+static inline void FreeBuffer(void *buf, size_t size)
+{
+    CFramePool::Instance().Put(buf, size);
+}
+
+static inline unsigned short *AllocPixels(int count)
+{
+    return (unsigned short *)AllocBuffer(count * sizeof(unsigned short));
+}
+
+static inline void FreePixels(unsigned short *buf, int count)
+{
+    FreeBuffer(buf, count * sizeof(unsigned short));
+}
+
+// pixel store that goes back to the frame pool when the last CImageData using it lets go
+static std::shared_ptr<unsigned short> NewPixelStore(int count)
+{
+    unsigned short *buf = AllocPixels(count);
+    if (buf == NULL)
+        return std::shared_ptr<unsigned short>();
+    return std::shared_ptr<unsigned short>(buf, [count](unsigned short *ptr)
+                                           { FreePixels(ptr, count); });
+}
+
+// JPEG output buffer, freed when the image and every frame sending it let go
+static std::shared_ptr<unsigned char> NewJPEGBuffer(int size)
+{
+    unsigned char *buf = (unsigned char *)AllocBuffer(size);
+    if (buf == NULL)
+        return std::shared_ptr<unsigned char>();
+    return std::shared_ptr<unsigned char>(buf, [size](unsigned char *ptr)
+                                          { FreeBuffer(ptr, size); });
+}
+
 void CImageData::ClearImage()
 {
-    if (m_imageData != 0)
-        delete[] m_imageData;
+    m_pixels.reset();
     m_imageData = 0;
+    m_statsValid = false;
+    m_pyramid.reset();
 
     m_imageWidth = 0;
     m_imageHeight = 0;
 
-    if (m_jpegData != nullptr)
-    {
-        delete[] m_jpegData;
-        m_jpegData = nullptr;
-    }
+    m_jpegData.reset();
+    m_jpegBufSize = 0;
+    m_jpegWidth = 0;
+    m_jpegHeight = 0;
 }
 
 CImageData::CImageData()
-    : m_imageHeight(0), m_imageWidth(0), m_exposureTime(0), m_imageData(NULL), m_jpegData(nullptr), sz_jpegData(-1), convert_jpeg(false), JpegQuality(100), pixelMin(-1), pixelMax(-1)
+    : m_imageHeight(0), m_imageWidth(0), m_exposureTime(0), m_binX(1), m_binY(1), m_temperature(0), m_timestamp(0), m_imageData(NULL), m_jpegData(nullptr), m_jpegBufSize(0), sz_jpegData(-1), m_jpegLevel(0), m_jpegWidth(0), m_jpegHeight(0), convert_jpeg(false), JpegQuality(100), pixelMin(-1), pixelMax(-1), autoscale(true), autoscaleLow(0), autoscaleHigh(100), jpegOverlay(true), m_jpegMono(false), toneCurve(JPEG_TONE_LINEAR), toneParam(0), jpegThreads(0), fitsTileWidth(0), fitsTileHeight(1), fitsThreads(0), m_statsValid(false)
 {
     ClearImage();
 }
 
 CImageData::CImageData(int imageWidth, int imageHeight, unsigned short *imageData, float exposureTime, int binX, int binY, float temperature, uint64_t timestamp, std::string cameraName, bool enableJpeg, int JpegQuality, int pixelMin, int pixelMax, bool autoscale)
-    : m_imageData(NULL), m_jpegData(nullptr), sz_jpegData(-1), convert_jpeg(false)
+    : m_imageData(NULL), m_jpegData(nullptr), m_jpegBufSize(0), sz_jpegData(-1), m_jpegLevel(0), m_jpegWidth(0), m_jpegHeight(0), convert_jpeg(false), autoscaleLow(0), autoscaleHigh(100), jpegOverlay(true), m_jpegMono(false), toneCurve(JPEG_TONE_LINEAR), toneParam(0), jpegThreads(0), fitsTileWidth(0), fitsTileHeight(1), fitsThreads(0), m_statsValid(false)
 {
     ClearImage();
 
@@ -65,7 +112,8 @@ CImageData::CImageData(int imageWidth, int imageHeight, unsigned short *imageDat
         return;
     }
 
-    m_imageData = new unsigned short[imageWidth * imageHeight];
+    m_pixels = NewPixelStore(imageWidth * imageHeight);
+    m_imageData = m_pixels.get();
     if ((m_imageData == NULL) || (m_imageData == nullptr))
     {
         return;
@@ -103,6 +151,35 @@ CImageData::CImageData(int imageWidth, int imageHeight, unsigned short *imageDat
     }
 }
 
+bool CImageData::SetImageData(int imageWidth, int imageHeight, const unsigned short *imageData)
+{
+    if ((imageWidth <= 0) || (imageHeight <= 0) || (imageData == NULL))
+    {
+        return false;
+    }
+
+    if ((m_imageData == NULL) || IsShared() || (imageWidth * imageHeight != m_imageWidth * m_imageHeight))
+    {
+        // not cleared, overwritten by the copy below
+        m_pixels = NewPixelStore(imageWidth * imageHeight);
+        m_imageData = m_pixels.get();
+        if (m_imageData == NULL)
+        {
+            ClearImage();
+            return false;
+        }
+    }
+    memcpy(m_imageData, imageData, imageWidth * imageHeight * sizeof(unsigned short));
+    m_imageWidth = imageWidth;
+    m_imageHeight = imageHeight;
+    m_statsValid = false;
+    m_pyramid.reset();
+
+    if (convert_jpeg)
+        ConvertJPEG();
+    return true;
+}
+
 void CImageData::SetImageMetadata(float exposureTime, int binX, int binY, float temperature, uint64_t timestamp, std::string cameraName)
 {
     m_exposureTime = exposureTime;
@@ -118,7 +195,7 @@ void CImageData::SetImageMetadata(float exposureTime, int binX, int binY, float
 }
 
 CImageData::CImageData(const CImageData &rhs)
-    : m_imageData(NULL), m_jpegData(nullptr), sz_jpegData(-1), convert_jpeg(false)
+    : m_imageData(NULL), m_jpegData(nullptr), m_jpegBufSize(0), sz_jpegData(-1), m_jpegLevel(0), m_jpegWidth(0), m_jpegHeight(0), convert_jpeg(false), autoscaleLow(0), autoscaleHigh(100), jpegOverlay(true), m_jpegMono(false), toneCurve(JPEG_TONE_LINEAR), toneParam(0), jpegThreads(0), fitsTileWidth(0), fitsTileHeight(1), fitsThreads(0), m_statsValid(false)
 {
     ClearImage();
 
@@ -127,14 +204,9 @@ CImageData::CImageData(const CImageData &rhs)
         return;
     }
 
-    m_imageData = new unsigned short[rhs.m_imageWidth * rhs.m_imageHeight];
-
-    if (m_imageData == 0)
-    {
-        return;
-    }
-
-    memcpy(m_imageData, rhs.m_imageData, rhs.m_imageWidth * rhs.m_imageHeight * sizeof(unsigned short));
+    // share the pixels, copied on write
+    m_pixels = rhs.m_pixels;
+    m_imageData = rhs.m_imageData;
     m_imageWidth = rhs.m_imageWidth;
     m_imageHeight = rhs.m_imageHeight;
     m_exposureTime = rhs.m_exposureTime;
@@ -151,6 +223,18 @@ CImageData::CImageData(const CImageData &rhs)
     pixelMin = rhs.pixelMin;
     pixelMax = rhs.pixelMax;
     autoscale = rhs.autoscale;
+    autoscaleLow = rhs.autoscaleLow;
+    autoscaleHigh = rhs.autoscaleHigh;
+    jpegOverlay = rhs.jpegOverlay;
+    toneCurve = rhs.toneCurve;
+    toneParam = rhs.toneParam;
+    jpegThreads = rhs.jpegThreads;
+    fitsTileWidth = rhs.fitsTileWidth;
+    fitsTileHeight = rhs.fitsTileHeight;
+    fitsThreads = rhs.fitsThreads;
+    m_stats = rhs.m_stats;
+    m_statsValid = rhs.m_statsValid;
+    m_pyramid = rhs.m_pyramid;
 }
 
 CImageData &CImageData::operator=(const CImageData &rhs)
@@ -167,14 +251,9 @@ CImageData &CImageData::operator=(const CImageData &rhs)
         return *this;
     }
 
-    m_imageData = new unsigned short[rhs.m_imageWidth * rhs.m_imageHeight];
-
-    if (m_imageData == 0)
-    {
-        return *this;
-    }
-
-    memcpy(m_imageData, rhs.m_imageData, rhs.m_imageWidth * rhs.m_imageHeight * sizeof(unsigned short));
+    // share the pixels, copied on write
+    m_pixels = rhs.m_pixels;
+    m_imageData = rhs.m_imageData;
     m_imageWidth = rhs.m_imageWidth;
     m_imageHeight = rhs.m_imageHeight;
     m_exposureTime = rhs.m_exposureTime;
@@ -191,85 +270,294 @@ CImageData &CImageData::operator=(const CImageData &rhs)
     pixelMin = rhs.pixelMin;
     pixelMax = rhs.pixelMax;
     autoscale = rhs.autoscale;
+    autoscaleLow = rhs.autoscaleLow;
+    autoscaleHigh = rhs.autoscaleHigh;
+    jpegOverlay = rhs.jpegOverlay;
+    toneCurve = rhs.toneCurve;
+    toneParam = rhs.toneParam;
+    jpegThreads = rhs.jpegThreads;
+    fitsTileWidth = rhs.fitsTileWidth;
+    fitsTileHeight = rhs.fitsTileHeight;
+    fitsThreads = rhs.fitsThreads;
+    m_stats = rhs.m_stats;
+    m_statsValid = rhs.m_statsValid;
+    m_pyramid = rhs.m_pyramid;
     return *this;
 }
 
-CImageData::~CImageData()
+CImageData::CImageData(CImageData &&rhs)
+    : m_imageData(NULL), m_jpegData(nullptr), m_jpegBufSize(0), sz_jpegData(-1), m_jpegLevel(0), m_jpegWidth(0), m_jpegHeight(0), convert_jpeg(false), autoscaleLow(0), autoscaleHigh(100), jpegOverlay(true), m_jpegMono(false), toneCurve(JPEG_TONE_LINEAR), toneParam(0), jpegThreads(0), fitsTileWidth(0), fitsTileHeight(1), fitsThreads(0), m_statsValid(false)
 {
-    if (m_imageData != NULL)
-        delete[] m_imageData;
-    if (m_jpegData != nullptr)
-        delete[] m_jpegData;
+    *this = std::move(rhs);
 }
 
-ImageStats CImageData::GetStats() const
+CImageData &CImageData::operator=(CImageData &&rhs)
 {
-    if (!m_imageData)
+    if (&rhs == this)
     {
-        return ImageStats(0, 0, 0, 0);
+        return *this;
     }
 
-    int min = 0xFFFF;
-    int max = 0;
-    double mean = 0.0;
+    ClearImage();
 
-    // Calculate min max and mean
+    m_pixels = std::move(rhs.m_pixels);
+    m_imageData = rhs.m_imageData;
+    m_imageWidth = rhs.m_imageWidth;
+    m_imageHeight = rhs.m_imageHeight;
+    m_exposureTime = rhs.m_exposureTime;
+    m_binX = rhs.m_binX;
+    m_binY = rhs.m_binY;
+    m_temperature = rhs.m_temperature;
+    m_cameraName = std::move(rhs.m_cameraName);
+    m_timestamp = rhs.m_timestamp;
 
-    unsigned short *imageDataPtr = m_imageData;
-    double rowDivisor = m_imageHeight * m_imageWidth;
-    unsigned long rowSum;
-    double rowAverage;
-    unsigned short currentPixelValue;
+    m_jpegData = std::move(rhs.m_jpegData);
+    m_jpegBufSize = rhs.m_jpegBufSize;
+    sz_jpegData = rhs.sz_jpegData;
+    convert_jpeg = rhs.convert_jpeg;
+    JpegQuality = rhs.JpegQuality;
+    pixelMin = rhs.pixelMin;
+    pixelMax = rhs.pixelMax;
+    autoscale = rhs.autoscale;
+    autoscaleLow = rhs.autoscaleLow;
+    autoscaleHigh = rhs.autoscaleHigh;
+    jpegOverlay = rhs.jpegOverlay;
+    toneCurve = rhs.toneCurve;
+    toneParam = rhs.toneParam;
+    jpegThreads = rhs.jpegThreads;
+    fitsTileWidth = rhs.fitsTileWidth;
+    fitsTileHeight = rhs.fitsTileHeight;
+    fitsThreads = rhs.fitsThreads;
+    m_stats = rhs.m_stats;
+    m_statsValid = rhs.m_statsValid;
+    m_pyramid = std::move(rhs.m_pyramid);
+    m_jpegLevel = rhs.m_jpegLevel;
+    m_jpegWidth = rhs.m_jpegWidth;
+    m_jpegHeight = rhs.m_jpegHeight;
+    m_jpegMono = rhs.m_jpegMono;
+
+    // rhs keeps its settings, but no data
+    rhs.m_imageData = NULL;
+    rhs.m_imageWidth = 0;
+    rhs.m_imageHeight = 0;
+    rhs.m_jpegBufSize = 0;
+    rhs.sz_jpegData = -1;
+    rhs.m_jpegWidth = 0;
+    rhs.m_jpegHeight = 0;
+    rhs.m_statsValid = false;
+    return *this;
+}
 
-    int rowIndex;
-    int columnIndex;
+bool CImageData::Detach()
+{
+    if (!IsShared())
+        return true;
 
-    for (rowIndex = 0; rowIndex < m_imageHeight; rowIndex++)
+    std::shared_ptr<unsigned short> pixels = NewPixelStore(m_imageWidth * m_imageHeight);
+    if (!pixels)
     {
-        rowSum = 0L;
-
-        for (columnIndex = 0; columnIndex < m_imageWidth; columnIndex++)
-        {
-            currentPixelValue = *imageDataPtr;
+        dbprintlf(FATAL "Could not allocate a copy of the shared pixels");
+        return false;
+    }
+    memcpy(pixels.get(), m_imageData, m_imageWidth * m_imageHeight * sizeof(unsigned short));
+    m_pixels = pixels;
+    m_imageData = m_pixels.get();
+    return true;
+}
 
-            if (currentPixelValue < min)
-            {
-                min = currentPixelValue;
-            }
+CImageData::~CImageData()
+{
+    ClearImage();
+}
 
-            if (currentPixelValue > max)
-            {
-                max = currentPixelValue;
-            }
+const PixelStats &CImageData::Stats() const
+{
+    if (!m_statsValid)
+    {
+        PixelStatsU16(m_imageData, m_imageData ? m_imageWidth * m_imageHeight : 0, m_stats);
+        m_statsValid = true;
+    }
+    return m_stats;
+}
 
-            rowSum += currentPixelValue;
+int CImageData::PyramidLevels() const
+{
+    int levels = 0;
+    while ((levels < PYRAMID_LEVELS) && ((m_imageWidth >> (levels + 1)) > 0) && ((m_imageHeight >> (levels + 1)) > 0))
+        levels++;
+    return levels;
+}
 
-            imageDataPtr++;
+const unsigned short *CImageData::GetPyramidLevel(int level, int &width, int &height) const
+{
+    width = 0;
+    height = 0;
+    if (!HasData() || (level < 0) || (level > PyramidLevels()))
+        return NULL;
+    width = m_imageWidth >> level;
+    height = m_imageHeight >> level;
+    if (level == 0)
+        return m_imageData;
+    int levels = PyramidLevels();
+    if (!m_pyramid)
+    {
+        // all levels in one pixel store, largest first
+        int count = 0;
+        for (int k = 1; k <= levels; k++)
+            count += (m_imageWidth >> k) * (m_imageHeight >> k);
+        std::shared_ptr<unsigned short> pyramid = NewPixelStore(count);
+        if (!pyramid)
+        {
+            width = height = 0;
+            return NULL;
         }
+        unsigned short *dst[PYRAMID_LEVELS];
+        dst[0] = pyramid.get();
+        for (int k = 1; k < levels; k++)
+            dst[k] = dst[k - 1] + (m_imageWidth >> k) * (m_imageHeight >> k);
+        PixelPyramidU16(m_imageData, m_imageWidth, m_imageHeight, levels, dst);
+        m_pyramid = pyramid;
+    }
+    const unsigned short *ptr = m_pyramid.get();
+    for (int k = 1; k < level; k++)
+        ptr += (m_imageWidth >> k) * (m_imageHeight >> k);
+    return ptr;
+}
 
-        rowAverage = static_cast<double>(rowSum) / rowDivisor;
+ImageStats CImageData::GetStats() const
+{
+    if (!m_imageData)
+    {
+        return ImageStats(0, 0, 0, 0);
+    }
 
-        mean += rowAverage;
+    // min, max, sum and sum of squares in one pass
+    const PixelStats &stats = Stats();
+    double count = m_imageHeight * m_imageWidth;
+    double mean = stats.sum / count;
+    double stddev = 0.0;
+    if (count > 1)
+    {
+        double varianceSum = stats.sumsq - stats.sum * mean;
+        stddev = sqrt((varianceSum > 0 ? varianceSum : 0) / (count - 1));
     }
 
-    // Calculate standard deviation
+    return ImageStats(stats.min, stats.max, mean, stddev);
+}
+
+static void BuildHistogram(const unsigned short *data, int width, int rowStart, int rowEnd, int step, uint32_t *hist)
+{
+    memset(hist, 0, CImageData::HISTOGRAM_BINS * sizeof(uint32_t));
+    if (step == 1)
+    {
+        const unsigned short *ptr = data + rowStart * width;
+        const unsigned short *end = data + rowEnd * width;
+        for (; ptr < end; ptr++)
+            hist[*ptr]++;
+        return;
+    }
+    for (int row = rowStart; row < rowEnd; row += step)
+    {
+        const unsigned short *ptr = data + row * width;
+        for (int col = 0; col < width; col += step)
+            hist[ptr[col]]++;
+    }
+}
 
-    double varianceSum = 0.0;
-    imageDataPtr = m_imageData;
+// smallest value with more than rank pixels at or below it
+static uint16_t HistogramRank(const uint32_t *hist, uint64_t rank)
+{
+    uint64_t cumulative = 0;
+    for (int val = 0; val < CImageData::HISTOGRAM_BINS; val++)
+    {
+        cumulative += hist[val];
+        if (cumulative > rank)
+            return val;
+    }
+    return 0xffff;
+}
 
-    for (rowIndex = 0; rowIndex < m_imageHeight; rowIndex++)
+bool CImageData::GetHistogram(uint32_t *hist, int step, int numThreads) const
+{
+    if (!HasData() || hist == NULL)
+        return false;
+    if (step < 1)
+        step = 1;
+    int rows = (m_imageHeight + step - 1) / step; // sampled rows
+    if (numThreads > rows)
+        numThreads = rows;
+    if (numThreads <= 1)
+    {
+        BuildHistogram(m_imageData, m_imageWidth, 0, m_imageHeight, step, hist);
+        return true;
+    }
+    // partial histograms over row bands, merged at the end
+    std::vector<std::thread> threads;
+    std::vector<uint32_t *> partials(numThreads - 1);
+    for (int i = 1; i < numThreads; i++)
     {
-        for (columnIndex = 0; columnIndex < m_imageWidth; columnIndex++)
+        partials[i - 1] = (uint32_t *)AllocBuffer(HISTOGRAM_BINS * sizeof(uint32_t));
+        if (partials[i - 1] == NULL) // out of memory, count in this thread alone
         {
-            double tempValue = (*imageDataPtr) - mean;
-            varianceSum += tempValue * tempValue;
-            imageDataPtr++;
+            for (int j = 1; j < i; j++)
+                FreeBuffer(partials[j - 1], HISTOGRAM_BINS * sizeof(uint32_t));
+            BuildHistogram(m_imageData, m_imageWidth, 0, m_imageHeight, step, hist);
+            return true;
         }
     }
+    int bandRows = ((rows + numThreads - 1) / numThreads) * step;
+    for (int i = 1; i < numThreads; i++)
+    {
+        int rowStart = std::min(i * bandRows, m_imageHeight);
+        int rowEnd = std::min(rowStart + bandRows, m_imageHeight);
+        threads.push_back(std::thread(BuildHistogram, m_imageData, m_imageWidth, rowStart, rowEnd, step, partials[i - 1]));
+    }
+    BuildHistogram(m_imageData, m_imageWidth, 0, std::min(bandRows, m_imageHeight), step, hist);
+    for (int i = 1; i < numThreads; i++)
+    {
+        threads[i - 1].join();
+        const uint32_t *partial = partials[i - 1];
+        for (int val = 0; val < HISTOGRAM_BINS; val++)
+            hist[val] += partial[val];
+        FreeBuffer(partials[i - 1], HISTOGRAM_BINS * sizeof(uint32_t));
+    }
+    return true;
+}
 
-    double stddev = sqrt(varianceSum / static_cast<double>((m_imageWidth * m_imageHeight) - 1));
+bool CImageData::GetPercentiles(const float *percentiles, uint16_t *values, int count, int step) const
+{
+    if (!HasData() || percentiles == NULL || values == NULL)
+        return false;
+    if (step < 1)
+        step = 1;
+    uint32_t *hist = (uint32_t *)AllocBuffer(HISTOGRAM_BINS * sizeof(uint32_t));
+    if (hist == NULL)
+    {
+        dbprintlf(FATAL "Could not allocate histogram");
+        return false;
+    }
+    GetHistogram(hist, step);
+    uint64_t numPixels = (uint64_t)((m_imageHeight + step - 1) / step) * ((m_imageWidth + step - 1) / step);
+    for (int i = 0; i < count; i++)
+    {
+        uint64_t rank;
+        if (percentiles[i] > 99.99)
+            rank = numPixels - 1;
+        else if (percentiles[i] <= 0)
+            rank = 0;
+        else
+            rank = floor(percentiles[i] * (numPixels - 1) * 0.01);
+        values[i] = HistogramRank(hist, rank);
+    }
+    FreeBuffer(hist, HISTOGRAM_BINS * sizeof(uint32_t));
+    return true;
+}
 
-    return ImageStats(min, max, mean, stddev);
+uint16_t CImageData::GetPercentile(float percentile, int step) const
+{
+    uint16_t val = 0;
+    GetPercentiles(&percentile, &val, 1, step);
+    return val;
 }
 
 void CImageData::Add(const CImageData &rhs)
@@ -292,6 +580,13 @@ void CImageData::Add(const CImageData &rhs)
     if ((rhs.m_imageWidth != m_imageWidth) || (rhs.m_imageHeight != m_imageHeight))
         return;
 
+    if (!Detach())
+        return;
+    m_statsValid = false;
+    m_pyramid.reset();
+    sourcePixelPtr = rhs.m_imageData;
+    targetPixelPtr = m_imageData;
+
     for (int pixelIndex = 0;
          pixelIndex < (m_imageWidth * m_imageHeight);
          pixelIndex++)
@@ -326,45 +621,28 @@ void CImageData::ApplyBinning(int binX, int binY)
         return;
     }
 
-    short newImageWidth = GetImageWidth() / binX;
-    short newImageHeight = GetImageHeight() / binY;
-
-    short binSourceImageWidth = newImageWidth * binX;
-    short binSourceImageHeight = newImageHeight * binY;
+    if ((binX < 1) || (binY < 1))
+        return;
 
-    unsigned short *newImageData = new unsigned short[newImageHeight * newImageWidth];
+    int newImageWidth = GetImageWidth() / binX;
+    int newImageHeight = GetImageHeight() / binY;
+    if ((newImageWidth <= 0) || (newImageHeight <= 0))
+        return;
 
-    memset(newImageData, 0, newImageHeight * newImageWidth * sizeof(unsigned short));
+    std::shared_ptr<unsigned short> newPixels = NewPixelStore(newImageHeight * newImageWidth);
+    unsigned short *newImageData = newPixels.get();
+    if (newImageData == NULL)
+        return;
 
     // Bin the data into the new image space allocated
-    for (int rowIndex = 0; rowIndex < binSourceImageHeight; rowIndex++)
-    {
-        const unsigned short *sourceImageDataPtr = GetImageData() + (rowIndex * GetImageWidth());
-
-        for (int columnIndex = 0; columnIndex < binSourceImageWidth; columnIndex++)
-        {
-            unsigned short *targetImageDataPtr = newImageData + (((rowIndex / binY) * newImageWidth) +
-                                                                 (columnIndex / binX));
-
-            unsigned long newPixelValue = *targetImageDataPtr + *sourceImageDataPtr;
-
-            if (newPixelValue > 0xFFFF)
-            {
-                *targetImageDataPtr = 0xFFFF;
-            }
-            else
-            {
-                *targetImageDataPtr = static_cast<unsigned short>(newPixelValue);
-            }
-
-            sourceImageDataPtr++;
-        }
-    }
+    PixelBinU16(m_imageData, m_imageWidth, m_imageHeight, binX, binY, newImageData);
 
-    delete[] m_imageData;
+    m_pixels = newPixels;
     m_imageData = newImageData;
     m_imageWidth = newImageWidth;
     m_imageHeight = newImageHeight;
+    m_statsValid = false;
+    m_pyramid.reset();
 
     if (convert_jpeg)
         ConvertJPEG();
@@ -372,10 +650,13 @@ void CImageData::ApplyBinning(int binX, int binY)
 
 void CImageData::FlipHorizontal()
 {
+    if (!Detach())
+        return;
     for (int row = 0; row < m_imageHeight; ++row)
     {
         std::reverse(m_imageData + row * m_imageWidth, m_imageData + (row + 1) * m_imageWidth);
     }
+    m_pyramid.reset();
 
     if (convert_jpeg)
         ConvertJPEG();
@@ -383,56 +664,164 @@ void CImageData::FlipHorizontal()
 
 #include <stdint.h>
 
+void CImageData::SetJPEGScaling(bool autoscale)
+{
+    this->autoscale = autoscale;
+}
+
+void CImageData::SetJPEGAutoscalePercentile(float low, float high)
+{
+    autoscaleLow = low < 0 ? 0 : (low > 100 ? 100 : low);
+    autoscaleHigh = high < autoscaleLow ? autoscaleLow : (high > 100 ? 100 : high);
+}
+
 uint16_t CImageData::DataMin()
 {
-    uint16_t res = 0xffff;
     if (!HasData())
     {
         return 0xffff;
     }
-    int idx = m_imageWidth * m_imageHeight;
-    while (idx--)
-    {
-        if (res > m_imageData[idx])
-        {
-            res = m_imageData[idx];
-        }
-    }
-    return res;
+    return Stats().min;
 }
 
 uint16_t CImageData::DataMax()
 {
-    uint16_t res = 0;
     if (!HasData())
     {
         return 0xffff;
     }
-    int idx = m_imageWidth * m_imageHeight;
-    while (idx--)
+    return Stats().max;
+}
+
+#include <stdio.h>
+
+// 16 bit to 8 bit tone mapping tables, cached per thread and rebuilt when the scaling changes
+typedef struct
+{
+    bool valid;
+    bool rgbValid;
+    uint16_t min;
+    uint16_t max;
+    int curve;
+    float param;
+    uint8_t gray[0x10000];
+    uint8_t rgb[0x10000][3]; // gray with the saturation (red) and limit (orange) markers
+} ToneLUT;
+
+static const ToneLUT &GetToneLUT(uint16_t min, uint16_t max, int curve, float param, bool overlay)
+{
+    static thread_local std::unique_ptr<ToneLUT> lut;
+    if (!lut)
+    {
+        lut.reset(new ToneLUT);
+        lut->valid = false;
+        lut->rgbValid = false;
+    }
+    ToneLUT *tbl = lut.get();
+    if (!tbl->valid || tbl->min != min || tbl->max != max || tbl->curve != curve || tbl->param != param)
     {
-        if (res < m_imageData[idx])
+        double norm = 1.0 / (max - min);
+        double asinhNorm = curve == CImageData::JPEG_TONE_ASINH ? 1.0 / asinh(param) : 1;
+        for (int val = 0; val < 0x10000; val++)
         {
-            res = m_imageData[idx];
+            double t = val <= min ? 0 : (val >= max ? 1 : (val - min) * norm);
+            if (curve == CImageData::JPEG_TONE_GAMMA)
+                t = pow(t, 1.0 / param);
+            else if (curve == CImageData::JPEG_TONE_ASINH)
+                t = asinh(t * param) * asinhNorm;
+            tbl->gray[val] = (uint8_t)(t * 255 + 0.5);
+        }
+        tbl->min = min;
+        tbl->max = max;
+        tbl->curve = curve;
+        tbl->param = param;
+        tbl->valid = true;
+        tbl->rgbValid = false;
+    }
+    if (overlay && !tbl->rgbValid)
+    {
+        for (int val = 0; val < 0x10000; val++)
+        {
+            uint8_t *rgb = tbl->rgb[val];
+            if (val == 0xffff) // saturation
+            {
+                rgb[0] = 0xff;
+                rgb[1] = 0x0;
+                rgb[2] = 0x0;
+            }
+            else if (val > max) // limit
+            {
+                rgb[0] = 0xff;
+                rgb[1] = 0xa5;
+                rgb[2] = 0x0;
+            }
+            else // scaling
+            {
+                rgb[0] = rgb[1] = rgb[2] = tbl->gray[val];
+            }
         }
+        tbl->rgbValid = true;
     }
-    return res;
+    return *tbl;
 }
 
-#include <stdio.h>
+// JPEG encoders with their tables and buffers, kept per thread so that streamed frames skip the encoder setup
+static jpge::encoder_cache &GetJPEGEncoderCache()
+{
+    static thread_local jpge::encoder_cache cache;
+    return cache;
+}
+
+void CImageData::SetJPEGToneCurve(JPEGToneCurve curve, float param)
+{
+    if (curve == JPEG_TONE_GAMMA)
+    {
+        toneCurve = curve;
+        toneParam = param > 0 ? param : 2.2;
+    }
+    else if (curve == JPEG_TONE_ASINH)
+    {
+        toneCurve = curve;
+        toneParam = param > 0 ? param : 10;
+    }
+    else
+    {
+        toneCurve = JPEG_TONE_LINEAR;
+        toneParam = 0;
+    }
+}
 
 void CImageData::ConvertJPEG()
 {
     // Check if data exists
     if (!HasData())
         return;
-    // source raw image
-    uint16_t *imgptr = m_imageData;
-    // temporary bitmap buffer
-    uint8_t *data = new uint8_t[m_imageWidth * m_imageHeight * 3]; // 3 channels for RGB
+    // source raw image, or the pyramid level of a preview; the scaling below is taken
+    // from the full image so that all levels look the same
+    if (m_jpegLevel > PyramidLevels())
+        m_jpegLevel = PyramidLevels();
+    int width, height;
+    const uint16_t *imgptr = GetPyramidLevel(m_jpegLevel, width, height);
+    if (imgptr == NULL)
+        return;
     // autoscale
     uint16_t min, max;
-    if (autoscale)
+    if (autoscale && (autoscaleLow > 0 || autoscaleHigh < 100))
+    {
+        float percentiles[2] = {autoscaleLow, autoscaleHigh};
+        uint16_t levels[2];
+        if (GetPercentiles(percentiles, levels, 2))
+        {
+            min = levels[0];
+            max = levels[1];
+        }
+        else
+        {
+            min = DataMin();
+            max = DataMax();
+        }
+    }
+    else if (autoscale)
     {
         min = DataMin();
         max = DataMax();
@@ -442,71 +831,111 @@ void CImageData::ConvertJPEG()
         min = pixelMin < 0 ? 0 : (pixelMin > 0xffff ? 0xffff : pixelMin);
         max = (uint16_t)(pixelMax < 0 ? 0xffff : (pixelMax > 0xffff ? 0xffff : pixelMax));
     }
-    // scaling
-    float scale = 0xffff / ((float)(max - min));
-    // Data conversion
-    for (int i = 0; i < m_imageWidth * m_imageHeight; i++) // for each pixel in raw image
+    if (max <= min) // flat image
+        max = min + 1;
+    // the colour overlay is only needed if saturated or clipped pixels are present
+    bool overlay = jpegOverlay && ((Stats().max == 0xffff) || (Stats().max > max));
+    int channels = overlay ? 3 : 1;
+    // temporary bitmap buffer, RGB with the overlay, grayscale otherwise
+    uint8_t *data = (uint8_t *)AllocBuffer(width * height * channels);
+    if (data == NULL)
     {
-        int idx = 3 * i;         // RGB pixel in JPEG source bitmap
-        if (imgptr[i] == 0xffff) // saturation
-        {
-            data[idx + 0] = 0xff;
-            data[idx + 1] = 0x0;
-            data[idx + 2] = 0x0;
-        }
-        else if (imgptr[i] > max) // limit
+        dbprintlf(FATAL "Could not allocate JPEG bitmap");
+        convert_jpeg = false;
+        sz_jpegData = 0;
+        return;
+    }
+    // Data conversion, one table lookup per pixel
+    const ToneLUT &lut = GetToneLUT(min, max, toneCurve, toneParam, overlay);
+    if (overlay)
+    {
+        for (int i = 0; i < width * height; i++) // for each pixel in raw image
         {
-            data[idx + 0] = 0xff;
-            data[idx + 1] = 0xa5;
-            data[idx + 2] = 0x0;
+            const uint8_t *rgb = lut.rgb[imgptr[i]];
+            data[3 * i + 0] = rgb[0];
+            data[3 * i + 1] = rgb[1];
+            data[3 * i + 2] = rgb[2];
         }
-        else // scaling
+    }
+    else
+    {
+        for (int i = 0; i < width * height; i++) // for each pixel in raw image
         {
-            uint8_t tmp = ((imgptr[i] - min) / 0x100) * scale;
-            data[idx + 0] = tmp;
-            data[idx + 1] = tmp;
-            data[idx + 2] = tmp;
+            data[i] = lut.gray[imgptr[i]];
         }
     }
     // JPEG output buffer, has to be larger than expected JPEG size
-    if (m_jpegData != nullptr)
+    int jpegBufSize = width * height * 4 + 1024; // extra room for JPEG conversion
+    // reused unless a frame being sent still holds it
+    if (m_jpegData != nullptr && (m_jpegBufSize != jpegBufSize || m_jpegData.use_count() > 1))
+        m_jpegData.reset();
+    if (m_jpegData == nullptr)
+    {
+        m_jpegData = NewJPEGBuffer(jpegBufSize);
+        m_jpegBufSize = jpegBufSize;
+    }
+    if (m_jpegData == nullptr)
     {
-        delete[] m_jpegData;
-        m_jpegData = nullptr;
+        dbprintlf(FATAL "Could not allocate JPEG buffer");
+        FreeBuffer(data, width * height * channels);
+        convert_jpeg = false;
+        sz_jpegData = 0;
+        m_jpegBufSize = 0;
+        return;
     }
-    m_jpegData = new uint8_t[m_imageWidth * m_imageHeight * 4 + 1024]; // extra room for JPEG conversion
+    sz_jpegData = m_jpegBufSize;
     // JPEG parameters
     jpge::params params;
     params.m_quality = JpegQuality;
-    params.m_subsampling = static_cast<jpge::subsampling_t>(2); // 0 == grey, 2 == RGB
-    // JPEG compression and image update
-    if (!jpge::compress_image_to_jpeg_file_in_memory(m_jpegData, sz_jpegData, m_imageWidth, m_imageHeight, 3, data, params))
+    params.m_subsampling = overlay ? jpge::H2V1 : jpge::Y_ONLY;
+    m_jpegMono = !overlay;
+    m_jpegWidth = width;
+    m_jpegHeight = height;
+    // JPEG compression and image update, strips encoded in parallel
+    int numThreads = jpegThreads > 0 ? jpegThreads : std::thread::hardware_concurrency();
+    if (!jpge::compress_image_to_jpeg_file_in_memory(m_jpegData.get(), sz_jpegData, width, height, channels, data, params, numThreads, &GetJPEGEncoderCache()))
     {
         dbprintlf(FATAL "Failed to compress image to jpeg in memory\n");
     }
-    delete[] data;
+    FreeBuffer(data, width * height * channels);
 }
 
-void CImageData::GetJPEGData(unsigned char *&ptr, int &sz)
+void CImageData::GetJPEGData(unsigned char *&ptr, int &sz, int maxDimension)
 {
-    if (!convert_jpeg)
+    // smallest pyramid level still covering the requested size
+    int level = 0;
+    if (maxDimension > 0)
+    {
+        int levels = PyramidLevels();
+        while ((level < levels) && (std::max(m_imageWidth >> (level + 1), m_imageHeight >> (level + 1)) >= maxDimension))
+            level++;
+    }
+    if (!convert_jpeg || (level != m_jpegLevel))
     {
         convert_jpeg = true;
+        m_jpegLevel = level;
         ConvertJPEG();
     }
-    ptr = m_jpegData;
+    ptr = m_jpegData.get();
     sz = sz_jpegData;
 }
 
-/* Sorting */
-int _compare_uint16(const void *a, const void *b)
+std::shared_ptr<const unsigned char> CImageData::GetJPEGBuffer(int &sz, int maxDimension)
 {
-    return (*((unsigned short *)a) - *((unsigned short *)b));
+    unsigned char *ptr;
+    GetJPEGData(ptr, sz, maxDimension);
+    if (ptr == nullptr || sz <= 0)
+    {
+        sz = 0;
+        return std::shared_ptr<const unsigned char>();
+    }
+    return m_jpegData;
 }
-/* End Sorting */
 
 bool CImageData::FindOptimumExposure(float &targetExposure, int &bin, float percentilePixel, int pixelTarget, float maxAllowedExposure, int maxAllowedBin, int numPixelExclusion, int pixelTargetUncertainty)
 {
+    if (!HasData())
+        return false;
     double exposure = m_exposureTime;
     targetExposure = exposure;
     bool changeBin = true;
@@ -522,12 +951,17 @@ bool CImageData::FindOptimumExposure(float &targetExposure, int &bin, float perc
     dbprintlf("Input: %lf s, bin %d x %d", exposure, m_binX, m_binY);
     double val;
     int m_imageSize = m_imageHeight * m_imageWidth;
-    uint16_t *picdata = new uint16_t[m_imageSize];
-    memcpy(picdata, m_imageData, m_imageSize * sizeof(uint16_t));
-    qsort(picdata, m_imageSize, sizeof(unsigned short), _compare_uint16);
+    // pixel ranks from the histogram, exact and without sorting a copy of the frame
+    uint32_t *hist = (uint32_t *)AllocBuffer(HISTOGRAM_BINS * sizeof(uint32_t));
+    if (hist == NULL)
+    {
+        dbprintlf(FATAL "Could not allocate histogram");
+        return false;
+    }
+    GetHistogram(hist);
 
     bool direction;
-    if (picdata[0] < picdata[m_imageSize - 1])
+    if (Stats().min < Stats().max)
         direction = true;
     else
         direction = false;
@@ -540,13 +974,14 @@ bool CImageData::FindOptimumExposure(float &targetExposure, int &bin, float perc
     if (validPixelCoord < numPixelExclusion)
         coord = m_imageSize - 1 - numPixelExclusion;
     if (direction)
-        val = picdata[coord];
+        val = HistogramRank(hist, coord);
     else
     {
         if (coord == 0)
             coord = 1;
-        val = picdata[m_imageSize - coord];
+        val = HistogramRank(hist, m_imageSize - coord);
     }
+    FreeBuffer(hist, HISTOGRAM_BINS * sizeof(uint32_t));
 
     float targetExposure_;
     int bin_ = bin;
@@ -599,7 +1034,6 @@ ret:
     if (bin > maxAllowedBin)
         bin = maxAllowedBin;
     dbprintlf(YELLOW_FG "Final exposure and bin: %f s, %d", targetExposure, bin);
-    delete[] picdata;
     return true;
 }
 
@@ -616,85 +1050,264 @@ bool CImageData::FindOptimumExposure(float &targetExposure, float percentilePixe
 #define DIR_DELIM "\\"
 #endif
 
-void CImageData::SaveFits(char *filePrefix, char *DirPrefix, bool filePrefixIsName, int i, int n, char *outString, ssize_t outStringSz, bool syncOnWrite)
+bool CImageData::GetFitsFileName(char *fileName, size_t fileNameSz, const char *filePrefix, const char *DirPrefix, bool filePrefixIsName, int i, int n) const
 {
-    static char defaultFilePrefix[] = "atik";
-    static char defaultDirPrefix[] = "." DIR_DELIM "fits" DIR_DELIM;
+    static const char defaultFilePrefix[] = "atik";
+    static const char defaultDirPrefix[] = "." DIR_DELIM "fits" DIR_DELIM;
     if ((filePrefix == NULL) || (strlen(filePrefix) == 0))
         filePrefix = defaultFilePrefix;
     if ((DirPrefix == NULL) || (strlen(DirPrefix) == 0))
         DirPrefix = defaultDirPrefix;
-    char fileName[256];
-    char *fileName_s;
-    fitsfile *fptr;
-    int status = 0, bitpix = USHORT_IMG, naxis = 2;
-    int bzero = 32768, bscale = 1;
-    long naxes[2] = {(long)(m_imageWidth), (long)(m_imageHeight)};
     unsigned int exposureTime = m_exposureTime * 1000U;
+    int len;
     if (!filePrefixIsName)
     {
         if (n > 0)
-        {
-            if (_snprintf(fileName, sizeof(fileName), "%s" DIR_DELIM "%s_%ums_%d_%d_%llu.fit", DirPrefix, filePrefix, exposureTime, i, n, (unsigned long long)m_timestamp) > (int)sizeof(fileName))
-                goto print_err;
-        }
+            len = _snprintf(fileName, fileNameSz, "%s" DIR_DELIM "%s_%ums_%d_%d_%llu.fit", DirPrefix, filePrefix, exposureTime, i, n, (unsigned long long)m_timestamp);
         else
-        {
-            if (_snprintf(fileName, sizeof(fileName), "%s" DIR_DELIM "%s_%ums_%llu.fit", DirPrefix, filePrefix, exposureTime, (unsigned long long)m_timestamp) > (int)sizeof(fileName))
-                goto print_err;
-        }
+            len = _snprintf(fileName, fileNameSz, "%s" DIR_DELIM "%s_%ums_%llu.fit", DirPrefix, filePrefix, exposureTime, (unsigned long long)m_timestamp);
     }
     else
     {
         if (n > 0)
         {
             dbprintlf(FATAL "Saving snapshots is not allowed with provided file name");
+            return false;
         }
-        else
-        {
-            if (_snprintf(fileName, sizeof(fileName), "%s" DIR_DELIM "%s.fit", DirPrefix, filePrefix))
-                goto print_err;
-        }
+        len = _snprintf(fileName, fileNameSz, "%s" DIR_DELIM "%s.fit", DirPrefix, filePrefix);
+    }
+    return len > 0 && len < (int)fileNameSz;
+}
+
+bool CImageData::SyncFile(const char *path, bool dataOnly)
+{
+#if !defined(OS_Windows)
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+    {
+        dbprintlf(RED_FG "Could not open %s for syncing", path);
+        return false;
     }
+    int ret = dataOnly ? fdatasync(fd) : fsync(fd);
+    close(fd);
+    if (ret)
+        dbprintlf(RED_FG "Could not sync %s", path);
+    return ret == 0;
+#else
+    sync();
+    return true;
+#endif
+}
+
+bool CImageData::WriteFitsHDU(void *fitsFile, int &status) const
+{
+    fitsfile *fptr = (fitsfile *)fitsFile;
+    if (m_imageData == NULL || status)
+        return false;
+    int bzero = 32768, bscale = 1;
+    unsigned int exposureTime = m_exposureTime * 1000U;
+    int tileWidth = (fitsTileWidth <= 0 || fitsTileWidth > m_imageWidth) ? m_imageWidth : fitsTileWidth;
+    int tileHeight = (fitsTileHeight <= 0 || fitsTileHeight > m_imageHeight) ? m_imageHeight : fitsTileHeight;
+
+    // tiles are Rice compressed in parallel here instead of serially inside cfitsio
+    std::vector<std::vector<uint8_t>> tiles;
+    RiceCompressTilesU16(m_imageData, m_imageWidth, m_imageHeight, tileWidth, tileHeight, fitsThreads, tiles);
+
+    // the image as a tile compressed binary table (ZIMAGE)
+    char *ttype[] = {(char *)"COMPRESSED_DATA"};
+    char *tform[] = {(char *)"1PB"};
+    int zimage = 1, zbitpix = SHORT_IMG, znaxis = 2, blocksize = 32, bytepix = 2;
+    fits_create_tbl(fptr, BINARY_TBL, tiles.size(), 1, ttype, tform, NULL, "COMPRESSED_IMAGE", &status);
+    fits_write_key(fptr, TLOGICAL, "ZIMAGE", &zimage, "extension contains compressed image", &status);
+    fits_write_key(fptr, TINT, "ZBITPIX", &zbitpix, "data type of original image", &status);
+    fits_write_key(fptr, TINT, "ZNAXIS", &znaxis, "dimension of original image", &status);
+    fits_write_key(fptr, TINT, "ZNAXIS1", (void *)&m_imageWidth, "length of original image axis", &status);
+    fits_write_key(fptr, TINT, "ZNAXIS2", (void *)&m_imageHeight, "length of original image axis", &status);
+    fits_write_key(fptr, TINT, "ZTILE1", &tileWidth, "size of tiles to be compressed", &status);
+    fits_write_key(fptr, TINT, "ZTILE2", &tileHeight, "size of tiles to be compressed", &status);
+    fits_write_key(fptr, TSTRING, "ZCMPTYPE", (void *)"RICE_1", "compression algorithm", &status);
+    fits_write_key(fptr, TSTRING, "ZNAME1", (void *)"BLOCKSIZE", "compression block size", &status);
+    fits_write_key(fptr, TINT, "ZVAL1", &blocksize, "pixels per block", &status);
+    fits_write_key(fptr, TSTRING, "ZNAME2", (void *)"BYTEPIX", "bytes per pixel (1, 2, 4, or 8)", &status);
+    fits_write_key(fptr, TINT, "ZVAL2", &bytepix, "bytes per pixel (1, 2, 4, or 8)", &status);
+    fits_write_key(fptr, TSTRING, "PROGRAM", (void *)"hitmis_explorer", NULL, &status);
+    fits_write_key(fptr, TSTRING, "CAMERA", (void *)(m_cameraName.c_str()), NULL, &status);
+    fits_write_key(fptr, TULONGLONG, "TIMESTAMP", (void *)&(m_timestamp), NULL, &status);
+    fits_write_key(fptr, TINT, "BZERO", &bzero, NULL, &status);
+    fits_write_key(fptr, TINT, "BSCALE", &bscale, NULL, &status);
+    fits_write_key(fptr, TFLOAT, "CCDTEMP", (void *)&(m_temperature), NULL, &status);
+    fits_write_key(fptr, TUINT, "EXPOSURE_MS", &(exposureTime), NULL, &status);
+    fits_write_key(fptr, TUSHORT, "BINX", (void *)&(m_binX), NULL, &status);
+    fits_write_key(fptr, TUSHORT, "BINY", (void *)&(m_binY), NULL, &status);
+
+    for (size_t t = 0; t < tiles.size() && !status; t++)
+        fits_write_col(fptr, TBYTE, 1, t + 1, 1, tiles[t].size(), tiles[t].data(), &status);
+    return status == 0;
+}
+
+bool CImageData::SaveFits(const char *filePrefix, const char *DirPrefix, bool filePrefixIsName, int i, int n, char *outString, ssize_t outStringSz, bool syncOnWrite)
+{
+    char fileName[256];
+    fitsfile *fptr;
+    int status = 0;
+    if (m_imageData == NULL || !GetFitsFileName(fileName, sizeof(fileName), filePrefix, DirPrefix, filePrefixIsName, i, n))
+        goto print_err;
 
     unlink(fileName);
-    fileName_s = new char[strlen(fileName) + 16];
-    _snprintf(fileName_s, strlen(fileName) + 16, "%s[compress]", fileName);
-    if (!fits_create_file(&fptr, fileName_s, &status))
-    {
-        fits_create_img(fptr, bitpix, naxis, naxes, &status);
-        fits_write_key(fptr, TSTRING, "PROGRAM", (void *)"hitmis_explorer", NULL, &status);
-        fits_write_key(fptr, TSTRING, "CAMERA", (void *)(m_cameraName.c_str()), NULL, &status);
-        fits_write_key(fptr, TULONGLONG, "TIMESTAMP", &(m_timestamp), NULL, &status);
-        fits_write_key(fptr, TUSHORT, "BZERO", &bzero, NULL, &status);
-        fits_write_key(fptr, TUSHORT, "BSCALE", &bscale, NULL, &status);
-        fits_write_key(fptr, TFLOAT, "CCDTEMP", &(m_temperature), NULL, &status);
-        fits_write_key(fptr, TUINT, "EXPOSURE_MS", &(exposureTime), NULL, &status);
-        fits_write_key(fptr, TUSHORT, "BINX", &(m_binX), NULL, &status);
-        fits_write_key(fptr, TUSHORT, "BINY", &(m_binY), NULL, &status);
-
-        long fpixel[] = {1, 1};
-        fits_write_pix(fptr, TUSHORT, fpixel, (m_imageWidth) * (m_imageHeight), m_imageData, &status);
+    if (!fits_create_file(&fptr, fileName, &status))
+    {
+        // empty primary HDU, then the compressed image
+        fits_create_img(fptr, SHORT_IMG, 0, NULL, &status);
+        WriteFitsHDU(fptr, status);
         fits_close_file(fptr, &status);
+        if (status)
+        {
+            dbprintlf(FATAL "Error %d writing file %s", status, fileName);
+            goto print_err;
+        }
         if (syncOnWrite)
         {
-            sync();
+            // the file's data, then its directory entry
+            char dirName[256];
+            strcpy(dirName, fileName);
+            *strrchr(dirName, DIR_DELIM[0]) = '\0';
+            SyncFile(fileName, true);
+            SyncFile(dirName, false);
         }
         if (outString != NULL && outStringSz > 0)
         {
             _snprintf(outString, outStringSz, "wrote %d of %d", i, n);
         }
-        delete[] fileName_s;
-        return;
+        return true;
     }
     else
     {
-        dbprintlf(FATAL "Could not create file %s", fileName_s);
+        dbprintlf(FATAL "Could not create file %s", fileName);
     }
-    delete[] fileName_s;
 print_err:
 {
     if (outString != NULL && outStringSz > 0)
         _snprintf(outString, outStringSz, "failed %d of %d", i, n);
 }
+    return false;
+}
+
+// one 80 character header card, value right aligned to column 30 as cfitsio writes it
+static void FitsCard(std::string &header, const char *key, const std::string &value, bool quote = false)
+{
+    char card[81];
+    std::string v = value;
+    if (quote)
+    {
+        for (size_t pos = v.find('\''); pos != std::string::npos; pos = v.find('\'', pos + 2))
+            v.insert(pos, 1, '\'');
+        v = "'" + v + (v.size() < 8 ? std::string(8 - v.size(), ' ') : "") + "'";
+        v.resize(v.size() < 68 ? v.size() : 68);
+    }
+    if (strlen(key) > 8)
+        snprintf(card, sizeof(card), "HIERARCH %s = %s", key, v.c_str());
+    else if (quote)
+        snprintf(card, sizeof(card), "%-8s= %s", key, v.c_str());
+    else
+        snprintf(card, sizeof(card), "%-8s= %20s", key, v.c_str());
+    std::string c(card);
+    c.resize(80, ' ');
+    header += c;
+}
+
+bool CImageData::SaveFitsUncompressed(const char *filePrefix, const char *DirPrefix, bool filePrefixIsName, int i, int n, char *outString, ssize_t outStringSz, bool syncOnWrite)
+{
+    char fileName[256];
+    char value[32];
+    std::string header;
+    size_t dataSize, fileSize;
+    bool ok = false;
+    if (m_imageData == NULL || !GetFitsFileName(fileName, sizeof(fileName), filePrefix, DirPrefix, filePrefixIsName, i, n))
+        goto print_err;
+
+    FitsCard(header, "SIMPLE", "T");
+    FitsCard(header, "BITPIX", "16");
+    FitsCard(header, "NAXIS", "2");
+    FitsCard(header, "NAXIS1", std::to_string(m_imageWidth));
+    FitsCard(header, "NAXIS2", std::to_string(m_imageHeight));
+    FitsCard(header, "PROGRAM", "hitmis_explorer", true);
+    FitsCard(header, "CAMERA", m_cameraName, true);
+    FitsCard(header, "TIMESTAMP", std::to_string((unsigned long long)m_timestamp));
+    FitsCard(header, "BZERO", "32768");
+    FitsCard(header, "BSCALE", "1");
+    snprintf(value, sizeof(value), "%.7G", m_temperature);
+    FitsCard(header, "CCDTEMP", value);
+    FitsCard(header, "EXPOSURE_MS", std::to_string((unsigned int)(m_exposureTime * 1000U)));
+    FitsCard(header, "BINX", std::to_string(m_binX));
+    FitsCard(header, "BINY", std::to_string(m_binY));
+    header += "END";
+    header.resize(((header.size() + 2879) / 2880) * 2880, ' ');
+    dataSize = (size_t)m_imageWidth * m_imageHeight * 2;
+    fileSize = header.size() + ((dataSize + 2879) / 2880) * 2880;
+
+    unlink(fileName);
+#if !defined(OS_Windows)
+    {
+        // preallocate, map, and convert the pixels straight into the page cache
+        int fd = open(fileName, O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0)
+        {
+            dbprintlf(FATAL "Could not create file %s", fileName);
+            goto print_err;
+        }
+#if defined(__linux__)
+        if (fallocate(fd, 0, 0, fileSize) != 0 && ftruncate(fd, fileSize) != 0)
+#else
+        if (ftruncate(fd, fileSize) != 0)
+#endif
+        {
+            dbprintlf(FATAL "Could not allocate %zu bytes for %s", fileSize, fileName);
+        }
+        else
+        {
+            uint8_t *map = (uint8_t *)mmap(NULL, fileSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+            if (map != MAP_FAILED)
+            {
+                memcpy(map, header.data(), header.size());
+                PixelToFitsU16(m_imageData, (size_t)m_imageWidth * m_imageHeight, map + header.size());
+                memset(map + header.size() + dataSize, 0, fileSize - header.size() - dataSize);
+                ok = !syncOnWrite || msync(map, fileSize, MS_SYNC) == 0;
+                munmap(map, fileSize);
+            }
+        }
+        close(fd);
+    }
+#else
+    {
+        std::vector<uint8_t> buf(fileSize, 0);
+        memcpy(buf.data(), header.data(), header.size());
+        PixelToFitsU16(m_imageData, (size_t)m_imageWidth * m_imageHeight, buf.data() + header.size());
+        FILE *fp = fopen(fileName, "wb");
+        if (fp != NULL)
+        {
+            ok = fwrite(buf.data(), fileSize, 1, fp) == 1;
+            fclose(fp);
+        }
+    }
+#endif
+    if (!ok)
+    {
+        dbprintlf(FATAL "Error writing file %s", fileName);
+        goto print_err;
+    }
+    if (syncOnWrite)
+    {
+        // the pages were synced above, now the directory entry
+        char dirName[256];
+        strcpy(dirName, fileName);
+        *strrchr(dirName, DIR_DELIM[0]) = '\0';
+        SyncFile(dirName, false);
+    }
+    if (outString != NULL && outStringSz > 0)
+        _snprintf(outString, outStringSz, "wrote %d of %d", i, n);
+    return true;
+print_err:
+    if (outString != NULL && outStringSz > 0)
+        _snprintf(outString, outStringSz, "failed %d of %d", i, n);
+    return false;
 }
\ No newline at end of file
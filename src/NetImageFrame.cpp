@@ -0,0 +1,319 @@
+/**
+ * @file NetImageFrame.cpp
+ * @author Sunip K. Mukherjee (sunipkmukherjee@gmail.com)
+ * @brief Image frame sent to the controller without copying the image data
+ * @version 0.1
+ * @date 2022-01-03
+ *
+ * @copyright Copyright (c) 2022
+ *
+ */
+#include "NetImageFrame.hpp"
+#include "RiceCompress.hpp"
+#include "meb_print.h"
+
+#include <string.h>
+#include <errno.h>
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+#if !defined(OS_Windows)
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#endif
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+#ifndef MSG_MORE
+#define MSG_MORE 0
+#endif
+
+#define NETIMG_MAX_JPEG_SIZE (64 << 20) // largest JPEG frame accepted by Receive()
+
+CNetImageFrame::CNetImageFrame(const netimg_meta &meta, std::shared_ptr<const uint8_t> data)
+    : meta_(meta), data_(std::move(data)), chunkRows_(0), numThreads_(0)
+{
+    if (data_ == nullptr)
+        meta_.size = 0;
+}
+
+CNetImageFrame::CNetImageFrame(CImageData &image, int maxDimension)
+    : chunkRows_(0), numThreads_(0)
+{
+    memset(&meta_, 0, sizeof(meta_));
+    int sz = 0;
+    data_ = image.GetJPEGBuffer(sz, maxDimension);
+    meta_.width = image.GetJPEGWidth();
+    meta_.height = image.GetJPEGHeight();
+    meta_.temperature = image.GetTemperature() * 100; // in 100th of degree
+    meta_.exposure_ms = image.GetExposure() * 1000;
+    meta_.tstamp = image.GetTimestamp();
+    meta_.type = image.IsJPEGMono() ? JPEGMONO : JPEGRGB;
+    meta_.size = data_ == nullptr ? 0 : sz;
+}
+
+CNetImageFrame::CNetImageFrame(netimg_type type, const CImageData &image, int chunkRows, int numThreads)
+    : image_(image), chunkRows_(chunkRows > 0 ? chunkRows : 64), numThreads_(numThreads)
+{
+    memset(&meta_, 0, sizeof(meta_));
+    if (type != RAW16 && type != RICE16)
+    {
+        dbprintlf(FATAL "Image frame type %d does not carry raw pixels", (int)type);
+        image_.ClearImage();
+        return;
+    }
+    meta_.width = image.GetImageWidth();
+    meta_.height = image.GetImageHeight();
+    meta_.temperature = image.GetTemperature() * 100; // in 100th of degree
+    meta_.exposure_ms = image.GetExposure() * 1000;
+    meta_.tstamp = image.GetTimestamp();
+    meta_.type = type;
+    meta_.size = image.HasData() ? image.GetImageWidth() * image.GetImageHeight() * sizeof(uint16_t) : 0;
+}
+
+bool CNetImageFrame::DecodeChunk(const netimg_chunk &chunk, const uint8_t *data, int width, int height, uint16_t *pixels)
+{
+    if (width <= 0 || chunk.rows == 0 || chunk.y + chunk.rows > height)
+        return false;
+    size_t count = (size_t)width * chunk.rows;
+    int16_t *dst = (int16_t *)(pixels + (size_t)chunk.y * width);
+    if (!RiceDecode16(data, chunk.size, dst, count))
+        return false;
+    for (size_t i = 0; i < count; i++) // signed to unsigned, BZERO = 32768
+        pixels[(size_t)chunk.y * width + i] ^= 0x8000;
+    return true;
+}
+
+#if !defined(OS_Windows)
+// write iov completely, flags for sendmsg (e.g. MSG_MORE)
+static bool SendAll(int fd, struct iovec *iov, int count, int flags, int timeout_ms, uint64_t tstamp)
+{
+    while (count > 0 && iov->iov_len == 0)
+    {
+        iov++;
+        count--;
+    }
+    while (count > 0)
+    {
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = count;
+        ssize_t sent = sendmsg(fd, &msg, MSG_NOSIGNAL | flags);
+        if (sent < 0 && errno == ENOTSOCK) // pipe or file
+            sent = writev(fd, iov, count);
+        if (sent < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                struct pollfd pfd = {fd, POLLOUT, 0};
+                int ret = poll(&pfd, 1, timeout_ms);
+                if (ret > 0 || (ret < 0 && errno == EINTR))
+                    continue;
+                dbprintlf(FATAL "Timed out sending image frame %llu", (unsigned long long)tstamp);
+                return false;
+            }
+            dbprintlf(FATAL "Error sending image frame %llu: %s", (unsigned long long)tstamp, strerror(errno));
+            return false;
+        }
+        // resume after a short write
+        while (count > 0 && (size_t)sent >= iov->iov_len)
+        {
+            sent -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (count > 0)
+        {
+            iov->iov_base = (uint8_t *)iov->iov_base + sent;
+            iov->iov_len -= sent;
+        }
+    }
+    return true;
+}
+
+bool CNetImageFrame::Send(int fd, int timeout_ms) const
+{
+    if (meta_.type == RICE16)
+        return SendChunks(fd, timeout_ms);
+    struct iovec iov[2];
+    iov[0].iov_base = (void *)&meta_;
+    iov[0].iov_len = sizeof(meta_);
+    // RAW16 pixels go out as they are in memory, little endian
+    iov[1].iov_base = meta_.type == RAW16 ? (void *)image_.GetImageData() : (void *)data_.get();
+    iov[1].iov_len = HasData() ? meta_.size : 0;
+    return SendAll(fd, iov, 2, 0, timeout_ms, meta_.tstamp);
+}
+
+bool CNetImageFrame::SendChunks(int fd, int timeout_ms) const
+{
+    struct iovec iov[2];
+    iov[0].iov_base = (void *)&meta_;
+    iov[0].iov_len = sizeof(meta_);
+    if (!HasData())
+        return SendAll(fd, iov, 1, 0, timeout_ms, meta_.tstamp);
+    if (!SendAll(fd, iov, 1, MSG_MORE, timeout_ms, meta_.tstamp))
+        return false;
+
+    const uint16_t *pixels = image_.GetImageData();
+    int width = image_.GetImageWidth();
+    int height = image_.GetImageHeight();
+    int numChunks = (height + chunkRows_ - 1) / chunkRows_;
+    int numThreads = numThreads_ > 0 ? numThreads_ : std::thread::hardware_concurrency();
+    if (numThreads < 1)
+        numThreads = 1;
+    if (numThreads > numChunks)
+        numThreads = numChunks;
+
+    // workers code chunks in order of their number, this thread sends each one once it is coded
+    std::vector<std::vector<uint8_t>> coded(numChunks);
+    std::vector<bool> ready(numChunks, false);
+    std::mutex cs;
+    std::condition_variable cv;
+    std::atomic<int> nextChunk(0);
+    std::atomic<bool> cancel(false);
+    auto worker = [&]()
+    {
+        std::vector<std::vector<uint8_t>> tile;
+        int chunk;
+        while (!cancel && (chunk = nextChunk++) < numChunks)
+        {
+            int y0 = chunk * chunkRows_;
+            int rows = height - y0 < chunkRows_ ? height - y0 : chunkRows_;
+            RiceCompressTilesU16(pixels + (size_t)y0 * width, width, rows, width, rows, 1, tile);
+            std::lock_guard<std::mutex> lock(cs);
+            coded[chunk].swap(tile[0]);
+            ready[chunk] = true;
+            cv.notify_all();
+        }
+    };
+    std::vector<std::thread> threads;
+    for (int i = 0; i < numThreads; i++)
+        threads.push_back(std::thread(worker));
+
+    bool ok = true;
+    for (int chunk = 0; chunk < numChunks && ok; chunk++)
+    {
+        std::vector<uint8_t> data;
+        {
+            std::unique_lock<std::mutex> lock(cs);
+            cv.wait(lock, [&]()
+                    { return ready[chunk]; });
+            data.swap(coded[chunk]);
+        }
+        netimg_chunk header;
+        header.y = chunk * chunkRows_;
+        header.rows = height - header.y < chunkRows_ ? height - header.y : chunkRows_;
+        header.size = data.size();
+        iov[0].iov_base = &header;
+        iov[0].iov_len = sizeof(header);
+        iov[1].iov_base = data.data();
+        iov[1].iov_len = data.size();
+        ok = SendAll(fd, iov, 2, chunk + 1 < numChunks ? MSG_MORE : 0, timeout_ms, meta_.tstamp);
+    }
+    cancel = true;
+    for (size_t i = 0; i < threads.size(); i++)
+        threads[i].join();
+    return ok;
+}
+// read len bytes completely
+static bool RecvAll(int fd, void *buf, size_t len, int timeout_ms)
+{
+    uint8_t *ptr = (uint8_t *)buf;
+    while (len > 0)
+    {
+        ssize_t got = recv(fd, ptr, len, 0);
+        if (got < 0 && errno == ENOTSOCK) // pipe or file
+            got = read(fd, ptr, len);
+        if (got == 0)
+            return false; // end of stream
+        if (got < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                struct pollfd pfd = {fd, POLLIN, 0};
+                int ret = poll(&pfd, 1, timeout_ms);
+                if (ret > 0 || (ret < 0 && errno == EINTR))
+                    continue;
+                dbprintlf(FATAL "Timed out receiving image frame");
+                return false;
+            }
+            dbprintlf(FATAL "Error receiving image frame: %s", strerror(errno));
+            return false;
+        }
+        ptr += got;
+        len -= got;
+    }
+    return true;
+}
+
+bool CNetImageFrame::Receive(int fd, netimg_meta &meta, std::vector<uint8_t> &data, int timeout_ms)
+{
+    if (!RecvAll(fd, &meta, sizeof(meta), timeout_ms))
+        return false;
+    size_t pixelBytes = (size_t)meta.width * meta.height * sizeof(uint16_t);
+    bool raw = meta.type == RAW16 || meta.type == RICE16;
+    if (meta.size < 0 || (raw && (size_t)meta.size != pixelBytes) || (!raw && meta.size > NETIMG_MAX_JPEG_SIZE))
+    {
+        dbprintlf(FATAL "Invalid image frame %llu: type %d, %d x %d, %d bytes", (unsigned long long)meta.tstamp, meta.type, meta.width, meta.height, meta.size);
+        return false;
+    }
+    data.resize(meta.size);
+    if (meta.type != RICE16)
+        return RecvAll(fd, data.data(), data.size(), timeout_ms);
+
+    // chunks of rows top to bottom, decoded as they arrive
+    std::vector<uint8_t> coded;
+    int y = 0;
+    while (y < meta.height)
+    {
+        netimg_chunk chunk;
+        if (!RecvAll(fd, &chunk, sizeof(chunk), timeout_ms))
+            return false;
+        // a Rice coded block is at most a bit per pixel larger than the pixels
+        size_t count = (size_t)meta.width * chunk.rows;
+        size_t maxSize = count * sizeof(uint16_t) + count / 8 + 64;
+        if (chunk.y != y || chunk.rows == 0 || chunk.size > maxSize)
+        {
+            dbprintlf(FATAL "Invalid chunk of image frame %llu at row %d", (unsigned long long)meta.tstamp, y);
+            return false;
+        }
+        coded.resize(chunk.size);
+        if (!RecvAll(fd, coded.data(), coded.size(), timeout_ms))
+            return false;
+        if (!DecodeChunk(chunk, coded.data(), meta.width, meta.height, (uint16_t *)data.data()))
+        {
+            dbprintlf(FATAL "Corrupt chunk of image frame %llu at row %d", (unsigned long long)meta.tstamp, y);
+            return false;
+        }
+        y += chunk.rows;
+    }
+    return true;
+}
+#else
+bool CNetImageFrame::Send(int fd, int timeout_ms) const
+{
+    dbprintlf(FATAL "Image frames can not be sent on this platform");
+    return false;
+}
+
+bool CNetImageFrame::SendChunks(int fd, int timeout_ms) const
+{
+    return false;
+}
+
+bool CNetImageFrame::Receive(int fd, netimg_meta &meta, std::vector<uint8_t> &data, int timeout_ms)
+{
+    dbprintlf(FATAL "Image frames can not be received on this platform");
+    return false;
+}
+#endif
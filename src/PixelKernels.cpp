@@ -0,0 +1,410 @@
+/**
+ * @file PixelKernels.cpp
+ * @author Sunip K. Mukherjee (sunipkmukherjee@gmail.com)
+ * @brief Vectorized kernels for 16-bit pixel data implementation
+ * @version 0.1
+ * @date 2022-01-03
+ *
+ * @copyright Copyright (c) 2022
+ *
+ */
+#include "PixelKernels.hpp"
+
+#include <vector>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define PIXELKERNELS_AVX2
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define PIXELKERNELS_SSE2
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define PIXELKERNELS_NEON
+#endif
+
+const char *PixelKernelsISA()
+{
+#if defined(PIXELKERNELS_AVX2)
+    return "avx2";
+#elif defined(PIXELKERNELS_SSE2)
+    return "sse2";
+#elif defined(PIXELKERNELS_NEON)
+    return "neon";
+#else
+    return "scalar";
+#endif
+}
+
+static inline void PixelStatsScalar(const uint16_t *data, size_t count, PixelStats &stats)
+{
+    uint16_t min = stats.min, max = stats.max;
+    uint64_t sum = 0, sumsq = 0;
+    for (size_t i = 0; i < count; i++)
+    {
+        uint32_t v = data[i];
+        min = v < min ? v : min;
+        max = v > max ? v : max;
+        sum += v;
+        sumsq += v * v;
+    }
+    stats.min = min;
+    stats.max = max;
+    stats.sum += sum;
+    stats.sumsq += sumsq;
+}
+
+/*
+ * The x86 kernels work on y = x - 0x8000 as signed 16-bit (x ^ 0x8000):
+ * - min/max use the signed compares available in SSE2,
+ * - _mm_madd_epi16(y, y) gives y0^2 + y1^2 <= 2^31, which fits an unsigned 32-bit lane,
+ *   and sum(x^2) = sum(y^2) + 0x10000 * sum(x) - n * 2^30.
+ * Sums of x are taken with SAD against zero on the low and high bytes, which produces
+ * 64-bit lanes directly.
+ */
+#if defined(PIXELKERNELS_AVX2)
+static void PixelStatsSIMD(const uint16_t *data, size_t count, PixelStats &stats)
+{
+    const __m256i bias = _mm256_set1_epi16((short)0x8000);
+    const __m256i lomask = _mm256_set1_epi16(0x00ff);
+    const __m256i zero = _mm256_setzero_si256();
+    __m256i vmin = _mm256_set1_epi16(0x7fff);
+    __m256i vmax = _mm256_set1_epi16((short)0x8000);
+    __m256i vsumlo = zero, vsumhi = zero, vsq = zero;
+    size_t n = count & ~(size_t)15;
+    for (size_t i = 0; i < n; i += 16)
+    {
+        __m256i x = _mm256_loadu_si256((const __m256i *)(data + i));
+        __m256i y = _mm256_xor_si256(x, bias);
+        vmin = _mm256_min_epi16(vmin, y);
+        vmax = _mm256_max_epi16(vmax, y);
+        vsumlo = _mm256_add_epi64(vsumlo, _mm256_sad_epu8(_mm256_and_si256(x, lomask), zero));
+        vsumhi = _mm256_add_epi64(vsumhi, _mm256_sad_epu8(_mm256_srli_epi16(x, 8), zero));
+        __m256i sq = _mm256_madd_epi16(y, y);
+        vsq = _mm256_add_epi64(vsq, _mm256_unpacklo_epi32(sq, zero));
+        vsq = _mm256_add_epi64(vsq, _mm256_unpackhi_epi32(sq, zero));
+    }
+    uint16_t lmin[16], lmax[16];
+    uint64_t lsumlo[4], lsumhi[4], lsq[4];
+    _mm256_storeu_si256((__m256i *)lmin, _mm256_xor_si256(vmin, bias));
+    _mm256_storeu_si256((__m256i *)lmax, _mm256_xor_si256(vmax, bias));
+    _mm256_storeu_si256((__m256i *)lsumlo, vsumlo);
+    _mm256_storeu_si256((__m256i *)lsumhi, vsumhi);
+    _mm256_storeu_si256((__m256i *)lsq, vsq);
+    uint64_t sum = 0, sqy = 0;
+    for (int i = 0; i < 4; i++)
+    {
+        sum += lsumlo[i] + (lsumhi[i] << 8);
+        sqy += lsq[i];
+    }
+    for (int i = 0; (n > 0) && (i < 16); i++)
+    {
+        stats.min = lmin[i] < stats.min ? lmin[i] : stats.min;
+        stats.max = lmax[i] > stats.max ? lmax[i] : stats.max;
+    }
+    stats.sum += sum;
+    stats.sumsq += sqy + (sum << 16) - ((uint64_t)n << 30);
+    PixelStatsScalar(data + n, count - n, stats);
+}
+#elif defined(PIXELKERNELS_SSE2)
+static void PixelStatsSIMD(const uint16_t *data, size_t count, PixelStats &stats)
+{
+    const __m128i bias = _mm_set1_epi16((short)0x8000);
+    const __m128i lomask = _mm_set1_epi16(0x00ff);
+    const __m128i zero = _mm_setzero_si128();
+    __m128i vmin = _mm_set1_epi16(0x7fff);
+    __m128i vmax = _mm_set1_epi16((short)0x8000);
+    __m128i vsumlo = zero, vsumhi = zero, vsq = zero;
+    size_t n = count & ~(size_t)7;
+    for (size_t i = 0; i < n; i += 8)
+    {
+        __m128i x = _mm_loadu_si128((const __m128i *)(data + i));
+        __m128i y = _mm_xor_si128(x, bias);
+        vmin = _mm_min_epi16(vmin, y);
+        vmax = _mm_max_epi16(vmax, y);
+        vsumlo = _mm_add_epi64(vsumlo, _mm_sad_epu8(_mm_and_si128(x, lomask), zero));
+        vsumhi = _mm_add_epi64(vsumhi, _mm_sad_epu8(_mm_srli_epi16(x, 8), zero));
+        __m128i sq = _mm_madd_epi16(y, y);
+        vsq = _mm_add_epi64(vsq, _mm_unpacklo_epi32(sq, zero));
+        vsq = _mm_add_epi64(vsq, _mm_unpackhi_epi32(sq, zero));
+    }
+    uint16_t lmin[8], lmax[8];
+    uint64_t lsumlo[2], lsumhi[2], lsq[2];
+    _mm_storeu_si128((__m128i *)lmin, _mm_xor_si128(vmin, bias));
+    _mm_storeu_si128((__m128i *)lmax, _mm_xor_si128(vmax, bias));
+    _mm_storeu_si128((__m128i *)lsumlo, vsumlo);
+    _mm_storeu_si128((__m128i *)lsumhi, vsumhi);
+    _mm_storeu_si128((__m128i *)lsq, vsq);
+    uint64_t sum = 0, sqy = 0;
+    for (int i = 0; i < 2; i++)
+    {
+        sum += lsumlo[i] + (lsumhi[i] << 8);
+        sqy += lsq[i];
+    }
+    for (int i = 0; (n > 0) && (i < 8); i++)
+    {
+        stats.min = lmin[i] < stats.min ? lmin[i] : stats.min;
+        stats.max = lmax[i] > stats.max ? lmax[i] : stats.max;
+    }
+    stats.sum += sum;
+    stats.sumsq += sqy + (sum << 16) - ((uint64_t)n << 30);
+    PixelStatsScalar(data + n, count - n, stats);
+}
+#elif defined(PIXELKERNELS_NEON)
+static void PixelStatsSIMD(const uint16_t *data, size_t count, PixelStats &stats)
+{
+    uint16x8_t vmin = vdupq_n_u16(0xffff);
+    uint16x8_t vmax = vdupq_n_u16(0);
+    uint64x2_t vsum = vdupq_n_u64(0), vsq = vdupq_n_u64(0);
+    size_t n = count & ~(size_t)7;
+    for (size_t i = 0; i < n; i += 8)
+    {
+        uint16x8_t x = vld1q_u16(data + i);
+        vmin = vminq_u16(vmin, x);
+        vmax = vmaxq_u16(vmax, x);
+        vsum = vpadalq_u32(vsum, vpaddlq_u16(x));
+        // x^2 < 2^32, widen each product pair straight into the 64-bit accumulator
+        vsq = vpadalq_u32(vsq, vmull_u16(vget_low_u16(x), vget_low_u16(x)));
+        vsq = vpadalq_u32(vsq, vmull_u16(vget_high_u16(x), vget_high_u16(x)));
+    }
+    uint16_t lmin[8], lmax[8];
+    uint64_t lsum[2], lsq[2];
+    vst1q_u16(lmin, vmin);
+    vst1q_u16(lmax, vmax);
+    vst1q_u64(lsum, vsum);
+    vst1q_u64(lsq, vsq);
+    for (int i = 0; (n > 0) && (i < 8); i++)
+    {
+        stats.min = lmin[i] < stats.min ? lmin[i] : stats.min;
+        stats.max = lmax[i] > stats.max ? lmax[i] : stats.max;
+    }
+    stats.sum += lsum[0] + lsum[1];
+    stats.sumsq += lsq[0] + lsq[1];
+    PixelStatsScalar(data + n, count - n, stats);
+}
+#else
+static void PixelStatsSIMD(const uint16_t *data, size_t count, PixelStats &stats)
+{
+    PixelStatsScalar(data, count, stats);
+}
+#endif
+
+void PixelStatsU16(const uint16_t *data, size_t count, PixelStats &stats)
+{
+    stats.min = 0xffff;
+    stats.max = 0;
+    stats.sum = 0;
+    stats.sumsq = 0;
+    if (data == NULL || count == 0)
+        return;
+    PixelStatsSIMD(data, count, stats);
+}
+
+/*
+ * Binning: every output row is accumulated in a 32-bit row buffer, one source row at a
+ * time, so both the source and the accumulator are walked sequentially and the bin
+ * factor is a compile-time constant in the common cases.
+ */
+template <int BX>
+static inline void BinRowAdd(const uint16_t *src, int newWidth, uint32_t *acc)
+{
+    for (int i = 0; i < newWidth; i++)
+    {
+        uint32_t sum = 0;
+        for (int k = 0; k < BX; k++)
+            sum += src[i * BX + k];
+        acc[i] += sum;
+    }
+}
+
+template <>
+inline void BinRowAdd<2>(const uint16_t *src, int newWidth, uint32_t *acc)
+{
+    int i = 0;
+#if defined(PIXELKERNELS_AVX2) || defined(PIXELKERNELS_SSE2)
+    // adjacent pixel pairs summed in 32-bit lanes
+    const __m128i lomask = _mm_set1_epi32(0xffff);
+    for (; i + 4 <= newWidth; i += 4)
+    {
+        __m128i x = _mm_loadu_si128((const __m128i *)(src + 2 * i));
+        __m128i pairs = _mm_add_epi32(_mm_and_si128(x, lomask), _mm_srli_epi32(x, 16));
+        __m128i a = _mm_loadu_si128((const __m128i *)(acc + i));
+        _mm_storeu_si128((__m128i *)(acc + i), _mm_add_epi32(a, pairs));
+    }
+#elif defined(PIXELKERNELS_NEON)
+    for (; i + 4 <= newWidth; i += 4)
+    {
+        vst1q_u32(acc + i, vpadalq_u16(vld1q_u32(acc + i), vld1q_u16(src + 2 * i)));
+    }
+#endif
+    for (; i < newWidth; i++)
+        acc[i] += (uint32_t)src[2 * i] + src[2 * i + 1];
+}
+
+static inline void BinRowAddGeneric(const uint16_t *src, int newWidth, int binX, uint32_t *acc)
+{
+    for (int i = 0; i < newWidth; i++)
+    {
+        uint32_t sum = 0;
+        for (int k = 0; k < binX; k++)
+            sum += src[i * binX + k];
+        acc[i] += sum;
+    }
+}
+
+static inline void BinRowStore(const uint32_t *acc, int newWidth, uint16_t *dst)
+{
+    int i = 0;
+#if defined(PIXELKERNELS_AVX2) || defined(PIXELKERNELS_SSE2)
+    // saturating 32 -> 16 bit narrowing through a signed pack
+    const __m128i bias32 = _mm_set1_epi32(0x8000);
+    const __m128i bias16 = _mm_set1_epi16((short)0x8000);
+    for (; i + 8 <= newWidth; i += 8)
+    {
+        __m128i a0 = _mm_sub_epi32(_mm_loadu_si128((const __m128i *)(acc + i)), bias32);
+        __m128i a1 = _mm_sub_epi32(_mm_loadu_si128((const __m128i *)(acc + i + 4)), bias32);
+        _mm_storeu_si128((__m128i *)(dst + i), _mm_xor_si128(_mm_packs_epi32(a0, a1), bias16));
+    }
+#elif defined(PIXELKERNELS_NEON)
+    for (; i + 8 <= newWidth; i += 8)
+    {
+        vst1q_u16(dst + i, vcombine_u16(vqmovn_u32(vld1q_u32(acc + i)), vqmovn_u32(vld1q_u32(acc + i + 4))));
+    }
+#endif
+    for (; i < newWidth; i++)
+        dst[i] = acc[i] > 0xffff ? 0xffff : acc[i];
+}
+
+template <int BX>
+static void PixelBinFixed(const uint16_t *src, int width, int newWidth, int newHeight, int binY, uint16_t *dst, uint32_t *acc)
+{
+    for (int row = 0; row < newHeight; row++)
+    {
+        for (int i = 0; i < newWidth; i++)
+            acc[i] = 0;
+        for (int k = 0; k < binY; k++)
+            BinRowAdd<BX>(src + (size_t)(row * binY + k) * width, newWidth, acc);
+        BinRowStore(acc, newWidth, dst + (size_t)row * newWidth);
+    }
+}
+
+static void PixelBinGeneric(const uint16_t *src, int width, int newWidth, int newHeight, int binX, int binY, uint16_t *dst, uint32_t *acc)
+{
+    for (int row = 0; row < newHeight; row++)
+    {
+        for (int i = 0; i < newWidth; i++)
+            acc[i] = 0;
+        for (int k = 0; k < binY; k++)
+            BinRowAddGeneric(src + (size_t)(row * binY + k) * width, newWidth, binX, acc);
+        BinRowStore(acc, newWidth, dst + (size_t)row * newWidth);
+    }
+}
+
+void PixelBinU16(const uint16_t *src, int width, int height, int binX, int binY, uint16_t *dst)
+{
+    if (src == NULL || dst == NULL || binX < 1 || binY < 1)
+        return;
+    int newWidth = width / binX;
+    int newHeight = height / binY;
+    if (newWidth <= 0 || newHeight <= 0)
+        return;
+    // sums of up to 65536 pixels of 0xffff fit the 32-bit accumulator
+    std::vector<uint32_t> acc(newWidth);
+    if (binX == 2 && binY == 2)
+        PixelBinFixed<2>(src, width, newWidth, newHeight, 2, dst, acc.data());
+    else if (binX == 3 && binY == 3)
+        PixelBinFixed<3>(src, width, newWidth, newHeight, 3, dst, acc.data());
+    else if (binX == 4 && binY == 4)
+        PixelBinFixed<4>(src, width, newWidth, newHeight, 4, dst, acc.data());
+    else if (binX == 2)
+        PixelBinFixed<2>(src, width, newWidth, newHeight, binY, dst, acc.data());
+    else
+        PixelBinGeneric(src, width, newWidth, newHeight, binX, binY, dst, acc.data());
+}
+
+void PixelHalveRowU16(const uint16_t *row0, const uint16_t *row1, int newWidth, uint16_t *dst)
+{
+    int i = 0;
+#if defined(PIXELKERNELS_AVX2) || defined(PIXELKERNELS_SSE2)
+    // pair sums in 32-bit lanes as in BinRowAdd<2>, narrowed through a signed pack as in BinRowStore
+    const __m128i lomask = _mm_set1_epi32(0xffff);
+    const __m128i round = _mm_set1_epi32(2);
+    const __m128i bias32 = _mm_set1_epi32(0x8000);
+    const __m128i bias16 = _mm_set1_epi16((short)0x8000);
+    for (; i + 8 <= newWidth; i += 8)
+    {
+        __m128i a0 = _mm_loadu_si128((const __m128i *)(row0 + 2 * i));
+        __m128i a1 = _mm_loadu_si128((const __m128i *)(row0 + 2 * i + 8));
+        __m128i b0 = _mm_loadu_si128((const __m128i *)(row1 + 2 * i));
+        __m128i b1 = _mm_loadu_si128((const __m128i *)(row1 + 2 * i + 8));
+        __m128i s0 = _mm_add_epi32(_mm_add_epi32(_mm_and_si128(a0, lomask), _mm_srli_epi32(a0, 16)),
+                                   _mm_add_epi32(_mm_and_si128(b0, lomask), _mm_srli_epi32(b0, 16)));
+        __m128i s1 = _mm_add_epi32(_mm_add_epi32(_mm_and_si128(a1, lomask), _mm_srli_epi32(a1, 16)),
+                                   _mm_add_epi32(_mm_and_si128(b1, lomask), _mm_srli_epi32(b1, 16)));
+        s0 = _mm_sub_epi32(_mm_srli_epi32(_mm_add_epi32(s0, round), 2), bias32);
+        s1 = _mm_sub_epi32(_mm_srli_epi32(_mm_add_epi32(s1, round), 2), bias32);
+        _mm_storeu_si128((__m128i *)(dst + i), _mm_xor_si128(_mm_packs_epi32(s0, s1), bias16));
+    }
+#elif defined(PIXELKERNELS_NEON)
+    for (; i + 4 <= newWidth; i += 4)
+    {
+        uint32x4_t sum = vpadalq_u16(vpaddlq_u16(vld1q_u16(row0 + 2 * i)), vld1q_u16(row1 + 2 * i));
+        vst1_u16(dst + i, vrshrn_n_u32(sum, 2));
+    }
+#endif
+    for (; i < newWidth; i++)
+        dst[i] = ((uint32_t)row0[2 * i] + row0[2 * i + 1] + row1[2 * i] + row1[2 * i + 1] + 2) >> 2;
+}
+
+void PixelToFitsU16(const uint16_t *src, size_t count, uint8_t *dst)
+{
+    // x - 32768 as signed 16-bit is x ^ 0x8000, then swap the bytes
+    size_t i = 0;
+#if defined(PIXELKERNELS_AVX2)
+    const __m256i bias = _mm256_set1_epi16((short)0x8000);
+    for (; i + 16 <= count; i += 16)
+    {
+        __m256i v = _mm256_xor_si256(_mm256_loadu_si256((const __m256i *)(src + i)), bias);
+        v = _mm256_or_si256(_mm256_slli_epi16(v, 8), _mm256_srli_epi16(v, 8));
+        _mm256_storeu_si256((__m256i *)(dst + 2 * i), v);
+    }
+#elif defined(PIXELKERNELS_SSE2)
+    const __m128i bias = _mm_set1_epi16((short)0x8000);
+    for (; i + 8 <= count; i += 8)
+    {
+        __m128i v = _mm_xor_si128(_mm_loadu_si128((const __m128i *)(src + i)), bias);
+        v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+        _mm_storeu_si128((__m128i *)(dst + 2 * i), v);
+    }
+#elif defined(PIXELKERNELS_NEON)
+    const uint16x8_t bias = vdupq_n_u16(0x8000);
+    for (; i + 8 <= count; i += 8)
+    {
+        uint16x8_t v = veorq_u16(vld1q_u16(src + i), bias);
+        vst1q_u8(dst + 2 * i, vrev16q_u8(vreinterpretq_u8_u16(v)));
+    }
+#endif
+    for (; i < count; i++)
+    {
+        dst[2 * i] = (uint8_t)((src[i] >> 8) ^ 0x80);
+        dst[2 * i + 1] = (uint8_t)src[i];
+    }
+}
+
+void PixelPyramidU16(const uint16_t *src, int width, int height, int levels, uint16_t *const *dst)
+{
+    if (src == NULL || dst == NULL || levels < 1 || (width >> levels) < 1 || (height >> levels) < 1)
+        return;
+    int w1 = width >> 1, h1 = height >> 1;
+    for (int row = 0; row < h1; row++)
+    {
+        PixelHalveRowU16(src + (size_t)(2 * row) * width, src + (size_t)(2 * row + 1) * width, w1, dst[0] + (size_t)row * w1);
+        // an odd row of level k completes row r / 2 of level k + 1
+        for (int k = 1, r = row; (k < levels) && (r & 1); k++)
+        {
+            int w = width >> k;
+            r >>= 1;
+            PixelHalveRowU16(dst[k - 1] + (size_t)(2 * r) * w, dst[k - 1] + (size_t)(2 * r + 1) * w, w >> 1, dst[k] + (size_t)r * (w >> 1));
+        }
+    }
+}
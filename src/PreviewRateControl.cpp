@@ -0,0 +1,267 @@
+/**
+ * @file PreviewRateControl.cpp
+ * @author Sunip K. Mukherjee (sunipkmukherjee@gmail.com)
+ * @brief Bandwidth-adaptive rate control of preview frames sent to a client
+ * @version 0.1
+ * @date 2022-01-03
+ *
+ * @copyright Copyright (c) 2022
+ *
+ */
+#include "PreviewRateControl.hpp"
+
+#include <string.h>
+#include <algorithm>
+#include <chrono>
+#if defined(__linux__)
+#include <sys/ioctl.h>
+#include <linux/sockios.h>
+#endif
+
+#define PREVIEW_QUALITY_STEP 10 // quality change per step down
+#define PREVIEW_HOLD_FRAMES 2   // frames measured at new settings before the next change
+#define PREVIEW_MAX_INTERVAL 60000 // longest time between frames in ms
+#define PREVIEW_BLOCKED_MS 20       // a send taking this long waited for the link
+
+static inline uint64_t getTime()
+{
+    return ((std::chrono::duration_cast<std::chrono::milliseconds>((std::chrono::time_point_cast<std::chrono::milliseconds>(std::chrono::system_clock::now())).time_since_epoch())).count());
+}
+
+CPreviewRateControl::CPreviewRateControl(uint64_t targetBitrate, int targetLatencyMs, int targetIntervalMs)
+    : minQuality_(30),
+      maxQuality_(90),
+      maxScale_(3),
+      scale_(0),
+      intervalMs_(0),
+      lastSendMs_(0),
+      inFlight_(0),
+      rateBps_(0),
+      frameBits_(0),
+      latencyMs_(0),
+      holdFrames_(0),
+      lastUnsent_(0),
+      lastReportMs_(0)
+{
+    memset(&stats_, 0, sizeof(stats_));
+    quality_ = maxQuality_;
+    SetTarget(targetBitrate, targetLatencyMs, targetIntervalMs);
+}
+
+void CPreviewRateControl::SetTarget(uint64_t targetBitrate, int targetLatencyMs, int targetIntervalMs)
+{
+    std::lock_guard<std::mutex> lock(cs_);
+    targetBitrate_ = targetBitrate > 0 ? targetBitrate : 1;
+    targetLatencyMs_ = targetLatencyMs > 0 ? targetLatencyMs : 1;
+    targetIntervalMs_ = targetIntervalMs > 0 ? targetIntervalMs : 1;
+}
+
+void CPreviewRateControl::SetQualityRange(int minQuality, int maxQuality)
+{
+    std::lock_guard<std::mutex> lock(cs_);
+    minQuality_ = std::min(std::max(minQuality, 10), 100);
+    maxQuality_ = std::min(std::max(maxQuality, minQuality_), 100);
+    quality_ = std::min(std::max(quality_, minQuality_), maxQuality_);
+}
+
+void CPreviewRateControl::SetMaxScale(int maxScale)
+{
+    std::lock_guard<std::mutex> lock(cs_);
+    maxScale_ = std::min(std::max(maxScale, 0), 3); // the image pyramid goes down to 8x
+    scale_ = std::min(scale_, maxScale_);
+}
+
+bool CPreviewRateControl::ShouldSend(uint64_t nowMs)
+{
+    std::lock_guard<std::mutex> lock(cs_);
+    stats_.offered++;
+    bool skip = false;
+    if (lastSendMs_ != 0 && nowMs < lastSendMs_ + intervalMs_) // the link needs this long per frame
+        skip = true;
+    // the previous frame is still queued: wait for it, but not past the latency target
+    if (inFlight_ >= 2 || (inFlight_ > 0 && nowMs < lastSendMs_ + targetLatencyMs_))
+        skip = true;
+    if (skip)
+    {
+        stats_.skipped++;
+        return false;
+    }
+    lastSendMs_ = nowMs;
+    inFlight_++;
+    return true;
+}
+
+int CPreviewRateControl::Prepare(CImageData &image)
+{
+    int quality, scale;
+    {
+        std::lock_guard<std::mutex> lock(cs_);
+        quality = quality_;
+        scale = scale_;
+    }
+    image.SetJPEGQuality(quality);
+    if (scale == 0)
+        return 0;
+    int longSide = std::max(image.GetImageWidth(), image.GetImageHeight());
+    return std::max(longSide >> scale, 1);
+}
+
+bool CPreviewRateControl::SendFrame(const CNetImageFrame &frame, int fd, int timeout_ms)
+{
+    uint64_t start = getTime();
+    bool ok = frame.Send(fd, timeout_ms);
+    uint64_t end = getTime();
+    if (!ok)
+    {
+        FrameDropped();
+        return false;
+    }
+    size_t unsent = 0;
+#if defined(__linux__)
+    int pending = 0;
+    if (ioctl(fd, SIOCOUTQ, &pending) == 0 && pending > 0) // not sent or not yet acknowledged
+        unsent = pending;
+#endif
+    FrameSent(frame.GetSize(), frame.GetMetadata().tstamp, start, end, unsent);
+    return true;
+}
+
+void CPreviewRateControl::FrameSent(size_t bytes, uint64_t captureMs, uint64_t sendStartMs, uint64_t sendEndMs, size_t unsentBytes)
+{
+    std::lock_guard<std::mutex> lock(cs_);
+    if (inFlight_ > 0)
+        inFlight_--;
+    stats_.sent++;
+
+    // throughput: if data from before this frame is still in the socket buffer, the link
+    // was busy since the last report and what left the buffer is what it carried; a send
+    // that had to wait for the link measures it too; otherwise the link kept up, so the
+    // estimate is probed upwards
+    double bits = bytes * 8.0;
+    uint64_t duration = sendEndMs > sendStartMs ? sendEndMs - sendStartMs : 0;
+    double sample = 0;
+    if (unsentBytes > bytes && lastUnsent_ > 0 && sendEndMs > lastReportMs_)
+    {
+        double delivered = (double)lastUnsent_ + bytes - unsentBytes;
+        sample = std::max(delivered, 0.0) * 8000.0 / (sendEndMs - lastReportMs_);
+    }
+    else if (duration >= PREVIEW_BLOCKED_MS)
+        sample = bits * 1000.0 / duration;
+    if (sample > 0)
+    {
+        if (rateBps_ == 0)
+            rateBps_ = sample;
+        else // follow a slower link quickly, a faster one carefully
+            rateBps_ += (sample < rateBps_ ? 0.5 : 0.25) * (sample - rateBps_);
+    }
+    else if (unsentBytes <= bytes)
+        rateBps_ = rateBps_ == 0 ? targetBitrate_ : std::min(rateBps_ * 1.25, 2.0 * targetBitrate_);
+    rateBps_ = std::max(rateBps_, 1000.0);
+    lastUnsent_ = unsentBytes;
+    lastReportMs_ = sendEndMs;
+
+    frameBits_ = frameBits_ == 0 ? bits : 0.5 * frameBits_ + 0.5 * bits;
+    double rate = std::min((double)targetBitrate_, rateBps_);
+    // data still in the socket buffer is delivered after this long
+    int backlogMs = (int)std::min(unsentBytes * 8000.0 / rate, (double)PREVIEW_MAX_INTERVAL);
+    latencyMs_ = (sendEndMs > captureMs ? sendEndMs - captureMs : 0) + backlogMs;
+    // skip frames to fit the rate at the current settings, and to let the backlog drain
+    int needMs = (int)std::min(frameBits_ * 1000.0 / rate, (double)PREVIEW_MAX_INTERVAL);
+    intervalMs_ = std::min(needMs + backlogMs, PREVIEW_MAX_INTERVAL);
+
+    if (latencyMs_ > 2 * targetLatencyMs_ && needMs > targetIntervalMs_)
+    {
+        // far behind, the link dropped: go straight to the size that fits, every halving
+        // of the size quarters the frame
+        int scale = scale_;
+        for (double excess = (double)needMs / targetIntervalMs_; excess > 1 && scale < maxScale_; excess /= 4)
+            scale++;
+        if (scale > scale_)
+        {
+            scale_ = scale;
+            quality_ = (minQuality_ + maxQuality_) / 2;
+            frameBits_ = 0;
+            holdFrames_ = PREVIEW_HOLD_FRAMES;
+            return;
+        }
+    }
+    if (holdFrames_ > 0)
+    {
+        holdFrames_--;
+        return;
+    }
+    if (latencyMs_ > targetLatencyMs_ || needMs > targetIntervalMs_ * 5 / 4)
+        StepDown();
+    else if (latencyMs_ < targetLatencyMs_ / 2 && needMs < targetIntervalMs_ * 3 / 4)
+        StepUp(needMs);
+}
+
+void CPreviewRateControl::FrameDropped()
+{
+    std::lock_guard<std::mutex> lock(cs_);
+    if (inFlight_ > 0)
+        inFlight_--;
+    stats_.dropped++;
+    // the link did not keep up at all: back off right away
+    intervalMs_ = std::min(std::max(intervalMs_ * 2, targetIntervalMs_), PREVIEW_MAX_INTERVAL);
+    if (holdFrames_ == 0)
+        StepDown();
+}
+
+void CPreviewRateControl::StepDown()
+{
+    // lower the quality first, then halve the preview size and start again mid range
+    if (quality_ > minQuality_)
+        quality_ = std::max(quality_ - PREVIEW_QUALITY_STEP, minQuality_);
+    else if (scale_ < maxScale_)
+    {
+        scale_++;
+        quality_ = (minQuality_ + maxQuality_) / 2;
+    }
+    else
+        return; // at the floor, frame skipping alone keeps to the rate
+    frameBits_ = 0;
+    holdFrames_ = PREVIEW_HOLD_FRAMES;
+}
+
+void CPreviewRateControl::StepUp(int needMs)
+{
+    // get the preview size back once it fits: doubling the size quadruples the frame, which
+    // the drop to the lowest quality about halves; raise the quality otherwise
+    if (scale_ > 0 && quality_ >= (minQuality_ + maxQuality_) / 2 && needMs * 2 < targetIntervalMs_)
+    {
+        scale_--;
+        quality_ = minQuality_;
+    }
+    else if (quality_ < maxQuality_)
+        quality_ = std::min(quality_ + PREVIEW_QUALITY_STEP / 2, maxQuality_);
+    else
+        return;
+    frameBits_ = 0;
+    holdFrames_ = PREVIEW_HOLD_FRAMES;
+}
+
+int CPreviewRateControl::GetQuality() const
+{
+    std::lock_guard<std::mutex> lock(cs_);
+    return quality_;
+}
+
+int CPreviewRateControl::GetScale() const
+{
+    std::lock_guard<std::mutex> lock(cs_);
+    return scale_;
+}
+
+PreviewRateStats CPreviewRateControl::GetStats() const
+{
+    std::lock_guard<std::mutex> lock(cs_);
+    PreviewRateStats stats = stats_;
+    stats.quality = quality_;
+    stats.scale = scale_;
+    stats.intervalMs = intervalMs_;
+    stats.rateBps = rateBps_;
+    stats.frameBytes = frameBits_ / 8;
+    stats.latencyMs = latencyMs_;
+    return stats;
+}
@@ -0,0 +1,230 @@
+/**
+ * @file RiceCompress.cpp
+ * @author Sunip K. Mukherjee (sunipkmukherjee@gmail.com)
+ * @brief Rice coding of 16-bit pixel data implementation
+ * @version 0.1
+ * @date 2022-01-03
+ *
+ * @copyright Copyright (c) 2022
+ *
+ */
+#include "RiceCompress.hpp"
+
+#include <atomic>
+#include <thread>
+
+/*
+ * RICE_1 with BYTEPIX = 2 (cfitsio fits_rcomp_short):
+ * - the first value, 16 bits raw,
+ * - per block, a 4-bit code: 0 for a block of zero differences, fs + 1 for Rice coded
+ *   differences with split fs (the quotient in unary as zeros and a one, then the low
+ *   fs bits), FS_MAX + 1 for raw 16-bit differences.
+ * Differences wrap at 16 bits and are folded to unsigned as 2d or ~(2d).
+ * The bit stream is big endian and zero padded to a whole byte.
+ */
+#define RICE_FSBITS 4
+#define RICE_FSMAX 14
+#define RICE_BBITS 16
+
+typedef struct
+{
+    uint8_t *out;
+    uint64_t acc;
+    int bits; // bits in acc not yet written, < 8 between calls
+} RiceBitWriter;
+
+static inline void RicePutBits(RiceBitWriter &bw, uint32_t value, int bits) // bits <= 32
+{
+    bw.acc = (bw.acc << bits) | value;
+    bw.bits += bits;
+    while (bw.bits >= 8)
+    {
+        bw.bits -= 8;
+        *bw.out++ = (uint8_t)(bw.acc >> bw.bits);
+    }
+}
+
+typedef struct
+{
+    const uint8_t *in;
+    size_t size;
+    size_t pos;
+    uint64_t acc;
+    int bits; // bits in acc not yet read
+} RiceBitReader;
+
+static inline bool RiceGetBits(RiceBitReader &br, uint32_t &value, int bits) // bits <= 32
+{
+    while (br.bits < bits)
+    {
+        if (br.pos >= br.size)
+            return false;
+        br.acc = (br.acc << 8) | br.in[br.pos++];
+        br.bits += 8;
+    }
+    br.bits -= bits;
+    value = (uint32_t)(br.acc >> br.bits) & (uint32_t)((1ULL << bits) - 1);
+    return true;
+}
+
+size_t RiceBound16(size_t n, int blockSize)
+{
+    size_t blocks = (n + blockSize - 1) / blockSize;
+    return 2 + (blocks * RICE_FSBITS + n * RICE_BBITS + 7) / 8;
+}
+
+size_t RiceEncode16(const int16_t *in, size_t n, uint8_t *out, int blockSize)
+{
+    RiceBitWriter bw = {out, 0, 0};
+    std::vector<uint32_t> diff(blockSize);
+    RicePutBits(bw, (uint16_t)in[0], RICE_BBITS);
+    int16_t lastpix = in[0];
+    for (size_t i = 0; i < n; i += blockSize)
+    {
+        int thisblock = n - i < (size_t)blockSize ? (int)(n - i) : blockSize;
+        uint32_t pixelsum = 0;
+        for (int j = 0; j < thisblock; j++)
+        {
+            int16_t nextpix = in[i + j];
+            int16_t pdiff = (int16_t)(nextpix - lastpix);
+            diff[j] = pdiff < 0 ? -2 * pdiff - 1 : 2 * pdiff;
+            pixelsum += diff[j];
+            lastpix = nextpix;
+        }
+        // split from the mean difference, as cfitsio picks it
+        int fs = 0;
+        if (pixelsum > (uint32_t)(thisblock / 2 + 1))
+        {
+            uint32_t psum = ((pixelsum - thisblock / 2 - 1) / thisblock) >> 1;
+            for (; psum > 0; fs++)
+                psum >>= 1;
+        }
+        if (fs == 0 && pixelsum == 0)
+        {
+            RicePutBits(bw, 0, RICE_FSBITS);
+            continue;
+        }
+        // fall back to raw differences when coding would not shrink the block
+        uint32_t codedBits = 0;
+        if (fs < RICE_FSMAX)
+        {
+            for (int j = 0; j < thisblock; j++)
+                codedBits += (diff[j] >> fs) + 1 + fs;
+        }
+        if (fs >= RICE_FSMAX || codedBits >= (uint32_t)thisblock * RICE_BBITS)
+        {
+            RicePutBits(bw, RICE_FSMAX + 1, RICE_FSBITS);
+            for (int j = 0; j < thisblock; j++)
+                RicePutBits(bw, diff[j], RICE_BBITS);
+            continue;
+        }
+        RicePutBits(bw, fs + 1, RICE_FSBITS);
+        uint32_t fsmask = (1U << fs) - 1;
+        for (int j = 0; j < thisblock; j++)
+        {
+            uint32_t top = diff[j] >> fs;
+            for (; top >= 16; top -= 16)
+                RicePutBits(bw, 0, 16);
+            RicePutBits(bw, (1U << fs) | (diff[j] & fsmask), top + 1 + fs);
+        }
+    }
+    if (bw.bits > 0)
+        *bw.out++ = (uint8_t)(bw.acc << (8 - bw.bits));
+    return bw.out - out;
+}
+
+bool RiceDecode16(const uint8_t *in, size_t size, int16_t *out, size_t n, int blockSize)
+{
+    if (n == 0)
+        return true;
+    RiceBitReader br = {in, size, 0, 0, 0};
+    uint32_t v;
+    if (!RiceGetBits(br, v, RICE_BBITS))
+        return false;
+    int16_t lastpix = (int16_t)v;
+    for (size_t i = 0; i < n; i += blockSize)
+    {
+        int thisblock = n - i < (size_t)blockSize ? (int)(n - i) : blockSize;
+        uint32_t code;
+        if (!RiceGetBits(br, code, RICE_FSBITS))
+            return false;
+        int fs = (int)code - 1;
+        for (int j = 0; j < thisblock; j++)
+        {
+            uint32_t diff = 0;
+            if (fs == RICE_FSMAX)
+            {
+                if (!RiceGetBits(br, diff, RICE_BBITS))
+                    return false;
+            }
+            else if (fs >= 0)
+            {
+                // count the zeros before the next one bit
+                uint32_t top = 0, bit;
+                while (true)
+                {
+                    if (!RiceGetBits(br, bit, 1))
+                        return false;
+                    if (bit)
+                        break;
+                    if (++top > 0xffff)
+                        return false;
+                }
+                uint32_t low = 0;
+                if (fs > 0 && !RiceGetBits(br, low, fs))
+                    return false;
+                diff = (top << fs) | low;
+            }
+            int d = (diff & 1) ? -(int)(diff >> 1) - 1 : (int)(diff >> 1);
+            lastpix = (int16_t)(lastpix + d);
+            out[i + j] = lastpix;
+        }
+    }
+    return true;
+}
+
+void RiceCompressTilesU16(const uint16_t *src, int width, int height, int tileWidth, int tileHeight, int numThreads, std::vector<std::vector<uint8_t>> &tiles, int blockSize)
+{
+    if (tileWidth <= 0 || tileWidth > width)
+        tileWidth = width;
+    if (tileHeight <= 0 || tileHeight > height)
+        tileHeight = height;
+    int tilesX = (width + tileWidth - 1) / tileWidth;
+    int tilesY = (height + tileHeight - 1) / tileHeight;
+    int numTiles = tilesX * tilesY;
+    tiles.resize(numTiles);
+    if (numThreads <= 0)
+        numThreads = std::thread::hardware_concurrency();
+    if (numThreads > numTiles)
+        numThreads = numTiles;
+
+    std::atomic<int> nextTile(0);
+    auto worker = [&]()
+    {
+        std::vector<int16_t> buf((size_t)tileWidth * tileHeight);
+        std::vector<uint8_t> coded(RiceBound16(buf.size(), blockSize));
+        int tile;
+        while ((tile = nextTile++) < numTiles)
+        {
+            int x0 = (tile % tilesX) * tileWidth, y0 = (tile / tilesX) * tileHeight;
+            int w = width - x0 < tileWidth ? width - x0 : tileWidth;
+            int h = height - y0 < tileHeight ? height - y0 : tileHeight;
+            // unsigned to signed, BZERO = 32768
+            for (int y = 0; y < h; y++)
+            {
+                const uint16_t *row = src + (size_t)(y0 + y) * width + x0;
+                int16_t *dst = buf.data() + (size_t)y * w;
+                for (int x = 0; x < w; x++)
+                    dst[x] = (int16_t)(row[x] ^ 0x8000);
+            }
+            size_t sz = RiceEncode16(buf.data(), (size_t)w * h, coded.data(), blockSize);
+            tiles[tile].assign(coded.data(), coded.data() + sz);
+        }
+    };
+    std::vector<std::thread> threads;
+    for (int i = 1; i < numThreads; i++)
+        threads.push_back(std::thread(worker));
+    worker();
+    for (size_t i = 0; i < threads.size(); i++)
+        threads[i].join();
+}
@@ -102,30 +102,29 @@ void *CameraThread(void *_inout)
         image = cam->CaptureImage(retrycount);
         if (image.HasData())
         {
-            uint8_t *jpg_ptr = nullptr;
-            int jpg_sz;
-            image.GetJPEGData(jpg_ptr, jpg_sz);
-            if (jpg_sz <= 0 || jpg_ptr == nullptr)
+            // the frame sends the JPEG buffer or the pixels of the image, no copy; previews
+            // are skipped, shrunk and compressed harder to fit the link of the controller
+            CNetImageFrame *frame = nullptr;
+            if (StreamRawImage)
+                frame = new CNetImageFrame(RICE16, image);
+            else if (PreviewRate.ShouldSend(getTime()))
+                frame = new CNetImageFrame(image, PreviewRate.Prepare(image));
+            if (frame != nullptr && !frame->HasData())
             {
-                dbprintlf("Invalid JPEG image");
+                dbprintlf("Invalid image frame");
+                if (!StreamRawImage)
+                    PreviewRate.FrameDropped();
+                delete frame;
             }
-            else
+            else if (frame != nullptr)
             {
-                netimg_meta metadata[1];
-                metadata->exposure_ms = image.GetImageExposure() * 1000; // exposure in ms
-                metadata->width = image.GetImageWidth();
-                metadata->height = image.GetImageHeight();
-                metadata->tstamp = getTime();
-                metadata->size = jpg_sz;
-                metadata->type = netimg_type::JPEGRGB;
-                uint8_t *buf = new uint8_t[sizeof(netimg_meta) + jpg_sz];
-                memcpy(buf, metadata, sizeof(netimg_meta));
-                memcpy(buf + sizeof(netimg_meta), jpg_ptr, jpg_sz);
-                NetFrame *frame = nullptr;
-                // Send controller this frame
-                frame = new NetFrame(buf, sizeof(netimg_meta) + jpg_sz, comic_netdata::DATA, NetType::DATA, FrameStatus::NONE, CtrlVertex);
-                tx_queue.push(frame);
-                delete (buf);
+                CNetImageFrame *dropped = nullptr;
+                if (img_queue.push_evict(frame, dropped)) // link is not keeping up, drop the oldest frame
+                {
+                    if (!StreamRawImage)
+                        PreviewRate.FrameDropped();
+                    delete dropped;
+                }
             }
             MainImage->Reset();
             std::lock_guard<std::mutex> lock(MainImage->cs);
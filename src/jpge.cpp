@@ -14,6 +14,25 @@
 #include <string.h>
 #include <stdio.h>
 
+#include <atomic>
+#include <thread>
+#include <vector>
+
+// SIMD kernels for the DCT, quantization and colour conversion. Define JPGE_NO_SIMD to build the scalar encoder only.
+#if !defined(JPGE_NO_SIMD)
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && (_M_IX86_FP >= 2))
+#include <emmintrin.h>
+#define JPGE_SSE2 1
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define JPGE_AVX2 __attribute__((target("avx2")))
+#endif
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define JPGE_NEON 1
+#endif
+#endif
+
 #define JPGE_MAX(a, b) (((a) > (b)) ? (a) : (b))
 #define JPGE_MIN(a, b) (((a) < (b)) ? (a) : (b))
 
@@ -28,10 +47,12 @@ namespace jpge
     {
         M_SOF0 = 0xC0,
         M_DHT = 0xC4,
+        M_RST0 = 0xD0,
         M_SOI = 0xD8,
         M_EOI = 0xD9,
         M_SOS = 0xDA,
         M_DQT = 0xDB,
+        M_DRI = 0xDD,
         M_APP0 = 0xE0
     };
     enum
@@ -196,6 +217,462 @@ namespace jpge
         }
     }
 
+    // SIMD kernels. Each one produces exactly the same output as its scalar counterpart above: the
+    // DCT multiplies use the same 16x16->32 bit products, the quantizer's float division is exact for
+    // the range of coefficients a DCT can produce, and the colour conversion keeps the 16.16 fixed
+    // point arithmetic. The x86 kernels are picked at runtime (AVX2 if the CPU has it, SSE2 otherwise),
+    // NEON is picked at compile time.
+    struct simd_kernels
+    {
+        void (*m_dct)(int32 *p);
+        // Quantizes a block of DCT coefficients with a quantization table in natural order and writes
+        // the result in zig-zag order. NULL if the scalar loop in load_quantized_coefficients() is used.
+        void (*m_quantize)(const int32 *pSrc, const int32 *pQ, int16 *pDst);
+        void (*m_rgb_to_y)(uint8 *pDst, const uint8 *pSrc, int num_pixels);
+        void (*m_rgb_to_ycc)(uint8 *pDst, const uint8 *pSrc, int num_pixels);
+    };
+
+#define JPGE_DCT1D_SIMD(V, ADD, SUB, MUL, s0, s1, s2, s3, s4, s5, s6, s7)                           \
+    {                                                                                              \
+        V t0 = ADD(s0, s7), t7 = SUB(s0, s7), t1 = ADD(s1, s6), t6 = SUB(s1, s6);                  \
+        V t2 = ADD(s2, s5), t5 = SUB(s2, s5), t3 = ADD(s3, s4), t4 = SUB(s3, s4);                  \
+        V t10 = ADD(t0, t3), t13 = SUB(t0, t3), t11 = ADD(t1, t2), t12 = SUB(t1, t2);              \
+        V u1 = MUL(ADD(t12, t13), 4433);                                                           \
+        s2 = ADD(u1, MUL(t13, 6270));                                                              \
+        s6 = ADD(u1, MUL(t12, -15137));                                                            \
+        u1 = ADD(t4, t7);                                                                          \
+        V u2 = ADD(t5, t6), u3 = ADD(t4, t6), u4 = ADD(t5, t7);                                    \
+        V z5 = MUL(ADD(u3, u4), 9633);                                                             \
+        t4 = MUL(t4, 2446);                                                                        \
+        t5 = MUL(t5, 16819);                                                                       \
+        t6 = MUL(t6, 25172);                                                                       \
+        t7 = MUL(t7, 12299);                                                                       \
+        u1 = MUL(u1, -7373);                                                                       \
+        u2 = MUL(u2, -20995);                                                                      \
+        u3 = MUL(u3, -16069);                                                                      \
+        u4 = MUL(u4, -3196);                                                                       \
+        u3 = ADD(u3, z5);                                                                          \
+        u4 = ADD(u4, z5);                                                                          \
+        s0 = ADD(t10, t11);                                                                        \
+        s1 = ADD(ADD(t7, u1), u4);                                                                 \
+        s3 = ADD(ADD(t6, u2), u3);                                                                 \
+        s4 = SUB(t10, t11);                                                                        \
+        s5 = ADD(ADD(t5, u2), u4);                                                                 \
+        s7 = ADD(ADD(t4, u1), u3);                                                                 \
+    }
+
+#if defined(JPGE_SSE2)
+    // madd_epi16 against a constant in the low half of each 32-bit lane is exactly DCT_MUL().
+#define JPGE_SSE2_ADD(a, b) _mm_add_epi32(a, b)
+#define JPGE_SSE2_SUB(a, b) _mm_sub_epi32(a, b)
+#define JPGE_SSE2_MUL(a, c) _mm_madd_epi16(a, _mm_set1_epi32((c) & 0xFFFF))
+#define JPGE_SSE2_DESCALE(x, n) _mm_srai_epi32(_mm_add_epi32(x, _mm_set1_epi32(1 << ((n)-1))), n)
+
+    static inline void transpose_4x4_sse2(__m128i &a, __m128i &b, __m128i &c, __m128i &d)
+    {
+        const __m128i ab_lo = _mm_unpacklo_epi32(a, b), ab_hi = _mm_unpackhi_epi32(a, b);
+        const __m128i cd_lo = _mm_unpacklo_epi32(c, d), cd_hi = _mm_unpackhi_epi32(c, d);
+        a = _mm_unpacklo_epi64(ab_lo, cd_lo);
+        b = _mm_unpackhi_epi64(ab_lo, cd_lo);
+        c = _mm_unpacklo_epi64(ab_hi, cd_hi);
+        d = _mm_unpackhi_epi64(ab_hi, cd_hi);
+    }
+
+    static void DCT2D_sse2(int32 *p)
+    {
+        __m128i v[8][2];
+        for (int i = 0; i < 8; i++)
+        {
+            v[i][0] = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p + i * 8));
+            v[i][1] = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p + i * 8 + 4));
+        }
+        // Rows, four at a time: transpose so that each vector holds one column of four rows.
+        for (int r = 0; r < 8; r += 4)
+        {
+            __m128i s0 = v[r][0], s1 = v[r + 1][0], s2 = v[r + 2][0], s3 = v[r + 3][0];
+            __m128i s4 = v[r][1], s5 = v[r + 1][1], s6 = v[r + 2][1], s7 = v[r + 3][1];
+            transpose_4x4_sse2(s0, s1, s2, s3);
+            transpose_4x4_sse2(s4, s5, s6, s7);
+            JPGE_DCT1D_SIMD(__m128i, JPGE_SSE2_ADD, JPGE_SSE2_SUB, JPGE_SSE2_MUL, s0, s1, s2, s3, s4, s5, s6, s7);
+            s0 = _mm_slli_epi32(s0, ROW_BITS);
+            s1 = JPGE_SSE2_DESCALE(s1, CONST_BITS - ROW_BITS);
+            s2 = JPGE_SSE2_DESCALE(s2, CONST_BITS - ROW_BITS);
+            s3 = JPGE_SSE2_DESCALE(s3, CONST_BITS - ROW_BITS);
+            s4 = _mm_slli_epi32(s4, ROW_BITS);
+            s5 = JPGE_SSE2_DESCALE(s5, CONST_BITS - ROW_BITS);
+            s6 = JPGE_SSE2_DESCALE(s6, CONST_BITS - ROW_BITS);
+            s7 = JPGE_SSE2_DESCALE(s7, CONST_BITS - ROW_BITS);
+            transpose_4x4_sse2(s0, s1, s2, s3);
+            transpose_4x4_sse2(s4, s5, s6, s7);
+            v[r][0] = s0, v[r + 1][0] = s1, v[r + 2][0] = s2, v[r + 3][0] = s3;
+            v[r][1] = s4, v[r + 1][1] = s5, v[r + 2][1] = s6, v[r + 3][1] = s7;
+        }
+        // Columns, four at a time: the row vectors already hold one row of four columns.
+        for (int h = 0; h < 2; h++)
+        {
+            __m128i s0 = v[0][h], s1 = v[1][h], s2 = v[2][h], s3 = v[3][h], s4 = v[4][h], s5 = v[5][h], s6 = v[6][h], s7 = v[7][h];
+            JPGE_DCT1D_SIMD(__m128i, JPGE_SSE2_ADD, JPGE_SSE2_SUB, JPGE_SSE2_MUL, s0, s1, s2, s3, s4, s5, s6, s7);
+            v[0][h] = JPGE_SSE2_DESCALE(s0, ROW_BITS + 3);
+            v[1][h] = JPGE_SSE2_DESCALE(s1, CONST_BITS + ROW_BITS + 3);
+            v[2][h] = JPGE_SSE2_DESCALE(s2, CONST_BITS + ROW_BITS + 3);
+            v[3][h] = JPGE_SSE2_DESCALE(s3, CONST_BITS + ROW_BITS + 3);
+            v[4][h] = JPGE_SSE2_DESCALE(s4, ROW_BITS + 3);
+            v[5][h] = JPGE_SSE2_DESCALE(s5, CONST_BITS + ROW_BITS + 3);
+            v[6][h] = JPGE_SSE2_DESCALE(s6, CONST_BITS + ROW_BITS + 3);
+            v[7][h] = JPGE_SSE2_DESCALE(s7, CONST_BITS + ROW_BITS + 3);
+        }
+        for (int i = 0; i < 8; i++)
+        {
+            _mm_storeu_si128(reinterpret_cast<__m128i *>(p + i * 8), v[i][0]);
+            _mm_storeu_si128(reinterpret_cast<__m128i *>(p + i * 8 + 4), v[i][1]);
+        }
+    }
+
+    // (|x| + q / 2) / q with the sign of x. Both operands are below 2^22, so the float quotient
+    // truncates to the same integer as the scalar division.
+    static inline __m128i quantize4_sse2(__m128i x, __m128i q)
+    {
+        const __m128i sign = _mm_srai_epi32(x, 31);
+        const __m128i a = _mm_add_epi32(_mm_sub_epi32(_mm_xor_si128(x, sign), sign), _mm_srai_epi32(q, 1));
+        const __m128i r = _mm_cvttps_epi32(_mm_div_ps(_mm_cvtepi32_ps(a), _mm_cvtepi32_ps(q)));
+        return _mm_sub_epi32(_mm_xor_si128(r, sign), sign);
+    }
+
+    static void quantize_sse2(const int32 *pSrc, const int32 *pQ, int16 *pDst)
+    {
+        int16 coeffs[64];
+        for (int i = 0; i < 64; i += 8)
+        {
+            const __m128i lo = quantize4_sse2(_mm_loadu_si128(reinterpret_cast<const __m128i *>(pSrc + i)), _mm_loadu_si128(reinterpret_cast<const __m128i *>(pQ + i)));
+            const __m128i hi = quantize4_sse2(_mm_loadu_si128(reinterpret_cast<const __m128i *>(pSrc + i + 4)), _mm_loadu_si128(reinterpret_cast<const __m128i *>(pQ + i + 4)));
+            _mm_storeu_si128(reinterpret_cast<__m128i *>(coeffs + i), _mm_packs_epi32(lo, hi));
+        }
+        for (int i = 0; i < 64; i++)
+            pDst[i] = coeffs[s_zag[i]];
+    }
+#endif // JPGE_SSE2
+
+#if defined(JPGE_AVX2)
+#define JPGE_AVX2_ADD(a, b) _mm256_add_epi32(a, b)
+#define JPGE_AVX2_SUB(a, b) _mm256_sub_epi32(a, b)
+#define JPGE_AVX2_MUL(a, c) _mm256_madd_epi16(a, _mm256_set1_epi32((c) & 0xFFFF))
+#define JPGE_AVX2_DESCALE(x, n) _mm256_srai_epi32(_mm256_add_epi32(x, _mm256_set1_epi32(1 << ((n)-1))), n)
+
+    JPGE_AVX2 static inline void transpose_8x8_avx2(__m256i *v)
+    {
+        const __m256i a0 = _mm256_unpacklo_epi32(v[0], v[1]), a1 = _mm256_unpackhi_epi32(v[0], v[1]);
+        const __m256i a2 = _mm256_unpacklo_epi32(v[2], v[3]), a3 = _mm256_unpackhi_epi32(v[2], v[3]);
+        const __m256i a4 = _mm256_unpacklo_epi32(v[4], v[5]), a5 = _mm256_unpackhi_epi32(v[4], v[5]);
+        const __m256i a6 = _mm256_unpacklo_epi32(v[6], v[7]), a7 = _mm256_unpackhi_epi32(v[6], v[7]);
+        const __m256i b0 = _mm256_unpacklo_epi64(a0, a2), b1 = _mm256_unpackhi_epi64(a0, a2);
+        const __m256i b2 = _mm256_unpacklo_epi64(a1, a3), b3 = _mm256_unpackhi_epi64(a1, a3);
+        const __m256i b4 = _mm256_unpacklo_epi64(a4, a6), b5 = _mm256_unpackhi_epi64(a4, a6);
+        const __m256i b6 = _mm256_unpacklo_epi64(a5, a7), b7 = _mm256_unpackhi_epi64(a5, a7);
+        v[0] = _mm256_permute2x128_si256(b0, b4, 0x20);
+        v[1] = _mm256_permute2x128_si256(b1, b5, 0x20);
+        v[2] = _mm256_permute2x128_si256(b2, b6, 0x20);
+        v[3] = _mm256_permute2x128_si256(b3, b7, 0x20);
+        v[4] = _mm256_permute2x128_si256(b0, b4, 0x31);
+        v[5] = _mm256_permute2x128_si256(b1, b5, 0x31);
+        v[6] = _mm256_permute2x128_si256(b2, b6, 0x31);
+        v[7] = _mm256_permute2x128_si256(b3, b7, 0x31);
+    }
+
+    JPGE_AVX2 static void DCT2D_avx2(int32 *p)
+    {
+        __m256i v[8];
+        for (int i = 0; i < 8; i++)
+            v[i] = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(p + i * 8));
+        transpose_8x8_avx2(v);
+        JPGE_DCT1D_SIMD(__m256i, JPGE_AVX2_ADD, JPGE_AVX2_SUB, JPGE_AVX2_MUL, v[0], v[1], v[2], v[3], v[4], v[5], v[6], v[7]);
+        v[0] = _mm256_slli_epi32(v[0], ROW_BITS);
+        v[1] = JPGE_AVX2_DESCALE(v[1], CONST_BITS - ROW_BITS);
+        v[2] = JPGE_AVX2_DESCALE(v[2], CONST_BITS - ROW_BITS);
+        v[3] = JPGE_AVX2_DESCALE(v[3], CONST_BITS - ROW_BITS);
+        v[4] = _mm256_slli_epi32(v[4], ROW_BITS);
+        v[5] = JPGE_AVX2_DESCALE(v[5], CONST_BITS - ROW_BITS);
+        v[6] = JPGE_AVX2_DESCALE(v[6], CONST_BITS - ROW_BITS);
+        v[7] = JPGE_AVX2_DESCALE(v[7], CONST_BITS - ROW_BITS);
+        transpose_8x8_avx2(v);
+        JPGE_DCT1D_SIMD(__m256i, JPGE_AVX2_ADD, JPGE_AVX2_SUB, JPGE_AVX2_MUL, v[0], v[1], v[2], v[3], v[4], v[5], v[6], v[7]);
+        v[0] = JPGE_AVX2_DESCALE(v[0], ROW_BITS + 3);
+        v[1] = JPGE_AVX2_DESCALE(v[1], CONST_BITS + ROW_BITS + 3);
+        v[2] = JPGE_AVX2_DESCALE(v[2], CONST_BITS + ROW_BITS + 3);
+        v[3] = JPGE_AVX2_DESCALE(v[3], CONST_BITS + ROW_BITS + 3);
+        v[4] = JPGE_AVX2_DESCALE(v[4], ROW_BITS + 3);
+        v[5] = JPGE_AVX2_DESCALE(v[5], CONST_BITS + ROW_BITS + 3);
+        v[6] = JPGE_AVX2_DESCALE(v[6], CONST_BITS + ROW_BITS + 3);
+        v[7] = JPGE_AVX2_DESCALE(v[7], CONST_BITS + ROW_BITS + 3);
+        for (int i = 0; i < 8; i++)
+            _mm256_storeu_si256(reinterpret_cast<__m256i *>(p + i * 8), v[i]);
+    }
+
+    JPGE_AVX2 static inline __m256i quantize8_avx2(__m256i x, __m256i q)
+    {
+        const __m256i a = _mm256_add_epi32(_mm256_abs_epi32(x), _mm256_srai_epi32(q, 1));
+        const __m256i r = _mm256_cvttps_epi32(_mm256_div_ps(_mm256_cvtepi32_ps(a), _mm256_cvtepi32_ps(q)));
+        return _mm256_sign_epi32(r, x);
+    }
+
+    JPGE_AVX2 static void quantize_avx2(const int32 *pSrc, const int32 *pQ, int16 *pDst)
+    {
+        int16 coeffs[64];
+        for (int i = 0; i < 64; i += 16)
+        {
+            const __m256i lo = quantize8_avx2(_mm256_loadu_si256(reinterpret_cast<const __m256i *>(pSrc + i)), _mm256_loadu_si256(reinterpret_cast<const __m256i *>(pQ + i)));
+            const __m256i hi = quantize8_avx2(_mm256_loadu_si256(reinterpret_cast<const __m256i *>(pSrc + i + 8)), _mm256_loadu_si256(reinterpret_cast<const __m256i *>(pQ + i + 8)));
+            // packs works per 128-bit lane, so put the quadwords back in order afterwards.
+            _mm256_storeu_si256(reinterpret_cast<__m256i *>(coeffs + i), _mm256_permute4x64_epi64(_mm256_packs_epi32(lo, hi), 0xD8));
+        }
+        for (int i = 0; i < 64; i++)
+            pDst[i] = coeffs[s_zag[i]];
+    }
+
+    // Splits 16 packed RGB pixels into one vector per channel.
+    JPGE_AVX2 static inline void load_rgb16_avx2(const uint8 *pSrc, __m128i &r, __m128i &g, __m128i &b)
+    {
+        const __m128i v0 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(pSrc));
+        const __m128i v1 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(pSrc + 16));
+        const __m128i v2 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(pSrc + 32));
+        r = _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(v0, _mm_setr_epi8(0, 3, 6, 9, 12, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1)),
+                                      _mm_shuffle_epi8(v1, _mm_setr_epi8(-1, -1, -1, -1, -1, -1, 2, 5, 8, 11, 14, -1, -1, -1, -1, -1))),
+                         _mm_shuffle_epi8(v2, _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 1, 4, 7, 10, 13)));
+        g = _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(v0, _mm_setr_epi8(1, 4, 7, 10, 13, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1)),
+                                      _mm_shuffle_epi8(v1, _mm_setr_epi8(-1, -1, -1, -1, -1, 0, 3, 6, 9, 12, 15, -1, -1, -1, -1, -1))),
+                         _mm_shuffle_epi8(v2, _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 2, 5, 8, 11, 14)));
+        b = _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(v0, _mm_setr_epi8(2, 5, 8, 11, 14, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1)),
+                                      _mm_shuffle_epi8(v1, _mm_setr_epi8(-1, -1, -1, -1, -1, 1, 4, 7, 10, 13, -1, -1, -1, -1, -1, -1))),
+                         _mm_shuffle_epi8(v2, _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 0, 3, 6, 9, 12, 15)));
+    }
+
+    // Packs a pair of 16-bit multipliers into every 32-bit lane, for madd_epi16.
+    static inline __m128i pair_epi16_sse2(int16 a, int16 b) { return _mm_setr_epi16(a, b, a, b, a, b, a, b); }
+
+    // Luma of 8 pixels held in 16-bit lanes. YG does not fit in 16 bits, so g * YG is computed as
+    // g * (YG - 65536) + (g << 16); the rounding constant rides along as 128 * 256.
+    JPGE_AVX2 static inline __m128i rgb_to_y8_avx2(__m128i r, __m128i g, __m128i b)
+    {
+        const __m128i c_rg = pair_epi16_sse2(static_cast<int16>(YR), static_cast<int16>(YG - 65536));
+        const __m128i c_bk = pair_epi16_sse2(static_cast<int16>(YB), 256);
+        const __m128i k = _mm_set1_epi16(128), z = _mm_setzero_si128();
+        __m128i lo = _mm_add_epi32(_mm_madd_epi16(_mm_unpacklo_epi16(r, g), c_rg), _mm_madd_epi16(_mm_unpacklo_epi16(b, k), c_bk));
+        __m128i hi = _mm_add_epi32(_mm_madd_epi16(_mm_unpackhi_epi16(r, g), c_rg), _mm_madd_epi16(_mm_unpackhi_epi16(b, k), c_bk));
+        lo = _mm_srli_epi32(_mm_add_epi32(lo, _mm_unpacklo_epi16(z, g)), 16);
+        hi = _mm_srli_epi32(_mm_add_epi32(hi, _mm_unpackhi_epi16(z, g)), 16);
+        return _mm_packs_epi32(lo, hi);
+    }
+
+    // 128 + ((a * ca + b * cb + (c << 15) + 32768) >> 16) for 8 pixels, i.e. Cb or Cr before clamping.
+    JPGE_AVX2 static inline __m128i rgb_to_c8_avx2(__m128i a, __m128i b, __m128i c, __m128i coeffs)
+    {
+        const __m128i k = _mm_set1_epi32(32768 + (128 << 16)), z = _mm_setzero_si128();
+        __m128i lo = _mm_add_epi32(_mm_madd_epi16(_mm_unpacklo_epi16(a, b), coeffs), _mm_slli_epi32(_mm_unpacklo_epi16(c, z), 15));
+        __m128i hi = _mm_add_epi32(_mm_madd_epi16(_mm_unpackhi_epi16(a, b), coeffs), _mm_slli_epi32(_mm_unpackhi_epi16(c, z), 15));
+        lo = _mm_srai_epi32(_mm_add_epi32(lo, k), 16);
+        hi = _mm_srai_epi32(_mm_add_epi32(hi, k), 16);
+        return _mm_packs_epi32(lo, hi);
+    }
+
+    JPGE_AVX2 static void RGB_to_Y_avx2(uint8 *pDst, const uint8 *pSrc, int num_pixels)
+    {
+        const __m128i z = _mm_setzero_si128();
+        for (; num_pixels >= 16; pDst += 16, pSrc += 48, num_pixels -= 16)
+        {
+            __m128i r, g, b;
+            load_rgb16_avx2(pSrc, r, g, b);
+            const __m128i y_lo = rgb_to_y8_avx2(_mm_unpacklo_epi8(r, z), _mm_unpacklo_epi8(g, z), _mm_unpacklo_epi8(b, z));
+            const __m128i y_hi = rgb_to_y8_avx2(_mm_unpackhi_epi8(r, z), _mm_unpackhi_epi8(g, z), _mm_unpackhi_epi8(b, z));
+            _mm_storeu_si128(reinterpret_cast<__m128i *>(pDst), _mm_packus_epi16(y_lo, y_hi));
+        }
+        RGB_to_Y(pDst, pSrc, num_pixels);
+    }
+
+    JPGE_AVX2 static void RGB_to_YCC_avx2(uint8 *pDst, const uint8 *pSrc, int num_pixels)
+    {
+        const __m128i z = _mm_setzero_si128();
+        const __m128i c_cb = pair_epi16_sse2(static_cast<int16>(CB_R), static_cast<int16>(CB_G));
+        const __m128i c_cr = pair_epi16_sse2(static_cast<int16>(CR_G), static_cast<int16>(CR_B));
+        for (; num_pixels >= 16; pDst += 48, pSrc += 48, num_pixels -= 16)
+        {
+            __m128i r, g, b;
+            load_rgb16_avx2(pSrc, r, g, b);
+            const __m128i r_lo = _mm_unpacklo_epi8(r, z), g_lo = _mm_unpacklo_epi8(g, z), b_lo = _mm_unpacklo_epi8(b, z);
+            const __m128i r_hi = _mm_unpackhi_epi8(r, z), g_hi = _mm_unpackhi_epi8(g, z), b_hi = _mm_unpackhi_epi8(b, z);
+            // packus clamps Cb and Cr to 0..255 exactly like clamp().
+            const __m128i y = _mm_packus_epi16(rgb_to_y8_avx2(r_lo, g_lo, b_lo), rgb_to_y8_avx2(r_hi, g_hi, b_hi));
+            const __m128i cb = _mm_packus_epi16(rgb_to_c8_avx2(r_lo, g_lo, b_lo, c_cb), rgb_to_c8_avx2(r_hi, g_hi, b_hi, c_cb));
+            const __m128i cr = _mm_packus_epi16(rgb_to_c8_avx2(g_lo, b_lo, r_lo, c_cr), rgb_to_c8_avx2(g_hi, b_hi, r_hi, c_cr));
+            const __m128i o0 = _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(y, _mm_setr_epi8(0, -1, -1, 1, -1, -1, 2, -1, -1, 3, -1, -1, 4, -1, -1, 5)),
+                                                         _mm_shuffle_epi8(cb, _mm_setr_epi8(-1, 0, -1, -1, 1, -1, -1, 2, -1, -1, 3, -1, -1, 4, -1, -1))),
+                                            _mm_shuffle_epi8(cr, _mm_setr_epi8(-1, -1, 0, -1, -1, 1, -1, -1, 2, -1, -1, 3, -1, -1, 4, -1)));
+            const __m128i o1 = _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(y, _mm_setr_epi8(-1, -1, 6, -1, -1, 7, -1, -1, 8, -1, -1, 9, -1, -1, 10, -1)),
+                                                         _mm_shuffle_epi8(cb, _mm_setr_epi8(5, -1, -1, 6, -1, -1, 7, -1, -1, 8, -1, -1, 9, -1, -1, 10))),
+                                            _mm_shuffle_epi8(cr, _mm_setr_epi8(-1, 5, -1, -1, 6, -1, -1, 7, -1, -1, 8, -1, -1, 9, -1, -1)));
+            const __m128i o2 = _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(y, _mm_setr_epi8(-1, 11, -1, -1, 12, -1, -1, 13, -1, -1, 14, -1, -1, 15, -1, -1)),
+                                                         _mm_shuffle_epi8(cb, _mm_setr_epi8(-1, -1, 11, -1, -1, 12, -1, -1, 13, -1, -1, 14, -1, -1, 15, -1))),
+                                            _mm_shuffle_epi8(cr, _mm_setr_epi8(10, -1, -1, 11, -1, -1, 12, -1, -1, 13, -1, -1, 14, -1, -1, 15)));
+            _mm_storeu_si128(reinterpret_cast<__m128i *>(pDst), o0);
+            _mm_storeu_si128(reinterpret_cast<__m128i *>(pDst + 16), o1);
+            _mm_storeu_si128(reinterpret_cast<__m128i *>(pDst + 32), o2);
+        }
+        RGB_to_YCC(pDst, pSrc, num_pixels);
+    }
+#endif // JPGE_AVX2
+
+#if defined(JPGE_NEON)
+#define JPGE_NEON_MUL(a, c) vmull_n_s16(vmovn_s32(a), c)
+
+    static void DCT2D_neon(int32 *p)
+    {
+        int32x4_t v[8][2];
+        for (int i = 0; i < 8; i++)
+        {
+            v[i][0] = vld1q_s32(p + i * 8);
+            v[i][1] = vld1q_s32(p + i * 8 + 4);
+        }
+        // Each pass transposes the block as four 4x4 quadrants and runs DCT1D across the vectors, so the
+        // row pass leaves the block transposed and the column pass puts it back in order.
+        for (int pass = 0; pass < 2; pass++)
+        {
+            int32x4_t t[8][2];
+            for (int r = 0; r < 8; r += 4)
+                for (int h = 0; h < 2; h++)
+                {
+                    const int32x4x2_t a = vtrnq_s32(v[r][h], v[r + 1][h]), b = vtrnq_s32(v[r + 2][h], v[r + 3][h]);
+                    t[h * 4 + 0][r >> 2] = vcombine_s32(vget_low_s32(a.val[0]), vget_low_s32(b.val[0]));
+                    t[h * 4 + 1][r >> 2] = vcombine_s32(vget_low_s32(a.val[1]), vget_low_s32(b.val[1]));
+                    t[h * 4 + 2][r >> 2] = vcombine_s32(vget_high_s32(a.val[0]), vget_high_s32(b.val[0]));
+                    t[h * 4 + 3][r >> 2] = vcombine_s32(vget_high_s32(a.val[1]), vget_high_s32(b.val[1]));
+                }
+            for (int h = 0; h < 2; h++)
+            {
+                int32x4_t s0 = t[0][h], s1 = t[1][h], s2 = t[2][h], s3 = t[3][h], s4 = t[4][h], s5 = t[5][h], s6 = t[6][h], s7 = t[7][h];
+                JPGE_DCT1D_SIMD(int32x4_t, vaddq_s32, vsubq_s32, JPGE_NEON_MUL, s0, s1, s2, s3, s4, s5, s6, s7);
+                if (pass == 0)
+                {
+                    v[0][h] = vshlq_n_s32(s0, ROW_BITS);
+                    v[1][h] = vrshrq_n_s32(s1, CONST_BITS - ROW_BITS);
+                    v[2][h] = vrshrq_n_s32(s2, CONST_BITS - ROW_BITS);
+                    v[3][h] = vrshrq_n_s32(s3, CONST_BITS - ROW_BITS);
+                    v[4][h] = vshlq_n_s32(s4, ROW_BITS);
+                    v[5][h] = vrshrq_n_s32(s5, CONST_BITS - ROW_BITS);
+                    v[6][h] = vrshrq_n_s32(s6, CONST_BITS - ROW_BITS);
+                    v[7][h] = vrshrq_n_s32(s7, CONST_BITS - ROW_BITS);
+                }
+                else
+                {
+                    v[0][h] = vrshrq_n_s32(s0, ROW_BITS + 3);
+                    v[1][h] = vrshrq_n_s32(s1, CONST_BITS + ROW_BITS + 3);
+                    v[2][h] = vrshrq_n_s32(s2, CONST_BITS + ROW_BITS + 3);
+                    v[3][h] = vrshrq_n_s32(s3, CONST_BITS + ROW_BITS + 3);
+                    v[4][h] = vrshrq_n_s32(s4, ROW_BITS + 3);
+                    v[5][h] = vrshrq_n_s32(s5, CONST_BITS + ROW_BITS + 3);
+                    v[6][h] = vrshrq_n_s32(s6, CONST_BITS + ROW_BITS + 3);
+                    v[7][h] = vrshrq_n_s32(s7, CONST_BITS + ROW_BITS + 3);
+                }
+            }
+        }
+        for (int i = 0; i < 8; i++)
+        {
+            vst1q_s32(p + i * 8, v[i][0]);
+            vst1q_s32(p + i * 8 + 4, v[i][1]);
+        }
+    }
+
+#if defined(__aarch64__)
+    static void quantize_neon(const int32 *pSrc, const int32 *pQ, int16 *pDst)
+    {
+        int16 coeffs[64];
+        for (int i = 0; i < 64; i += 4)
+        {
+            const int32x4_t x = vld1q_s32(pSrc + i), q = vld1q_s32(pQ + i);
+            const int32x4_t a = vaddq_s32(vabsq_s32(x), vshrq_n_s32(q, 1));
+            const int32x4_t r = vcvtq_s32_f32(vdivq_f32(vcvtq_f32_s32(a), vcvtq_f32_s32(q)));
+            vst1_s16(coeffs + i, vmovn_s32(vbslq_s32(vcltq_s32(x, vdupq_n_s32(0)), vnegq_s32(r), r)));
+        }
+        for (int i = 0; i < 64; i++)
+            pDst[i] = coeffs[s_zag[i]];
+    }
+#endif
+
+    static inline uint16x4_t rgb_to_y4_neon(uint16x4_t r, uint16x4_t g, uint16x4_t b)
+    {
+        return vrshrn_n_u32(vmlal_n_u16(vmlal_n_u16(vmull_n_u16(r, YR), g, YG), b, YB), 16);
+    }
+
+    // (a * ca + b * cb + (c << 15) + 32768) >> 16, i.e. Cb or Cr before the 128 offset.
+    static inline int16x4_t rgb_to_c4_neon(int16x4_t a, int16x4_t b, int16x4_t c, int16 ca, int16 cb)
+    {
+        return vrshrn_n_s32(vaddq_s32(vmlal_n_s16(vmull_n_s16(a, ca), b, cb), vshll_n_s16(c, 15)), 16);
+    }
+
+    static void RGB_to_Y_neon(uint8 *pDst, const uint8 *pSrc, int num_pixels)
+    {
+        for (; num_pixels >= 8; pDst += 8, pSrc += 24, num_pixels -= 8)
+        {
+            const uint8x8x3_t rgb = vld3_u8(pSrc);
+            const uint16x8_t r = vmovl_u8(rgb.val[0]), g = vmovl_u8(rgb.val[1]), b = vmovl_u8(rgb.val[2]);
+            const uint16x8_t y = vcombine_u16(rgb_to_y4_neon(vget_low_u16(r), vget_low_u16(g), vget_low_u16(b)),
+                                              rgb_to_y4_neon(vget_high_u16(r), vget_high_u16(g), vget_high_u16(b)));
+            vst1_u8(pDst, vmovn_u16(y));
+        }
+        RGB_to_Y(pDst, pSrc, num_pixels);
+    }
+
+    static void RGB_to_YCC_neon(uint8 *pDst, const uint8 *pSrc, int num_pixels)
+    {
+        const int16x8_t k = vdupq_n_s16(128);
+        for (; num_pixels >= 8; pDst += 24, pSrc += 24, num_pixels -= 8)
+        {
+            const uint8x8x3_t rgb = vld3_u8(pSrc);
+            const uint16x8_t r = vmovl_u8(rgb.val[0]), g = vmovl_u8(rgb.val[1]), b = vmovl_u8(rgb.val[2]);
+            const int16x4_t r_lo = vreinterpret_s16_u16(vget_low_u16(r)), r_hi = vreinterpret_s16_u16(vget_high_u16(r));
+            const int16x4_t g_lo = vreinterpret_s16_u16(vget_low_u16(g)), g_hi = vreinterpret_s16_u16(vget_high_u16(g));
+            const int16x4_t b_lo = vreinterpret_s16_u16(vget_low_u16(b)), b_hi = vreinterpret_s16_u16(vget_high_u16(b));
+            uint8x8x3_t ycc;
+            ycc.val[0] = vmovn_u16(vcombine_u16(rgb_to_y4_neon(vget_low_u16(r), vget_low_u16(g), vget_low_u16(b)),
+                                                rgb_to_y4_neon(vget_high_u16(r), vget_high_u16(g), vget_high_u16(b))));
+            // vqmovun clamps Cb and Cr to 0..255 exactly like clamp().
+            ycc.val[1] = vqmovun_s16(vaddq_s16(vcombine_s16(rgb_to_c4_neon(r_lo, g_lo, b_lo, CB_R, CB_G), rgb_to_c4_neon(r_hi, g_hi, b_hi, CB_R, CB_G)), k));
+            ycc.val[2] = vqmovun_s16(vaddq_s16(vcombine_s16(rgb_to_c4_neon(g_lo, b_lo, r_lo, CR_G, CR_B), rgb_to_c4_neon(g_hi, b_hi, r_hi, CR_G, CR_B)), k));
+            vst3_u8(pDst, ycc);
+        }
+        RGB_to_YCC(pDst, pSrc, num_pixels);
+    }
+#endif // JPGE_NEON
+
+    static simd_kernels select_simd_kernels()
+    {
+        simd_kernels k = {DCT2D, NULL, RGB_to_Y, RGB_to_YCC};
+#if defined(JPGE_SSE2)
+        k.m_dct = DCT2D_sse2;
+        k.m_quantize = quantize_sse2;
+#if defined(JPGE_AVX2)
+        if (__builtin_cpu_supports("avx2"))
+        {
+            k.m_dct = DCT2D_avx2;
+            k.m_quantize = quantize_avx2;
+            k.m_rgb_to_y = RGB_to_Y_avx2;
+            k.m_rgb_to_ycc = RGB_to_YCC_avx2;
+        }
+#endif
+#elif defined(JPGE_NEON)
+        k.m_dct = DCT2D_neon;
+#if defined(__aarch64__)
+        k.m_quantize = quantize_neon;
+#endif
+        k.m_rgb_to_y = RGB_to_Y_neon;
+        k.m_rgb_to_ycc = RGB_to_YCC_neon;
+#endif
+        return k;
+    }
+
+    static const simd_kernels &get_simd_kernels()
+    {
+        static const simd_kernels s_kernels = select_simd_kernels();
+        return s_kernels;
+    }
+
     struct sym_freq
     {
         uint m_key, m_sym_index;
@@ -485,6 +962,14 @@ namespace jpge
         emit_byte(0);
     }
 
+    // Emit define restart interval marker
+    void jpeg_encoder::emit_dri()
+    {
+        emit_marker(M_DRI);
+        emit_word(4);
+        emit_word(m_params.m_restart_interval);
+    }
+
     // Emit all markers at beginning of image file.
     void jpeg_encoder::emit_markers()
     {
@@ -493,6 +978,8 @@ namespace jpge
         emit_dqt();
         emit_sof();
         emit_dhts();
+        if (m_params.m_restart_interval)
+            emit_dri();
         emit_sos();
     }
 
@@ -557,19 +1044,26 @@ namespace jpge
         memset(m_last_dc_val, 0, 3 * sizeof(m_last_dc_val[0]));
         m_mcu_y_ofs = 0;
         m_pass_num = 1;
+        m_restart_mcus_left = m_params.m_restart_interval;
+        m_restart_num = 0;
     }
 
     bool jpeg_encoder::second_pass_init()
     {
-        compute_huffman_table(&m_huff_codes[0 + 0][0], &m_huff_code_sizes[0 + 0][0], m_huff_bits[0 + 0], m_huff_val[0 + 0]);
-        compute_huffman_table(&m_huff_codes[2 + 0][0], &m_huff_code_sizes[2 + 0][0], m_huff_bits[2 + 0], m_huff_val[2 + 0]);
-        if (m_num_components > 1)
+        // one pass encoding uses the standard tables computed in jpg_open()
+        if (m_params.m_two_pass_flag)
         {
-            compute_huffman_table(&m_huff_codes[0 + 1][0], &m_huff_code_sizes[0 + 1][0], m_huff_bits[0 + 1], m_huff_val[0 + 1]);
-            compute_huffman_table(&m_huff_codes[2 + 1][0], &m_huff_code_sizes[2 + 1][0], m_huff_bits[2 + 1], m_huff_val[2 + 1]);
+            compute_huffman_table(&m_huff_codes[0 + 0][0], &m_huff_code_sizes[0 + 0][0], m_huff_bits[0 + 0], m_huff_val[0 + 0]);
+            compute_huffman_table(&m_huff_codes[2 + 0][0], &m_huff_code_sizes[2 + 0][0], m_huff_bits[2 + 0], m_huff_val[2 + 0]);
+            if (m_num_components > 1)
+            {
+                compute_huffman_table(&m_huff_codes[0 + 1][0], &m_huff_code_sizes[0 + 1][0], m_huff_bits[0 + 1], m_huff_val[0 + 1]);
+                compute_huffman_table(&m_huff_codes[2 + 1][0], &m_huff_code_sizes[2 + 1][0], m_huff_bits[2 + 1], m_huff_val[2 + 1]);
+            }
         }
         first_pass_init();
-        emit_markers();
+        if (m_emit_headers)
+            emit_markers();
         m_pass_num = 2;
         return true;
     }
@@ -635,32 +1129,58 @@ namespace jpge
         m_image_bpl_mcu = m_image_x_mcu * m_num_components;
         m_mcus_per_row = m_image_x_mcu / m_mcu_x;
 
-        if ((m_mcu_lines[0] = static_cast<uint8 *>(jpge_malloc(m_image_bpl_mcu * m_mcu_y))) == NULL)
-            return false;
+        // the scanline buffer and the tables are kept from the previous image when they still fit
+        uint mcu_lines_size = m_image_bpl_mcu * m_mcu_y;
+        if (mcu_lines_size > m_mcu_lines_size)
+        {
+            jpge_free(m_mcu_lines[0]);
+            m_mcu_lines_size = 0;
+            if ((m_mcu_lines[0] = static_cast<uint8 *>(jpge_malloc(mcu_lines_size))) == NULL)
+                return false;
+            m_mcu_lines_size = mcu_lines_size;
+        }
         for (int i = 1; i < m_mcu_y; i++)
             m_mcu_lines[i] = m_mcu_lines[i - 1] + m_image_bpl_mcu;
 
-        compute_quant_table(m_quantization_tables[0], s_std_lum_quant);
-        compute_quant_table(m_quantization_tables[1], m_params.m_no_chroma_discrim_flag ? s_std_lum_quant : s_std_croma_quant);
+        if ((m_quant_quality != m_params.m_quality) || (m_quant_no_chroma_discrim != m_params.m_no_chroma_discrim_flag))
+        {
+            compute_quant_table(m_quantization_tables[0], s_std_lum_quant);
+            compute_quant_table(m_quantization_tables[1], m_params.m_no_chroma_discrim_flag ? s_std_lum_quant : s_std_croma_quant);
+            for (int i = 0; i < 64; i++)
+            {
+                m_quant_natural[0][s_zag[i]] = m_quantization_tables[0][i];
+                m_quant_natural[1][s_zag[i]] = m_quantization_tables[1][i];
+            }
+            m_quant_quality = m_params.m_quality;
+            m_quant_no_chroma_discrim = m_params.m_no_chroma_discrim_flag;
+        }
 
         m_out_buf_left = JPGE_OUT_BUF_SIZE;
         m_pOut_buf = m_out_buf;
 
         if (m_params.m_two_pass_flag)
         {
+            // the first pass replaces the standard tables with optimized ones
+            m_std_huff_tables = false;
             clear_obj(m_huff_count);
             first_pass_init();
         }
         else
         {
-            memcpy(m_huff_bits[0 + 0], s_dc_lum_bits, 17);
-            memcpy(m_huff_val[0 + 0], s_dc_lum_val, DC_LUM_CODES);
-            memcpy(m_huff_bits[2 + 0], s_ac_lum_bits, 17);
-            memcpy(m_huff_val[2 + 0], s_ac_lum_val, AC_LUM_CODES);
-            memcpy(m_huff_bits[0 + 1], s_dc_chroma_bits, 17);
-            memcpy(m_huff_val[0 + 1], s_dc_chroma_val, DC_CHROMA_CODES);
-            memcpy(m_huff_bits[2 + 1], s_ac_chroma_bits, 17);
-            memcpy(m_huff_val[2 + 1], s_ac_chroma_val, AC_CHROMA_CODES);
+            if (!m_std_huff_tables)
+            {
+                memcpy(m_huff_bits[0 + 0], s_dc_lum_bits, 17);
+                memcpy(m_huff_val[0 + 0], s_dc_lum_val, DC_LUM_CODES);
+                memcpy(m_huff_bits[2 + 0], s_ac_lum_bits, 17);
+                memcpy(m_huff_val[2 + 0], s_ac_lum_val, AC_LUM_CODES);
+                memcpy(m_huff_bits[0 + 1], s_dc_chroma_bits, 17);
+                memcpy(m_huff_val[0 + 1], s_dc_chroma_val, DC_CHROMA_CODES);
+                memcpy(m_huff_bits[2 + 1], s_ac_chroma_bits, 17);
+                memcpy(m_huff_val[2 + 1], s_ac_chroma_val, AC_CHROMA_CODES);
+                for (int i = 0; i < 4; i++)
+                    compute_huffman_table(&m_huff_codes[i][0], &m_huff_code_sizes[i][0], m_huff_bits[i], m_huff_val[i]);
+                m_std_huff_tables = true;
+            }
             if (!second_pass_init())
                 return false; // in effect, skip over the first pass
         }
@@ -751,6 +1271,12 @@ namespace jpge
 
     void jpeg_encoder::load_quantized_coefficients(int component_num)
     {
+        const simd_kernels &kernels = get_simd_kernels();
+        if (kernels.m_quantize)
+        {
+            kernels.m_quantize(m_sample_array, m_quant_natural[component_num > 0], m_coefficient_array);
+            return;
+        }
         int32 *q = m_quantization_tables[component_num > 0];
         int16 *pDst = m_coefficient_array;
         for (int i = 0; i < 64; i++)
@@ -918,9 +1444,32 @@ namespace jpge
             put_bits(codes[1][0], code_sizes[1][0]);
     }
 
+    // Called before every MCU: once the restart interval has passed, byte align the entropy coded data with 1 bits,
+    // write the next RSTn marker and reset the DC predictions.
+    void jpeg_encoder::emit_restart()
+    {
+        if (!m_params.m_restart_interval)
+            return;
+        if (!m_restart_mcus_left)
+        {
+            if (m_pass_num == 2)
+            {
+                put_bits(0x7F, 7);
+                m_bit_buffer = 0;
+                m_bits_in = 0;
+                flush_output_buffer();
+                emit_marker(M_RST0 + (m_restart_num & 7));
+            }
+            m_restart_num++;
+            memset(m_last_dc_val, 0, 3 * sizeof(m_last_dc_val[0]));
+            m_restart_mcus_left = m_params.m_restart_interval;
+        }
+        m_restart_mcus_left--;
+    }
+
     void jpeg_encoder::code_block(int component_num)
     {
-        DCT2D(m_sample_array);
+        get_simd_kernels().m_dct(m_sample_array);
         load_quantized_coefficients(component_num);
         if (m_pass_num == 1)
             code_coefficients_pass_one(component_num);
@@ -934,6 +1483,7 @@ namespace jpge
         {
             for (int i = 0; i < m_mcus_per_row; i++)
             {
+                emit_restart();
                 load_block_8_8_grey(i);
                 code_block(0);
             }
@@ -942,6 +1492,7 @@ namespace jpge
         {
             for (int i = 0; i < m_mcus_per_row; i++)
             {
+                emit_restart();
                 load_block_8_8(i, 0, 0);
                 code_block(0);
                 load_block_8_8(i, 0, 1);
@@ -954,6 +1505,7 @@ namespace jpge
         {
             for (int i = 0; i < m_mcus_per_row; i++)
             {
+                emit_restart();
                 load_block_8_8(i * 2 + 0, 0, 0);
                 code_block(0);
                 load_block_8_8(i * 2 + 1, 0, 0);
@@ -968,6 +1520,7 @@ namespace jpge
         {
             for (int i = 0; i < m_mcus_per_row; i++)
             {
+                emit_restart();
                 load_block_8_8(i * 2 + 0, 0, 0);
                 code_block(0);
                 load_block_8_8(i * 2 + 1, 0, 0);
@@ -1000,7 +1553,8 @@ namespace jpge
     {
         put_bits(0x7F, 7);
         flush_output_buffer();
-        emit_marker(M_EOI);
+        if (m_emit_eoi)
+            emit_marker(M_EOI);
         m_pass_num++; // purposely bump up m_pass_num, for debugging
         return true;
     }
@@ -1035,7 +1589,7 @@ namespace jpge
             if (m_image_bpp == 4)
                 RGBA_to_Y(pDst, Psrc, m_image_x);
             else if (m_image_bpp == 3)
-                RGB_to_Y(pDst, Psrc, m_image_x);
+                get_simd_kernels().m_rgb_to_y(pDst, Psrc, m_image_x);
             else
                 memcpy(pDst, Psrc, m_image_x);
         }
@@ -1044,7 +1598,7 @@ namespace jpge
             if (m_image_bpp == 4)
                 RGBA_to_YCC(pDst, Psrc, m_image_x);
             else if (m_image_bpp == 3)
-                RGB_to_YCC(pDst, Psrc, m_image_x);
+                get_simd_kernels().m_rgb_to_ycc(pDst, Psrc, m_image_x);
             else
                 Y_to_YCC(pDst, Psrc, m_image_x);
         }
@@ -1074,8 +1628,19 @@ namespace jpge
     void jpeg_encoder::clear()
     {
         m_mcu_lines[0] = NULL;
+        m_mcu_lines_size = 0;
+        m_quant_quality = 0;
+        m_quant_no_chroma_discrim = false;
+        m_std_huff_tables = false;
+        reset();
+    }
+
+    void jpeg_encoder::reset()
+    {
         m_pass_num = 0;
         m_all_stream_writes_succeeded = true;
+        m_emit_headers = true;
+        m_emit_eoi = true;
     }
 
     jpeg_encoder::jpeg_encoder()
@@ -1090,11 +1655,20 @@ namespace jpge
 
     bool jpeg_encoder::init(output_stream *pStream, int width, int height, int src_channels, const params &comp_params)
     {
-        deinit();
+        return init_strip(pStream, width, height, src_channels, comp_params, true, true);
+    }
+
+    bool jpeg_encoder::init_strip(output_stream *pStream, int width, int height, int src_channels, const params &comp_params, bool first, bool last)
+    {
+        reset();
         if (((!pStream) || (width < 1) || (height < 1)) || ((src_channels != 1) && (src_channels != 3) && (src_channels != 4)) || (!comp_params.check()))
             return false;
+        if ((!first || !last) && comp_params.m_two_pass_flag)
+            return false;
         m_pStream = pStream;
         m_params = comp_params;
+        m_emit_headers = first;
+        m_emit_eoi = last;
         return jpg_open(width, height, src_channels);
     }
 
@@ -1232,16 +1806,181 @@ namespace jpge
         }
     };
 
-    bool compress_image_to_jpeg_file_in_memory(void *pDstBuf, int &buf_size, int width, int height, int num_channels, const uint8 *pImage_data, const params &comp_params)
+    // Output stream growing on demand, holds one encoded strip.
+    class strip_stream : public output_stream
+    {
+        strip_stream(const strip_stream &);
+        strip_stream &operator=(const strip_stream &);
+
+        uint8 *m_pBuf;
+        uint m_buf_size, m_buf_ofs;
+
+    public:
+        strip_stream() : m_pBuf(NULL), m_buf_size(0), m_buf_ofs(0) {}
+
+        virtual ~strip_stream() { jpge_free(m_pBuf); }
+
+        virtual bool put_buf(const void *pBuf, int len)
+        {
+            if (m_buf_ofs + len > m_buf_size)
+            {
+                uint new_size = JPGE_MAX(m_buf_size * 2, m_buf_ofs + len + 4096);
+                uint8 *pNew_buf = static_cast<uint8 *>(realloc(m_pBuf, new_size));
+                if (!pNew_buf)
+                    return false;
+                m_pBuf = pNew_buf;
+                m_buf_size = new_size;
+            }
+            memcpy(m_pBuf + m_buf_ofs, pBuf, len);
+            m_buf_ofs += len;
+            return true;
+        }
+
+        const uint8 *get_buf() const { return m_pBuf; }
+        uint get_size() const { return m_buf_ofs; }
+
+        // Empties the stream, keeping its buffer.
+        void reset() { m_buf_ofs = 0; }
+    };
+
+    encoder_cache::encoder_cache() : m_pEncoders(NULL), m_pStrips(NULL), m_count(0)
+    {
+    }
+
+    encoder_cache::~encoder_cache()
+    {
+        clear();
+    }
+
+    bool encoder_cache::reserve(int count)
+    {
+        if (count <= m_count)
+            return true;
+        jpeg_encoder **pEncoders = static_cast<jpeg_encoder **>(realloc(m_pEncoders, count * sizeof(jpeg_encoder *)));
+        if (!pEncoders)
+            return false;
+        m_pEncoders = pEncoders;
+        strip_stream **pStrips = static_cast<strip_stream **>(realloc(m_pStrips, count * sizeof(strip_stream *)));
+        if (!pStrips)
+            return false;
+        m_pStrips = pStrips;
+        for (; m_count < count; m_count++)
+        {
+            m_pEncoders[m_count] = new jpeg_encoder;
+            m_pStrips[m_count] = new strip_stream;
+        }
+        return true;
+    }
+
+    void encoder_cache::clear()
+    {
+        for (int i = 0; i < m_count; i++)
+        {
+            delete m_pEncoders[i];
+            delete m_pStrips[i];
+        }
+        jpge_free(m_pEncoders);
+        jpge_free(m_pStrips);
+        m_pEncoders = NULL;
+        m_pStrips = NULL;
+        m_count = 0;
+    }
+
+    // Encodes one strip of MCU rows [first_row, end_row) of the image.
+    static bool compress_strip(jpeg_encoder &dst_image, strip_stream *pStream, int width, int height, int num_channels, const uint8 *pImage_data, const params &comp_params, int first_row, int end_row)
+    {
+        pStream->reset();
+        if (!dst_image.init_strip(pStream, width, height, num_channels, comp_params, first_row == 0, end_row == height))
+            return false;
+        for (int i = first_row; i < end_row; i++)
+        {
+            if (!dst_image.process_scanline(pImage_data + i * width * num_channels))
+                return false;
+        }
+        return dst_image.process_scanline(NULL);
+    }
+
+    static bool compress_image_parallel(memory_stream &dst_stream, encoder_cache &cache, int width, int height, int num_channels, const uint8 *pImage_data, const params &comp_params, int num_threads)
+    {
+        // MCU geometry, see jpeg_encoder::jpg_open()
+        int mcu_x = ((comp_params.m_subsampling == H2V1) || (comp_params.m_subsampling == H2V2)) ? 16 : 8;
+        int mcu_y = (comp_params.m_subsampling == H2V2) ? 16 : 8;
+        int mcus_per_row = (width + mcu_x - 1) / mcu_x;
+        int mcu_rows = (height + mcu_y - 1) / mcu_y;
+
+        // one restart interval per strip, at most 65535 MCUs
+        int strip_mcu_rows = (mcu_rows + num_threads - 1) / num_threads;
+        strip_mcu_rows = JPGE_MIN(strip_mcu_rows, 0xFFFF / mcus_per_row);
+        if (strip_mcu_rows < 1)
+            return false;
+        int num_strips = (mcu_rows + strip_mcu_rows - 1) / strip_mcu_rows;
+        params strip_params(comp_params);
+        strip_params.m_restart_interval = strip_mcu_rows * mcus_per_row;
+
+        if (!cache.reserve(num_strips))
+            return false;
+        std::vector<char> strip_ok(num_strips, 0);
+        std::atomic<int> next_strip(0);
+        auto worker = [&]()
+        {
+            int strip;
+            while ((strip = next_strip++) < num_strips)
+            {
+                int first_row = strip * strip_mcu_rows * mcu_y;
+                int end_row = JPGE_MIN(first_row + strip_mcu_rows * mcu_y, height);
+                strip_ok[strip] = compress_strip(cache.encoder(strip), &cache.strip(strip), width, height, num_channels, pImage_data, strip_params, first_row, end_row);
+            }
+        };
+        std::vector<std::thread> threads;
+        for (int i = 1; i < JPGE_MIN(num_threads, num_strips); i++)
+            threads.push_back(std::thread(worker));
+        worker();
+        for (size_t i = 0; i < threads.size(); i++)
+            threads[i].join();
+
+        // join the strips with RST0..RST7 markers
+        for (int i = 0; i < num_strips; i++)
+        {
+            if (!strip_ok[i])
+                return false;
+            if (i > 0)
+            {
+                uint8 marker[2] = {0xFF, static_cast<uint8>(M_RST0 + ((i - 1) & 7))};
+                if (!dst_stream.put_buf(marker, 2))
+                    return false;
+            }
+            if (!dst_stream.put_buf(cache.strip(i).get_buf(), cache.strip(i).get_size()))
+                return false;
+        }
+        return true;
+    }
+
+    bool compress_image_to_jpeg_file_in_memory(void *pDstBuf, int &buf_size, int width, int height, int num_channels, const uint8 *pImage_data, const params &comp_params, int num_threads, encoder_cache *pCache)
     {
         if ((!pDstBuf) || (!buf_size))
             return false;
 
+        encoder_cache local_cache;
+        encoder_cache &cache = pCache ? *pCache : local_cache;
+
+        if ((num_threads > 1) && (!comp_params.m_two_pass_flag) && (width > 0) && (height > 0))
+        {
+            memory_stream dst_stream(pDstBuf, buf_size);
+            if (compress_image_parallel(dst_stream, cache, width, height, num_channels, pImage_data, comp_params, num_threads))
+            {
+                buf_size = dst_stream.get_size();
+                return true;
+            }
+            printf("%s, %d: Error in parallel compression, retrying on one thread\n", __FILE__, __LINE__);
+        }
+
         memory_stream dst_stream(pDstBuf, buf_size);
 
         buf_size = 0;
 
-        jpge::jpeg_encoder dst_image;
+        if (!cache.reserve(1))
+            return false;
+        jpge::jpeg_encoder &dst_image = cache.encoder(0);
         if (!dst_image.init(&dst_stream, width, height, num_channels, comp_params))
         {
             printf("%s, %d: Error init\n", __FILE__, __LINE__);
@@ -1266,8 +2005,6 @@ namespace jpge
             }
         }
 
-        dst_image.deinit();
-
         buf_size = dst_stream.get_size();
         return true;
     }